@@ -60,6 +60,26 @@ namespace pnet {
         return !operator==(ep);
     }
 
+    size_t Endpoint::hash() const{
+        //FNV-1a over the fields compared by operator==
+        uint64_t hash = 14695981039346656037ull;
+        auto add = [&](const void *ptr, int bytes){
+            for(int i = 0; i < bytes; i++){
+                hash = (hash ^ ((const uint8_t*)ptr)[i]) * 1099511628211ull;
+            }
+        };
+        add(&impl->addr.sin6_family, sizeof(impl->addr.sin6_family));
+        if(impl->addr.sin6_family == AF_INET){
+            struct sockaddr_in *addr = (struct sockaddr_in*)&impl->addr;
+            add(&addr->sin_port, sizeof(addr->sin_port));
+            add(&addr->sin_addr.s_addr, sizeof(addr->sin_addr.s_addr));
+        }else if(impl->addr.sin6_family == AF_INET6){
+            add(&impl->addr.sin6_port, sizeof(impl->addr.sin6_port));
+            add(&impl->addr.sin6_addr, sizeof(impl->addr.sin6_addr));
+        }
+        return hash;
+    }
+
     uint16_t Endpoint::getPort() const{
         struct sockaddr_in *addr = (struct sockaddr_in*)&impl->addr;
         return htons(addr->sin_port);
@@ -71,7 +91,7 @@ namespace pnet {
     }
 
     const char *Endpoint::getAddress() const{
-        static char buf[INET6_ADDRSTRLEN];
+        thread_local char buf[INET6_ADDRSTRLEN];
         if(isv4()){
             return inet_ntop(impl->addr.sin6_family, &((sockaddr_in*)&impl->addr)->sin_addr, buf, sizeof(buf));
         }else{
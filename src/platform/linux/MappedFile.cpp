@@ -0,0 +1,134 @@
+//
+// Copyright (c) 2020 Julian Hinxlage. All rights reserved.
+//
+
+#include "pnet/MappedFile.h"
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstring>
+
+namespace pnet {
+
+    class MappedFile::Impl{
+    public:
+        int fd;
+        char *data;
+        int size;
+
+        Impl(){
+            fd = -1;
+            data = nullptr;
+            size = 0;
+        }
+
+        ~Impl(){
+            close();
+        }
+
+        void unmap(){
+            if(data != nullptr){
+                ::munmap(data, size);
+                data = nullptr;
+            }
+            size = 0;
+        }
+
+        void close(){
+            unmap();
+            if(fd != -1){
+                ::close(fd);
+                fd = -1;
+            }
+        }
+
+        Error map(int bytes){
+            unmap();
+            if(bytes <= 0){
+                return Error();
+            }
+            void *ptr = ::mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+            if(ptr == MAP_FAILED){
+                return Error(ErrorCode::ERROR, strerror(errno));
+            }
+            data = (char*)ptr;
+            size = bytes;
+            return Error();
+        }
+    };
+
+    MappedFile::MappedFile() {
+        impl = std::make_shared<Impl>();
+    }
+
+    Error MappedFile::open(const std::string &path) {
+        impl->close();
+        impl->fd = ::open(path.c_str(), O_RDWR);
+        if(impl->fd == -1){
+            return Error(ErrorCode::ERROR, strerror(errno));
+        }
+        struct stat info;
+        if(::fstat(impl->fd, &info) == -1){
+            Error error(ErrorCode::ERROR, strerror(errno));
+            impl->close();
+            return error;
+        }
+        Error error = impl->map(info.st_size);
+        if(error){
+            impl->close();
+        }
+        return error;
+    }
+
+    Error MappedFile::create(const std::string &path, int size) {
+        impl->close();
+        impl->fd = ::open(path.c_str(), O_RDWR | O_CREAT, 0644);
+        if(impl->fd == -1){
+            return Error(ErrorCode::ERROR, strerror(errno));
+        }
+        Error error = resize(size);
+        if(error){
+            impl->close();
+        }
+        return error;
+    }
+
+    Error MappedFile::resize(int size) {
+        if(impl->fd == -1){
+            return Error("file not open");
+        }
+        impl->unmap();
+        if(::ftruncate(impl->fd, size) == -1){
+            return Error(ErrorCode::ERROR, strerror(errno));
+        }
+        return impl->map(size);
+    }
+
+    Error MappedFile::flush() {
+        if(impl->data != nullptr){
+            if(::msync(impl->data, impl->size, MS_ASYNC) == -1){
+                return Error(ErrorCode::ERROR, strerror(errno));
+            }
+        }
+        return Error();
+    }
+
+    void MappedFile::close() {
+        impl->close();
+    }
+
+    bool MappedFile::isOpen() {
+        return impl->fd != -1;
+    }
+
+    char *MappedFile::data() {
+        return impl->data;
+    }
+
+    int MappedFile::size() {
+        return impl->size;
+    }
+
+}
@@ -6,17 +6,106 @@
 #include <cerrno>
 #include <cstring>
 #include <poll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+#include <chrono>
+#include <mutex>
+#include <atomic>
+#include <thread>
 
 namespace pnet {
 
     class SocketHandler::Impl{
     public:
+        class Timer{
+        public:
+            int id;
+            std::chrono::microseconds interval;
+            std::chrono::steady_clock::time_point next;
+            std::function<void()> callback;
+        };
+
         std::vector<pollfd> pollSet;
         std::vector<std::function<void()>> onPoll;
-        bool running;
+        std::vector<Timer> timers;
+        //timers are added and removed from other threads, callbacks run without it
+        std::mutex timerMutex;
+        int nextTimerId;
+        std::atomic<bool> running;
+        //written by other threads to interrupt poll, so that new timers and stop take effect right away
+        int wakeHandle;
+        std::thread::id loopThread;
 
         Impl(){
             running = false;
+            nextTimerId = 1;
+            wakeHandle = eventfd(0, EFD_NONBLOCK);
+            if(wakeHandle != -1){
+                pollSet.push_back(pollfd{wakeHandle, POLLIN, 0});
+                onPoll.push_back([this](){
+                    uint64_t value = 0;
+                    while(::read(wakeHandle, &value, sizeof(value)) > 0){}
+                });
+            }
+        }
+
+        ~Impl(){
+            if(wakeHandle != -1){
+                ::close(wakeHandle);
+            }
+        }
+
+        void wake(){
+            if(wakeHandle != -1 && std::this_thread::get_id() != loopThread){
+                uint64_t value = 1;
+                (void)!::write(wakeHandle, &value, sizeof(value));
+            }
+        }
+
+        //micro seconds until the next timer is due, at most timeoutMillis
+        int64_t pollTimeout(int timeoutMillis){
+            int64_t timeout = timeoutMillis < 0 ? -1 : timeoutMillis * 1000ll;
+            std::lock_guard<std::mutex> lock(timerMutex);
+            auto now = std::chrono::steady_clock::now();
+            for(auto &timer : timers){
+                int64_t micros = std::chrono::ceil<std::chrono::microseconds>(timer.next - now).count();
+                if(micros < 0){
+                    micros = 0;
+                }
+                if(timeout < 0 || micros < timeout){
+                    timeout = micros;
+                }
+            }
+            return timeout;
+        }
+
+        void runTimers(){
+            auto now = std::chrono::steady_clock::now();
+            std::vector<int> due;
+            {
+                std::lock_guard<std::mutex> lock(timerMutex);
+                for(auto &timer : timers){
+                    if(timer.next <= now){
+                        timer.next = now + timer.interval;
+                        due.push_back(timer.id);
+                    }
+                }
+            }
+            //callbacks may add or remove timers
+            for(int id : due){
+                std::function<void()> callback;
+                {
+                    std::lock_guard<std::mutex> lock(timerMutex);
+                    for(auto &timer : timers){
+                        if(timer.id == id){
+                            callback = timer.callback;
+                        }
+                    }
+                }
+                if(callback){
+                    callback();
+                }
+            }
         }
     };
 
@@ -44,10 +133,41 @@ namespace pnet {
         }
     }
 
+    int SocketHandler::addTimer(int intervalMillis, const std::function<void()> &callback) {
+        return addMicroTimer(intervalMillis * 1000, callback);
+    }
+
+    int SocketHandler::addMicroTimer(int intervalMicros, const std::function<void()> &callback) {
+        Impl::Timer timer;
+        timer.interval = std::chrono::microseconds(intervalMicros);
+        timer.next = std::chrono::steady_clock::now() + timer.interval;
+        timer.callback = callback;
+        {
+            std::lock_guard<std::mutex> lock(impl->timerMutex);
+            timer.id = impl->nextTimerId++;
+            impl->timers.push_back(timer);
+        }
+        impl->wake();
+        return timer.id;
+    }
+
+    void SocketHandler::removeTimer(int id) {
+        std::lock_guard<std::mutex> lock(impl->timerMutex);
+        for(int i = 0; i < impl->timers.size(); i++){
+            if(impl->timers[i].id == id){
+                impl->timers.erase(impl->timers.begin() + i);
+                return;
+            }
+        }
+    }
+
     Error SocketHandler::run(int timeoutMillis) {
         impl->running = true;
+        impl->loopThread = std::this_thread::get_id();
         while(impl->running){
-            int code = ::poll(impl->pollSet.data(), impl->pollSet.size(), timeoutMillis);
+            int64_t micros = impl->pollTimeout(timeoutMillis);
+            timespec timeout{(time_t)(micros / 1000000), (long)(micros % 1000000) * 1000};
+            int code = ::ppoll(impl->pollSet.data(), impl->pollSet.size(), micros < 0 ? nullptr : &timeout, nullptr);
             switch(code){
                 case -1:
                     impl->running = false;
@@ -64,12 +184,14 @@ namespace pnet {
                         }
                     }
             }
+            impl->runTimers();
         }
         return Error();
     }
 
     void SocketHandler::stop() {
         impl->running = false;
+        impl->wake();
     }
 
 }
@@ -5,48 +5,68 @@
 #ifndef SOCKET_BLOB_H
 #define SOCKET_BLOB_H
 
+#include <cstdint>
+#include <cstring>
+#include <bit>
+#include <type_traits>
+#if defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
 namespace pnet {
 
     //blob of memory with logic and bitwise operators
+    //the blob is a little endian unsigned integer, data[bytes-1] is the most significant byte
+    //operations work on 64 bit words at runtime and on bytes in constant evaluation
     template<int bytes>
     class Blob {
     public:
+        static constexpr int bits = bytes * 8;
         unsigned char data[bytes];
 
-        Blob(){
-            for(int i = 0; i < bytes; i++){
-                data[i] = 0;
-            }
-        }
+        constexpr Blob() : data{} {}
 
-        Blob(const Blob &blob){
-            operator=(blob);
-        }
+        constexpr Blob(const Blob &blob) = default;
 
         template<typename T>
-        Blob(const T &t){
+        constexpr Blob(const T &t) : data{} {
             operator=(t);
         }
 
-        Blob &operator=(const Blob &blob){
-            for(int i = 0; i < bytes; i++){
-                data[i] = blob.data[i];
-            }
-            return *this;
-        }
+        constexpr Blob &operator=(const Blob &blob) = default;
 
         template<typename T>
-        Blob &operator=(const T &t){
-            int size = bytes < (int)sizeof(t) ? bytes : (int)sizeof(t);
-            for(int i = 0; i < size; i++){
-                data[i] = ((char*)&t)[i];
-            }for(int i = size; i < bytes; i++){
+        constexpr Blob &operator=(const T &t){
+            constexpr int size = bytes < (int)sizeof(T) ? bytes : (int)sizeof(T);
+            if constexpr (std::is_integral_v<T>){
+                for(int i = 0; i < size; i++){
+                    data[i] = (unsigned char)((uint64_t)t >> (i * 8));
+                }
+            }else{
+                std::memcpy(data, &t, size);
+            }
+            for(int i = size; i < bytes; i++){
                 data[i] = 0;
             }
             return *this;
         }
 
-        bool operator==(const Blob &blob) const{
+        constexpr bool operator==(const Blob &blob) const{
+            if(!std::is_constant_evaluated()){
+#if defined(__SSE2__)
+                if constexpr (bytes % 16 == 0){
+                    for(int i = 0; i < bytes; i += 16){
+                        __m128i a = _mm_loadu_si128((const __m128i*)(data + i));
+                        __m128i b = _mm_loadu_si128((const __m128i*)(blob.data + i));
+                        if(_mm_movemask_epi8(_mm_cmpeq_epi8(a, b)) != 0xffff){
+                            return false;
+                        }
+                    }
+                    return true;
+                }
+#endif
+                return std::memcmp(data, blob.data, bytes) == 0;
+            }
             for(int i = 0; i < bytes; i++){
                 if(data[i] != blob.data[i]){
                     return false;
@@ -55,124 +75,230 @@ namespace pnet {
             return true;
         }
 
-        bool operator!=(const Blob &blob) const{
+        constexpr bool operator!=(const Blob &blob) const{
             return !operator==(blob);
         }
 
-        bool operator<(const Blob &blob) const{
-            for(int i = bytes-1; i >= 0; i--){
-                if(data[i] < blob.data[i]){
-                    return true;
-                }else if(data[i] > blob.data[i]){
-                    return false;
-                }
-            }
-            return false;
+        constexpr bool operator<(const Blob &blob) const{
+            return compare(blob) < 0;
         }
 
-        bool operator>(const Blob &blob) const{
-            for(int i = bytes-1; i >= 0; i--){
-                if(data[i] > blob.data[i]){
-                    return true;
-                }else if(data[i] < blob.data[i]){
-                    return false;
-                }
-            }
-            return false;
+        constexpr bool operator>(const Blob &blob) const{
+            return compare(blob) > 0;
         }
 
-        bool operator<=(const Blob &blob) const{
-            return !operator>(blob);
+        constexpr bool operator<=(const Blob &blob) const{
+            return compare(blob) <= 0;
         }
 
-        bool operator>=(const Blob &blob) const{
-            return !operator<(blob);
+        constexpr bool operator>=(const Blob &blob) const{
+            return compare(blob) >= 0;
         }
 
-        Blob operator&(const Blob &blob) const{
-            Blob result;
-            for(int i = 0; i < bytes; i++){
-                result.data[i] = data[i] & blob.data[i];
+        //-1, 0 or 1 as unsigned integers
+        constexpr int compare(const Blob &blob) const{
+            for(int i = words - 1; i >= 0; i--){
+                uint64_t a = word(i);
+                uint64_t b = blob.word(i);
+                if(a != b){
+                    return a < b ? -1 : 1;
+                }
             }
+            return 0;
+        }
+
+        constexpr Blob operator&(const Blob &blob) const{
+            Blob result = *this;
+            result &= blob;
             return result;
         }
 
-        Blob operator|(const Blob &blob) const{
-            Blob result;
-            for(int i = 0; i < bytes; i++){
-                result.data[i] = data[i] | blob.data[i];
-            }
+        constexpr Blob operator|(const Blob &blob) const{
+            Blob result = *this;
+            result |= blob;
             return result;
         }
 
-        Blob operator^(const Blob &blob) const{
-            Blob result;
-            for(int i = 0; i < bytes; i++){
-                result.data[i] = data[i] ^ blob.data[i];
-            }
+        constexpr Blob operator^(const Blob &blob) const{
+            Blob result = *this;
+            result ^= blob;
             return result;
         }
 
-        Blob operator~() const{
+        constexpr Blob operator~() const{
             Blob result;
-            for(int i = 0; i < bytes; i++){
-                result.data[i] = ~data[i];
+            for(int i = 0; i < words; i++){
+                result.setWord(i, ~word(i));
             }
             return result;
         }
 
-        Blob &operator&=(const Blob &blob){
-            *this = *this & blob;
+        constexpr Blob &operator&=(const Blob &blob){
+            for(int i = 0; i < words; i++){
+                setWord(i, word(i) & blob.word(i));
+            }
             return *this;
         }
 
-        Blob &operator|=(const Blob &blob){
-            *this = *this | blob;
+        constexpr Blob &operator|=(const Blob &blob){
+            for(int i = 0; i < words; i++){
+                setWord(i, word(i) | blob.word(i));
+            }
             return *this;
         }
 
-        Blob &operator^=(const Blob &blob){
-            *this = *this ^ blob;
+        constexpr Blob &operator^=(const Blob &blob){
+            if(!std::is_constant_evaluated()){
+#if defined(__AVX2__)
+                if constexpr (bytes % 32 == 0){
+                    for(int i = 0; i < bytes; i += 32){
+                        __m256i a = _mm256_loadu_si256((const __m256i*)(data + i));
+                        __m256i b = _mm256_loadu_si256((const __m256i*)(blob.data + i));
+                        _mm256_storeu_si256((__m256i*)(data + i), _mm256_xor_si256(a, b));
+                    }
+                    return *this;
+                }
+#endif
+#if defined(__SSE2__)
+                if constexpr (bytes % 16 == 0){
+                    for(int i = 0; i < bytes; i += 16){
+                        __m128i a = _mm_loadu_si128((const __m128i*)(data + i));
+                        __m128i b = _mm_loadu_si128((const __m128i*)(blob.data + i));
+                        _mm_storeu_si128((__m128i*)(data + i), _mm_xor_si128(a, b));
+                    }
+                    return *this;
+                }
+#endif
+            }
+            for(int i = 0; i < words; i++){
+                setWord(i, word(i) ^ blob.word(i));
+            }
             return *this;
         }
 
-        Blob operator<<(int shift){
+        constexpr Blob operator<<(int shift) const{
             Blob result;
-            int byteShift = shift / 8;
-            int bitShift = shift % 8;
-            for(int i = 0; i < bytes; i++){
-                if(i - byteShift >= 0){
-                    if(bitShift == 0){
-                        result.data[i] = data[i - byteShift];
-                    }else{
-                        result.data[i] = (data[i - byteShift] << bitShift);
-                        if(i - byteShift - 1 >= 0){
-                            result.data[i] |= (data[i - byteShift - 1] >> (8 - bitShift));
-                        }
-                    }
+            if(shift < 0 || shift >= bits){
+                return result;
+            }
+            int wordShift = shift / 64;
+            int bitShift = shift % 64;
+            for(int i = words - 1; i >= wordShift; i--){
+                uint64_t value = word(i - wordShift) << bitShift;
+                if(bitShift != 0 && i - wordShift - 1 >= 0){
+                    value |= word(i - wordShift - 1) >> (64 - bitShift);
                 }
+                result.setWord(i, value);
             }
             return result;
         }
 
-        Blob operator>>(int shift){
+        constexpr Blob operator>>(int shift) const{
             Blob result;
-            int byteShift = shift / 8;
-            int bitShift = shift % 8;
-            for(int i = 0; i < bytes; i++){
-                if(i + byteShift < bytes){
-                    if(bitShift == 0){
-                        result.data[i] = data[i + byteShift];
-                    }else{
-                        result.data[i] = (data[i + byteShift] >> bitShift);
-                        if(i + byteShift + 1 < bytes){
-                            result.data[i] |= (data[i + byteShift + 1] << (8 - bitShift));
-                        }
-                    }
+            if(shift < 0 || shift >= bits){
+                return result;
+            }
+            int wordShift = shift / 64;
+            int bitShift = shift % 64;
+            for(int i = 0; i + wordShift < words; i++){
+                uint64_t value = word(i + wordShift) >> bitShift;
+                if(bitShift != 0 && i + wordShift + 1 < words){
+                    value |= word(i + wordShift + 1) << (64 - bitShift);
                 }
+                result.setWord(i, value);
             }
             return result;
         }
+
+        //number of zero bits above the most significant set bit
+        constexpr int countl_zero() const{
+            for(int i = words - 1; i >= 0; i--){
+                uint64_t value = word(i);
+                if(value != 0){
+                    return (words - 1 - i) * 64 + std::countl_zero(value) - padding;
+                }
+            }
+            return bits;
+        }
+
+        //number of zero bits below the least significant set bit
+        constexpr int countr_zero() const{
+            for(int i = 0; i < words; i++){
+                uint64_t value = word(i);
+                if(value != 0){
+                    return i * 64 + std::countr_zero(value);
+                }
+            }
+            return bits;
+        }
+
+        //index of the most significant set bit, -1 if no bit is set
+        constexpr int highestBit() const{
+            return bits - 1 - countl_zero();
+        }
+
+        //index of the least significant set bit, -1 if no bit is set
+        constexpr int lowestBit() const{
+            int index = countr_zero();
+            return index == bits ? -1 : index;
+        }
+
+        constexpr bool getBit(int index) const{
+            return (data[index / 8] >> (index % 8)) & 1;
+        }
+
+        constexpr void setBit(int index, bool value = true){
+            if(value){
+                data[index / 8] |= (unsigned char)(1 << (index % 8));
+            }else{
+                data[index / 8] &= (unsigned char)~(1 << (index % 8));
+            }
+        }
+
+        constexpr void flipBit(int index){
+            data[index / 8] ^= (unsigned char)(1 << (index % 8));
+        }
+
+        constexpr bool isZero() const{
+            for(int i = 0; i < words; i++){
+                if(word(i) != 0){
+                    return false;
+                }
+            }
+            return true;
+        }
+
+        //64 bit word of the integer, word 0 is the least significant
+        static constexpr int words = (bytes + 7) / 8;
+        //unused high bits of the last word when bytes is not a multiple of 8
+        static constexpr int padding = words * 64 - bits;
+
+        constexpr uint64_t word(int index) const{
+            int begin = index * 8;
+            int size = bytes - begin < 8 ? bytes - begin : 8;
+            if(!std::is_constant_evaluated() && size == 8 && std::endian::native == std::endian::little){
+                uint64_t value;
+                std::memcpy(&value, data + begin, 8);
+                return value;
+            }
+            uint64_t value = 0;
+            for(int i = 0; i < size; i++){
+                value |= (uint64_t)data[begin + i] << (i * 8);
+            }
+            return value;
+        }
+
+        constexpr void setWord(int index, uint64_t value){
+            int begin = index * 8;
+            int size = bytes - begin < 8 ? bytes - begin : 8;
+            if(!std::is_constant_evaluated() && size == 8 && std::endian::native == std::endian::little){
+                std::memcpy(data + begin, &value, 8);
+                return;
+            }
+            for(int i = 0; i < size; i++){
+                data[begin + i] = (unsigned char)(value >> (i * 8));
+            }
+        }
     };
 
 }
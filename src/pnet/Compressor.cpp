@@ -0,0 +1,292 @@
+//
+// Copyright (c) 2020 Julian Hinxlage. All rights reserved.
+//
+
+#include "Compressor.h"
+#include "Schema.h"
+#include <cstring>
+#include <algorithm>
+#include <unordered_map>
+
+namespace pnet {
+
+    static constexpr int minMatch = 4;
+    static constexpr int maxOffset = 65535;
+    static constexpr int hashBits = 12;
+
+    static uint32_t read32(const char *ptr){
+        uint32_t value;
+        std::memcpy(&value, ptr, sizeof(value));
+        return value;
+    }
+
+    static int hash(uint32_t value){
+        return (int)((value * 2654435761u) >> (32 - hashBits));
+    }
+
+    //lengths above 14 continue in the following bytes, each 255 byte adds to the length
+    static void writeLength(std::string &output, int length){
+        while(length >= 255){
+            output.push_back((char)255);
+            length -= 255;
+        }
+        output.push_back((char)length);
+    }
+
+    static const char *readLength(const char *ptr, const char *end, int &length, int limit){
+        uint8_t byte;
+        do{
+            if(ptr >= end){
+                return nullptr;
+            }
+            byte = *ptr++;
+            length += byte;
+            if(length > limit){
+                return nullptr;
+            }
+        }while(byte == 255);
+        return ptr;
+    }
+
+    static void writeSequence(std::string &output, const char *literals, int literalCount, int offset, int matchLength){
+        int matchCode = matchLength == 0 ? 0 : matchLength - minMatch;
+        uint8_t token = (std::min(literalCount, 15) << 4) | std::min(matchCode, 15);
+        output.push_back((char)token);
+        if(literalCount >= 15){
+            writeLength(output, literalCount - 15);
+        }
+        output.append(literals, literalCount);
+        if(matchLength != 0){
+            output.push_back((char)(offset & 0xff));
+            output.push_back((char)(offset >> 8));
+            if(matchCode >= 15){
+                writeLength(output, matchCode - 15);
+            }
+        }
+    }
+
+    Compressor::Compressor() {
+        maxSize = 1024 * 1024;
+        id = 0;
+        dictionaryTable.assign(1 << hashBits, -1);
+    }
+
+    void Compressor::setDictionary(const std::string &dictionary) {
+        //only the last window of the dictionary can be referenced
+        if(dictionary.size() > maxOffset){
+            this->dictionary = dictionary.substr(dictionary.size() - maxOffset);
+        }else{
+            this->dictionary = dictionary;
+        }
+
+        //FNV-1a, 0 is reserved for no dictionary
+        id = 0;
+        if(!this->dictionary.empty()){
+            id = 2166136261u;
+            for(char c : this->dictionary){
+                id = (id ^ (uint8_t)c) * 16777619u;
+            }
+            if(id == 0){
+                id = 1;
+            }
+        }
+
+        dictionaryTable.assign(1 << hashBits, -1);
+        for(int i = 0; i + minMatch <= (int)this->dictionary.size(); i++){
+            dictionaryTable[hash(read32(this->dictionary.data() + i))] = i;
+        }
+    }
+
+    uint32_t Compressor::dictionaryId() const {
+        return id;
+    }
+
+    bool Compressor::compress(const char *ptr, int bytes, std::string &output) const {
+        //window: dictionary followed by the input, positions index into it
+        std::string window;
+        window.reserve(dictionary.size() + bytes);
+        window.append(dictionary);
+        window.append(ptr, bytes);
+        const char *base = window.data();
+        int start = dictionary.size();
+        int end = window.size();
+
+        output.clear();
+        output.reserve(bytes);
+        char header[16];
+        char *headerEnd = writeVarint(header, bytes);
+        std::memcpy(headerEnd, &id, sizeof(id));
+        output.append(header, headerEnd + sizeof(id));
+
+        std::vector<int> table = dictionaryTable;
+        int anchor = start;
+        int i = start;
+        //the last bytes are always literals, so matches never read past the end
+        int matchLimit = end - minMatch;
+        while(i < matchLimit){
+            uint32_t value = read32(base + i);
+            int h = hash(value);
+            int candidate = table[h];
+            table[h] = i;
+            if(candidate < 0 || i - candidate > maxOffset || read32(base + candidate) != value){
+                i++;
+                continue;
+            }
+
+            int length = minMatch;
+            while(i + length < end && base[candidate + length] == base[i + length]){
+                length++;
+            }
+            writeSequence(output, base + anchor, i - anchor, i - candidate, length);
+            if((int)output.size() >= bytes){
+                return false;
+            }
+            i += length;
+            anchor = i;
+        }
+        writeSequence(output, base + anchor, end - anchor, 0, 0);
+        return (int)output.size() < bytes;
+    }
+
+    bool Compressor::decompress(const char *ptr, int bytes, std::string &output) const {
+        const char *end = ptr + bytes;
+        uint64_t size = 0;
+        ptr = readVarint(ptr, end, size);
+        if(ptr == nullptr || size > (uint64_t)maxSize || end - ptr < (int)sizeof(uint32_t)){
+            return false;
+        }
+        if(read32(ptr) != id){
+            return false;
+        }
+        ptr += sizeof(uint32_t);
+
+        output.resize(size);
+        char *out = output.data();
+        int pos = 0;
+        int dictionarySize = dictionary.size();
+        while(ptr < end){
+            uint8_t token = *ptr++;
+
+            int literalCount = token >> 4;
+            if(literalCount == 15){
+                ptr = readLength(ptr, end, literalCount, size - pos);
+                if(ptr == nullptr){
+                    return false;
+                }
+            }
+            if(literalCount > end - ptr || literalCount > (int)size - pos){
+                return false;
+            }
+            std::memcpy(out + pos, ptr, literalCount);
+            ptr += literalCount;
+            pos += literalCount;
+
+            if(ptr == end){
+                //the last sequence has no match
+                break;
+            }
+
+            if(end - ptr < 2){
+                return false;
+            }
+            int offset = (uint8_t)ptr[0] | ((uint8_t)ptr[1] << 8);
+            ptr += 2;
+            int length = token & 15;
+            if(length == 15){
+                ptr = readLength(ptr, end, length, size - pos);
+                if(ptr == nullptr){
+                    return false;
+                }
+            }
+            length += minMatch;
+            if(offset == 0 || offset > pos + dictionarySize || length > (int)size - pos){
+                return false;
+            }
+
+            int source = pos - offset;
+            if(source >= 0 && offset >= length){
+                std::memcpy(out + pos, out + source, length);
+                pos += length;
+            }else{
+                //overlapping or partly in the dictionary
+                for(int i = 0; i < length; i++, source++){
+                    out[pos++] = source < 0 ? dictionary[dictionarySize + source] : out[source];
+                }
+            }
+        }
+        return pos == (int)size;
+    }
+
+    std::string Compressor::train(const std::vector<std::string> &samples, int size) {
+        const int gram = 8;
+        const int segment = 32;
+
+        //number of samples each gram occurs in
+        std::unordered_map<uint64_t, int> counts;
+        for(auto &sample : samples){
+            std::unordered_map<uint64_t, bool> seen;
+            for(int i = 0; i + gram <= (int)sample.size(); i++){
+                uint64_t key;
+                std::memcpy(&key, sample.data() + i, gram);
+                if(!seen[key]){
+                    seen[key] = true;
+                    counts[key]++;
+                }
+            }
+        }
+
+        class Segment{
+        public:
+            int score;
+            const std::string *sample;
+            int offset;
+        };
+        std::vector<Segment> segments;
+        for(auto &sample : samples){
+            for(int i = 0; i + segment <= (int)sample.size(); i += segment / 2){
+                int score = 0;
+                for(int j = i; j + gram <= i + segment; j++){
+                    uint64_t key;
+                    std::memcpy(&key, sample.data() + j, gram);
+                    score += counts[key] - 1;
+                }
+                if(score > 0){
+                    segments.push_back({score, &sample, i});
+                }
+            }
+        }
+        std::stable_sort(segments.begin(), segments.end(), [](const Segment &a, const Segment &b){
+            return a.score > b.score;
+        });
+
+        //skip segments whose grams are all covered already, the best segments go last where offsets are smallest
+        std::vector<std::string> selected;
+        std::unordered_map<uint64_t, bool> covered;
+        int total = 0;
+        for(auto &seg : segments){
+            if(total + segment > size){
+                break;
+            }
+            bool useful = false;
+            for(int j = seg.offset; j + gram <= seg.offset + segment; j++){
+                uint64_t key;
+                std::memcpy(&key, seg.sample->data() + j, gram);
+                if(!covered[key]){
+                    covered[key] = true;
+                    useful = true;
+                }
+            }
+            if(useful){
+                selected.push_back(seg.sample->substr(seg.offset, segment));
+                total += segment;
+            }
+        }
+
+        std::string dictionary;
+        for(int i = selected.size() - 1; i >= 0; i--){
+            dictionary += selected[i];
+        }
+        return dictionary;
+    }
+
+}
@@ -0,0 +1,42 @@
+//
+// Copyright (c) 2020 Julian Hinxlage. All rights reserved.
+//
+
+#ifndef SOCKET_COMPRESSOR_H
+#define SOCKET_COMPRESSOR_H
+
+#include <string>
+#include <vector>
+#include <cstdint>
+
+namespace pnet {
+
+    //LZ77 block compression in the style of LZ4 with an optional shared dictionary
+    //compressed data: varint uncompressed size, 4 byte dictionary id, sequences
+    class Compressor {
+    public:
+        //largest size a payload may decompress to, protects against decompression bombs
+        int maxSize;
+
+        Compressor();
+        //all nodes exchanging compressed data have to use the same dictionary
+        void setDictionary(const std::string &dictionary);
+        //0 when no dictionary is used
+        uint32_t dictionaryId() const;
+        //returns false if the output would not be smaller than the input
+        bool compress(const char *ptr, int bytes, std::string &output) const;
+        //returns false on malformed input, an unknown dictionary or an output larger than maxSize
+        bool decompress(const char *ptr, int bytes, std::string &output) const;
+
+        //build a dictionary of at most size bytes from the most frequent segments in the samples
+        static std::string train(const std::vector<std::string> &samples, int size);
+    private:
+        std::string dictionary;
+        uint32_t id;
+        //hash table of the dictionary positions, copied as the start state of every compression
+        std::vector<int> dictionaryTable;
+    };
+
+}
+
+#endif //SOCKET_COMPRESSOR_H
@@ -6,6 +6,8 @@
 #define SOCKET_ENDPOINT_H
 
 #include <memory>
+#include <functional>
+#include <cstdint>
 
 namespace pnet {
 
@@ -17,6 +19,8 @@ namespace pnet {
         Endpoint &operator=(const Endpoint &ep);
         bool operator==(const Endpoint &ep) const;
         bool operator!=(const Endpoint &ep) const;
+        //consistent with operator==
+        size_t hash() const;
 
         uint16_t getPort() const;
         void setPort(uint16_t port);
@@ -34,4 +38,11 @@ namespace pnet {
 
 }
 
+template<>
+struct std::hash<pnet::Endpoint>{
+    size_t operator()(const pnet::Endpoint &ep) const{
+        return ep.hash();
+    }
+};
+
 #endif //SOCKET_ENDPOINT_H
@@ -0,0 +1,37 @@
+//
+// Copyright (c) 2020 Julian Hinxlage. All rights reserved.
+//
+
+#ifndef SOCKET_MAPPEDFILE_H
+#define SOCKET_MAPPEDFILE_H
+
+#include "Error.h"
+#include <memory>
+#include <string>
+
+namespace pnet {
+
+    //file mapped into memory, writes to data() reach the file without write calls
+    class MappedFile {
+    public:
+        MappedFile();
+        //maps an existing file with its current size
+        Error open(const std::string &path);
+        //maps a file with the given size, the file is created or resized
+        Error create(const std::string &path, int size);
+        //changes the size of an open file, data() may move
+        Error resize(int size);
+        //schedules writing changed pages back to the file without waiting
+        Error flush();
+        void close();
+        bool isOpen();
+        char *data();
+        int size();
+    private:
+        class Impl;
+        std::shared_ptr<Impl> impl;
+    };
+
+}
+
+#endif //SOCKET_MAPPEDFILE_H
@@ -6,9 +6,10 @@
 
 namespace pnet {
 
-    Packet::Packet() {
-        bytes = 0;
-        offset = 0;
+    Packet::Packet(int headroom) {
+        buffer.resize(headroom);
+        bytes = headroom;
+        offset = headroom;
     }
 
     Packet::Packet(const std::vector<char> &buffer, int bytes) {
@@ -29,6 +30,10 @@ namespace pnet {
         return bytes - offset;
     }
 
+    int Packet::headroom() {
+        return offset;
+    }
+
     std::string Packet::getStr(){
         std::string str;
         while(offset < bytes){
@@ -43,31 +48,39 @@ namespace pnet {
     }
 
     void Packet::addStr(const std::string &str){
-        for(int i = 0; i < str.size(); i++){
-            if(buffer.size() > bytes){
-                buffer[bytes++] = str[i];
-            }else{
-                buffer.push_back(str[i]);
-                bytes++;
-            }
-        }
-        if(buffer.size() > bytes){
-            buffer[bytes++] = '\0';
-        }else{
-            buffer.push_back('\0');
-            bytes++;
+        add(str.c_str(), str.size() + 1);
+    }
+
+    void Packet::add(const char *ptr, int bytes) {
+        std::memcpy(extend(bytes), ptr, bytes);
+    }
+
+    void Packet::prepend(const char *ptr, int bytes) {
+        std::memcpy(extendFront(bytes), ptr, bytes);
+    }
+
+    char *Packet::extend(int bytes) {
+        if(buffer.size() < this->bytes + bytes){
+            buffer.resize(this->bytes + bytes);
         }
+        this->bytes += bytes;
+        return buffer.data() + this->bytes - bytes;
     }
 
-    void Packet::add(char *ptr, int bytes) {
-        for(int i = 0; i < bytes; i++){
-            if(buffer.size() > this->bytes){
-                buffer[this->bytes++] = ptr[i];
-            }else{
-                buffer.push_back(ptr[i]);
-                this->bytes++;
-            }
+    char *Packet::extendFront(int bytes) {
+        if(offset < bytes){
+            //not enough headroom, move the data back
+            int grow = bytes - offset;
+            buffer.insert(buffer.begin(), grow, '\0');
+            this->bytes += grow;
+            offset += grow;
         }
+        offset -= bytes;
+        return buffer.data() + offset;
+    }
+
+    void Packet::reserve(int bytes) {
+        buffer.reserve(this->bytes + bytes);
     }
 
     void Packet::skip(int bytes) {
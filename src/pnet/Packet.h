@@ -7,6 +7,7 @@
 
 #include <vector>
 #include <string>
+#include <cstring>
 
 namespace pnet {
 
@@ -16,15 +17,22 @@ namespace pnet {
         int bytes;
         int offset;
 
-        Packet();
+        //headroom: bytes reserved in front of the data for prepending headers
+        Packet(int headroom = 0);
         Packet(const std::vector<char> &buffer, int bytes);
         std::string remaining();
         char *data();
         int size();
+        int headroom();
         std::string getStr();
         void addStr(const std::string &str);
-        void add(char *ptr, int bytes);
+        void add(const char *ptr, int bytes);
+        void prepend(const char *ptr, int bytes);
         void skip(int bytes);
+        void reserve(int bytes);
+        //append/prepend uninitialized bytes and return a pointer to them
+        char *extend(int bytes);
+        char *extendFront(int bytes);
 
         template<typename T>
         T get(){
@@ -37,15 +45,33 @@ namespace pnet {
             return t;
         }
 
+        //bounds checked version of get
+        template<typename T>
+        bool read(T &t){
+            if(size() < (int)sizeof(t)){
+                return false;
+            }
+            std::memcpy(&t, buffer.data() + offset, sizeof(t));
+            offset += sizeof(t);
+            return true;
+        }
+
         template<typename T>
         void add(const T &t){
-            for(int i = 0; i < sizeof(t); i++){
-                if(buffer.size() > bytes){
-                    buffer[bytes++] = ((char*)&t)[i];
-                }else{
-                    buffer.push_back(((char*)&t)[i]);
-                    bytes++;
-                }
+            add((const char*)&t, sizeof(t));
+        }
+
+        //write in front of the current data, without moving the data when there is enough headroom
+        template<typename T>
+        void prepend(const T &t){
+            prepend((const char*)&t, sizeof(t));
+        }
+
+        //overwrite already written bytes at an absolute buffer position
+        template<typename T>
+        void set(int position, const T &t){
+            if(position >= 0 && position + (int)sizeof(t) <= bytes){
+                std::memcpy(buffer.data() + position, &t, sizeof(t));
             }
         }
 
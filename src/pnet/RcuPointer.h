@@ -0,0 +1,129 @@
+//
+// Copyright (c) 2020 Julian Hinxlage. All rights reserved.
+//
+
+#ifndef SOCKET_RCUPOINTER_H
+#define SOCKET_RCUPOINTER_H
+
+#include <atomic>
+#include <memory>
+#include <vector>
+#include <algorithm>
+#include <functional>
+
+namespace pnet {
+
+    //read-copy-update pointer: readers get the current immutable value without locks,
+    //a writer publishes a new value and old ones are deleted when no reader holds them anymore.
+    //readers announce what they hold in hazard pointers, a read only retries if a value is published at the same time
+    template<typename T>
+    class RcuPointer{
+    public:
+        //readers that can hold a value at the same time, further readers wait for a free slot
+        static constexpr int maxReaders = 64;
+
+        //holds a value until destroyed, keep it short lived
+        class Guard{
+        public:
+            Guard(Guard &&guard) noexcept : slot(guard.slot), value(guard.value) {
+                guard.slot = nullptr;
+            }
+            Guard(const Guard &guard) = delete;
+            ~Guard(){
+                if(slot != nullptr){
+                    slot->store(nullptr, std::memory_order_release);
+                }
+            }
+            const T *operator->() const { return value; }
+            const T &operator*() const { return *value; }
+            const T *get() const { return value; }
+        private:
+            friend class RcuPointer;
+            std::atomic<const T*> *slot;
+            const T *value;
+            Guard(std::atomic<const T*> *slot, const T *value) : slot(slot), value(value) {}
+        };
+
+        RcuPointer() : current(new T()) {
+            for(auto &hazard : hazards){
+                hazard.store(nullptr);
+            }
+        }
+
+        ~RcuPointer(){
+            delete current.load();
+            for(auto value : retired){
+                delete value;
+            }
+        }
+
+        RcuPointer(const RcuPointer &pointer) = delete;
+        RcuPointer &operator=(const RcuPointer &pointer) = delete;
+
+        Guard read() const {
+            //start at a slot depending on the thread, so threads rarely compete for one
+            thread_local int hint = std::hash<const void*>()(&hint) % maxReaders;
+            std::atomic<const T*> *slot = nullptr;
+            for(int i = hint;; i = (i + 1) % maxReaders){
+                const T *expected = nullptr;
+                if(hazards[i].compare_exchange_weak(expected, reserved())){
+                    slot = &hazards[i];
+                    hint = i;
+                    break;
+                }
+            }
+            const T *value = current.load();
+            while(true){
+                slot->store(value);
+                //the writer may have retired the value before the hazard was visible
+                const T *check = current.load();
+                if(check == value){
+                    return Guard(slot, value);
+                }
+                value = check;
+            }
+        }
+
+        //writers have to be serialized by the caller
+        void publish(std::unique_ptr<T> value){
+            retired.push_back(current.exchange(value.release()));
+            reclaim();
+        }
+
+        //retired values still held by readers
+        int pending() const {
+            return retired.size();
+        }
+
+    private:
+        std::atomic<const T*> current;
+        mutable std::atomic<const T*> hazards[maxReaders];
+        std::vector<const T*> retired;
+
+        //marks a claimed slot before the value is known
+        const T *reserved() const {
+            return reinterpret_cast<const T*>(&hazards);
+        }
+
+        void reclaim(){
+            std::vector<const T*> held;
+            for(auto &hazard : hazards){
+                const T *value = hazard.load();
+                if(value != nullptr && value != reserved()){
+                    held.push_back(value);
+                }
+            }
+            for(size_t i = 0; i < retired.size(); i++){
+                if(std::find(held.begin(), held.end(), retired[i]) == held.end()){
+                    delete retired[i];
+                    retired[i] = retired.back();
+                    retired.pop_back();
+                    i--;
+                }
+            }
+        }
+    };
+
+}
+
+#endif //SOCKET_RCUPOINTER_H
@@ -0,0 +1,39 @@
+//
+// Copyright (c) 2020 Julian Hinxlage. All rights reserved.
+//
+
+#include "Schema.h"
+
+namespace pnet {
+
+    int varintSize(uint64_t value) {
+        int size = 1;
+        while(value >= 0x80){
+            value >>= 7;
+            size++;
+        }
+        return size;
+    }
+
+    char *writeVarint(char *ptr, uint64_t value) {
+        while(value >= 0x80){
+            *ptr++ = (char)(value | 0x80);
+            value >>= 7;
+        }
+        *ptr++ = (char)value;
+        return ptr;
+    }
+
+    const char *readVarint(const char *ptr, const char *end, uint64_t &value) {
+        value = 0;
+        for(int shift = 0; shift < 64 && ptr < end; shift += 7){
+            uint8_t byte = *ptr++;
+            value |= (uint64_t)(byte & 0x7f) << shift;
+            if((byte & 0x80) == 0){
+                return ptr;
+            }
+        }
+        return nullptr;
+    }
+
+}
@@ -0,0 +1,338 @@
+//
+// Copyright (c) 2020 Julian Hinxlage. All rights reserved.
+//
+
+#ifndef SOCKET_SCHEMA_H
+#define SOCKET_SCHEMA_H
+
+#include "Packet.h"
+#include <tuple>
+#include <string>
+#include <string_view>
+#include <cstring>
+#include <cstdint>
+#include <type_traits>
+#include <limits>
+
+namespace pnet {
+
+    enum WireFormat{
+        //fixed size integers, NUL terminated strings
+        WIRE_V1 = 1,
+        //LEB128 varint integers, length prefixed strings
+        WIRE_V2 = 2,
+    };
+
+    //values that are serialized as their raw memory
+    template<typename T>
+    class IsRaw : public std::is_trivially_copyable<T>{};
+
+    //integers that are serialized as varints
+    template<typename T, WireFormat format>
+    class IsVarint : public std::bool_constant<format == WIRE_V2 && std::is_integral_v<T> && !std::is_same_v<T, bool> && (sizeof(T) > 1)>{};
+
+    int varintSize(uint64_t value);
+    char *writeVarint(char *ptr, uint64_t value);
+    //returns nullptr if the buffer ends before the varint or the varint is longer than 64 bits
+    const char *readVarint(const char *ptr, const char *end, uint64_t &value);
+
+    //serialization of a single field
+    template<typename T, WireFormat format, typename Enable = void>
+    class FieldCodec;
+
+    template<typename T, WireFormat format>
+    class FieldCodec<T, format, std::enable_if_t<IsRaw<T>::value && !IsVarint<T, format>::value>>{
+    public:
+        static constexpr bool fixed = true;
+        static constexpr int minSize = sizeof(T);
+
+        static int size(const T &){
+            return sizeof(T);
+        }
+
+        static char *write(char *ptr, const T &t){
+            std::memcpy(ptr, &t, sizeof(T));
+            return ptr + sizeof(T);
+        }
+
+        static const char *read(const char *ptr, const char *end, T &t){
+            if(end - ptr < (int)sizeof(T)){
+                return nullptr;
+            }
+            return readUnchecked(ptr, t);
+        }
+
+        static const char *readUnchecked(const char *ptr, T &t){
+            std::memcpy(&t, ptr, sizeof(T));
+            return ptr + sizeof(T);
+        }
+    };
+
+    //signed integers are zigzag encoded
+    template<typename T, WireFormat format>
+    class FieldCodec<T, format, std::enable_if_t<IsVarint<T, format>::value>>{
+    public:
+        static constexpr bool fixed = false;
+        static constexpr int minSize = 1;
+
+        static uint64_t encode(T t){
+            if constexpr (std::is_signed_v<T>){
+                return ((uint64_t)t << 1) ^ (uint64_t)(t < 0 ? -1 : 0);
+            }else{
+                return (uint64_t)t;
+            }
+        }
+
+        static int size(const T &t){
+            return varintSize(encode(t));
+        }
+
+        static char *write(char *ptr, const T &t){
+            return writeVarint(ptr, encode(t));
+        }
+
+        static const char *read(const char *ptr, const char *end, T &t){
+            uint64_t value = 0;
+            ptr = readVarint(ptr, end, value);
+            if(ptr == nullptr){
+                return nullptr;
+            }
+            if constexpr (std::is_signed_v<T>){
+                int64_t decoded = (int64_t)(value >> 1) ^ -(int64_t)(value & 1);
+                if(decoded < std::numeric_limits<T>::min() || decoded > std::numeric_limits<T>::max()){
+                    return nullptr;
+                }
+                t = (T)decoded;
+            }else{
+                if(value > std::numeric_limits<T>::max()){
+                    return nullptr;
+                }
+                t = (T)value;
+            }
+            return ptr;
+        }
+    };
+
+    //strings are NUL terminated
+    template<>
+    class FieldCodec<std::string, WIRE_V1>{
+    public:
+        static constexpr bool fixed = false;
+        static constexpr int minSize = 1;
+
+        static int size(const std::string &str){
+            return str.size() + 1;
+        }
+
+        static char *write(char *ptr, const std::string &str){
+            std::memcpy(ptr, str.c_str(), str.size() + 1);
+            return ptr + str.size() + 1;
+        }
+
+        static const char *read(const char *ptr, const char *end, std::string &str){
+            const char *terminator = (const char*)std::memchr(ptr, '\0', end - ptr);
+            if(terminator == nullptr){
+                return nullptr;
+            }
+            str.assign(ptr, terminator);
+            return terminator + 1;
+        }
+    };
+
+    //strings are prefixed with their length
+    template<>
+    class FieldCodec<std::string, WIRE_V2>{
+    public:
+        static constexpr bool fixed = false;
+        static constexpr int minSize = 1;
+
+        static int size(const std::string &str){
+            return varintSize(str.size()) + str.size();
+        }
+
+        static char *write(char *ptr, const std::string &str){
+            ptr = writeVarint(ptr, str.size());
+            std::memcpy(ptr, str.data(), str.size());
+            return ptr + str.size();
+        }
+
+        static const char *read(const char *ptr, const char *end, std::string &str){
+            uint64_t length = 0;
+            ptr = readVarint(ptr, end, length);
+            if(ptr == nullptr || length > (uint64_t)(end - ptr)){
+                return nullptr;
+            }
+            str.assign(ptr, length);
+            return ptr + length;
+        }
+    };
+
+    //views are read in place, they point into the packet and are valid as long as its buffer,
+    //the same encoding as std::string, a WIRE_V1 view can not contain NUL
+    template<>
+    class FieldCodec<std::string_view, WIRE_V1>{
+    public:
+        static constexpr bool fixed = false;
+        static constexpr int minSize = 1;
+
+        static int size(const std::string_view &str){
+            return str.size() + 1;
+        }
+
+        static char *write(char *ptr, const std::string_view &str){
+            std::memcpy(ptr, str.data(), str.size());
+            ptr[str.size()] = '\0';
+            return ptr + str.size() + 1;
+        }
+
+        static const char *read(const char *ptr, const char *end, std::string_view &str){
+            const char *terminator = (const char*)std::memchr(ptr, '\0', end - ptr);
+            if(terminator == nullptr){
+                return nullptr;
+            }
+            str = std::string_view(ptr, terminator - ptr);
+            return terminator + 1;
+        }
+    };
+
+    template<>
+    class FieldCodec<std::string_view, WIRE_V2>{
+    public:
+        static constexpr bool fixed = false;
+        static constexpr int minSize = 1;
+
+        static int size(const std::string_view &str){
+            return varintSize(str.size()) + str.size();
+        }
+
+        static char *write(char *ptr, const std::string_view &str){
+            ptr = writeVarint(ptr, str.size());
+            std::memcpy(ptr, str.data(), str.size());
+            return ptr + str.size();
+        }
+
+        static const char *read(const char *ptr, const char *end, std::string_view &str){
+            uint64_t length = 0;
+            ptr = readVarint(ptr, end, length);
+            if(ptr == nullptr || length > (uint64_t)(end - ptr)){
+                return nullptr;
+            }
+            str = std::string_view(ptr, length);
+            return ptr + length;
+        }
+    };
+
+    template<typename T>
+    class MemberType;
+
+    template<typename C, typename T>
+    class MemberType<T C::*>{
+    public:
+        typedef T Type;
+    };
+
+    template<typename Fields, WireFormat format>
+    class FieldList;
+
+    template<typename... M, WireFormat format>
+    class FieldList<std::tuple<M...>, format>{
+    public:
+        static constexpr bool fixed = (FieldCodec<typename MemberType<M>::Type, format>::fixed && ... && true);
+        static constexpr int minSize = (FieldCodec<typename MemberType<M>::Type, format>::minSize + ... + 0);
+    };
+
+    //encode and decode of a message type T, described by a static constexpr function
+    //T::fields() returning a tuple of member pointers in wire order
+    template<typename T>
+    class Schema {
+    public:
+        template<WireFormat format>
+        using Fields = FieldList<decltype(T::fields()), format>;
+
+        //all fields have a fixed size, a message can be read with a single bounds check
+        template<WireFormat format = WIRE_V1>
+        static constexpr bool fixed = Fields<format>::fixed;
+        //the exact size of fixed messages, the lower bound otherwise
+        template<WireFormat format = WIRE_V1>
+        static constexpr int minSize = Fields<format>::minSize;
+
+        template<WireFormat format>
+        static int size(const T &msg){
+            if constexpr (fixed<format>){
+                return minSize<format>;
+            }else{
+                return std::apply([&](auto... member){
+                    return (FieldCodec<typename MemberType<decltype(member)>::Type, format>::size(msg.*member) + ... + 0);
+                }, T::fields());
+            }
+        }
+
+        template<WireFormat format>
+        static char *write(char *ptr, const T &msg){
+            std::apply([&](auto... member){
+                ((ptr = FieldCodec<typename MemberType<decltype(member)>::Type, format>::write(ptr, msg.*member)), ...);
+            }, T::fields());
+            return ptr;
+        }
+
+        //returns nullptr if the buffer is too short or malformed
+        template<WireFormat format>
+        static const char *read(const char *ptr, const char *end, T &msg){
+            if(end - ptr < minSize<format>){
+                return nullptr;
+            }
+            if constexpr (fixed<format>){
+                //bounds are already checked for the whole message
+                std::apply([&](auto... member){
+                    ((ptr = FieldCodec<typename MemberType<decltype(member)>::Type, format>::readUnchecked(ptr, msg.*member)), ...);
+                }, T::fields());
+                return ptr;
+            }else{
+                std::apply([&](auto... member){
+                    ((ptr = ptr ? FieldCodec<typename MemberType<decltype(member)>::Type, format>::read(ptr, end, msg.*member) : nullptr), ...);
+                }, T::fields());
+                return ptr;
+            }
+        }
+
+        static int size(const T &msg, WireFormat format = WIRE_V1){
+            if(format == WIRE_V2){
+                return size<WIRE_V2>(msg);
+            }else{
+                return size<WIRE_V1>(msg);
+            }
+        }
+
+        static char *write(char *ptr, const T &msg, WireFormat format = WIRE_V1){
+            if(format == WIRE_V2){
+                return write<WIRE_V2>(ptr, msg);
+            }else{
+                return write<WIRE_V1>(ptr, msg);
+            }
+        }
+
+        static const char *read(const char *ptr, const char *end, T &msg, WireFormat format = WIRE_V1){
+            if(format == WIRE_V2){
+                return read<WIRE_V2>(ptr, end, msg);
+            }else{
+                return read<WIRE_V1>(ptr, end, msg);
+            }
+        }
+
+        static void write(Packet &packet, const T &msg, WireFormat format = WIRE_V1){
+            write(packet.extend(size(msg, format)), msg, format);
+        }
+
+        static bool read(Packet &packet, T &msg, WireFormat format = WIRE_V1){
+            const char *ptr = read(packet.data(), packet.data() + packet.size(), msg, format);
+            if(ptr == nullptr){
+                return false;
+            }
+            packet.skip(ptr - packet.data());
+            return true;
+        }
+    };
+
+}
+
+#endif //SOCKET_SCHEMA_H
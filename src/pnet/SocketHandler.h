@@ -17,6 +17,12 @@ namespace pnet {
         SocketHandler();
         void add(int handle, const std::function<void()> &callback);
         void remove(int handle);
+        //call the callback every intervalMillis on the handler thread, returns an id for removeTimer,
+        //both can be called from any thread
+        int addTimer(int intervalMillis, const std::function<void()> &callback);
+        //like addTimer with an interval in micro seconds, for deadlines below one millisecond
+        int addMicroTimer(int intervalMicros, const std::function<void()> &callback);
+        void removeTimer(int id);
         Error run(int timeoutMillis = 100);
         void stop();
     private:
@@ -8,6 +8,7 @@
 #include <iostream>
 #include <thread>
 #include <functional>
+#include <memory>
 
 namespace pnet {
 
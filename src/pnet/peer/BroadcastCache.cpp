@@ -0,0 +1,98 @@
+//
+// Copyright (c) 2020 Julian Hinxlage. All rights reserved.
+//
+
+#include "BroadcastCache.h"
+#include <algorithm>
+
+namespace pnet {
+
+    BroadcastCache::BroadcastCache() {
+        current = 0;
+        reset(16384, 30000);
+    }
+
+    void BroadcastCache::reset(int capacity, int windowMillis) {
+        this->capacity = std::max(capacity, 1);
+        generationMillis = std::max(windowMillis / 2, 1);
+        //load factor of at most one half keeps probe sequences short
+        uint64_t size = 1;
+        while(size < (uint64_t)this->capacity * 2){
+            size *= 2;
+        }
+        mask = size - 1;
+        for(auto &table : tables){
+            table.slots.assign(size, 0);
+            table.count = 0;
+            table.created = 0;
+        }
+        current = 0;
+    }
+
+    bool BroadcastCache::insert(const Blob<32> &id, uint64_t nowMillis) {
+        uint64_t value = fingerprint(id);
+        if(tables[0].contains(value, mask) || tables[1].contains(value, mask)){
+            return false;
+        }
+        Table *table = &tables[current];
+        if(table->count == 0){
+            table->created = nowMillis;
+        }else if(table->count >= capacity || nowMillis - table->created >= generationMillis){
+            current ^= 1;
+            table = &tables[current];
+            table->clear(nowMillis);
+        }
+        table->insert(value, mask);
+        return true;
+    }
+
+    bool BroadcastCache::contains(const Blob<32> &id) {
+        uint64_t value = fingerprint(id);
+        return tables[0].contains(value, mask) || tables[1].contains(value, mask);
+    }
+
+    int BroadcastCache::memoryUsage() {
+        return (tables[0].slots.size() + tables[1].slots.size()) * sizeof(uint64_t);
+    }
+
+    //folded and mixed, the low bits select the slot, 0 marks an empty slot
+    uint64_t BroadcastCache::fingerprint(const Blob<32> &id) {
+        uint64_t value = id.word(0) ^ id.word(1) ^ id.word(2) ^ id.word(3);
+        value ^= value >> 30;
+        value *= 0xbf58476d1ce4e5b9ull;
+        value ^= value >> 27;
+        value *= 0x94d049bb133111ebull;
+        value ^= value >> 31;
+        return value == 0 ? 1 : value;
+    }
+
+    bool BroadcastCache::Table::contains(uint64_t fingerprint, uint64_t mask) const {
+        if(count == 0){
+            return false;
+        }
+        for(uint64_t i = fingerprint & mask;; i = (i + 1) & mask){
+            if(slots[i] == fingerprint){
+                return true;
+            }
+            if(slots[i] == 0){
+                return false;
+            }
+        }
+    }
+
+    void BroadcastCache::Table::insert(uint64_t fingerprint, uint64_t mask) {
+        uint64_t i = fingerprint & mask;
+        while(slots[i] != 0){
+            i = (i + 1) & mask;
+        }
+        slots[i] = fingerprint;
+        count++;
+    }
+
+    void BroadcastCache::Table::clear(uint64_t now) {
+        std::fill(slots.begin(), slots.end(), 0);
+        count = 0;
+        created = now;
+    }
+
+}
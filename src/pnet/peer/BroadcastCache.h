@@ -0,0 +1,50 @@
+//
+// Copyright (c) 2020 Julian Hinxlage. All rights reserved.
+//
+
+#ifndef SOCKET_BROADCASTCACHE_H
+#define SOCKET_BROADCASTCACHE_H
+
+#include "pnet/Blob.h"
+#include <vector>
+#include <cstdint>
+
+namespace pnet {
+
+    //fixed memory set of recently seen broadcast ids
+    //two open addressed tables of 64 bit fingerprints, new ids go into the current one,
+    //when it is half a window old or holds capacity ids it replaces the previous one, which is cleared.
+    //ids are remembered for at least half a window unless more than capacity arrive in that time,
+    //two different ids are mistaken for each other with a probability of about 2 * capacity / 2^64
+    class BroadcastCache{
+    public:
+        BroadcastCache();
+        //memory is 2 tables of 2 * capacity (rounded up to a power of two) fingerprints
+        void reset(int capacity, int windowMillis);
+        //returns false if the id was seen within the window
+        bool insert(const Blob<32> &id, uint64_t nowMillis);
+        bool contains(const Blob<32> &id);
+        int memoryUsage();
+    private:
+        class Table{
+        public:
+            std::vector<uint64_t> slots;
+            int count = 0;
+            uint64_t created = 0;
+
+            bool contains(uint64_t fingerprint, uint64_t mask) const;
+            void insert(uint64_t fingerprint, uint64_t mask);
+            void clear(uint64_t now);
+        };
+        Table tables[2];
+        int current;
+        int capacity;
+        uint64_t mask;
+        uint64_t generationMillis;
+
+        static uint64_t fingerprint(const Blob<32> &id);
+    };
+
+}
+
+#endif //SOCKET_BROADCASTCACHE_H
@@ -0,0 +1,203 @@
+//
+// Copyright (c) 2020 Julian Hinxlage. All rights reserved.
+//
+
+#include "Fragmentation.h"
+#include <algorithm>
+
+namespace pnet {
+
+    //ranges requested per message and round, a badly damaged message is repaired over several rounds
+    static constexpr int maxNackRanges = 64;
+
+    FragmentSender::FragmentSender() {
+        timeout = 5000;
+        maxBytes = 64 * 1024 * 1024;
+        nextId = 1;
+        bytes = 0;
+    }
+
+    void FragmentSender::add(const PeerId &destination, std::string &data, bool compressed, int fragmentSize, uint64_t nowMillis) {
+        expire(nowMillis);
+        Message &msg = messages[nextId++];
+        msg.destination = destination;
+        msg.compressed = compressed;
+        msg.data.swap(data);
+        msg.fragmentSize = fragmentSize;
+        msg.count = (msg.data.size() + fragmentSize - 1) / fragmentSize;
+        msg.queued.assign(msg.count, true);
+        for(uint32_t i = 0; i < msg.count; i++){
+            msg.queue.push_back(i);
+        }
+        msg.time = nowMillis;
+        bytes += msg.data.size();
+        while(bytes > maxBytes && messages.size() > 1){
+            bytes -= messages.begin()->second.data.size();
+            messages.erase(messages.begin());
+        }
+    }
+
+    void FragmentSender::nack(const PeerId &source, uint32_t messageId, uint32_t first, uint32_t count, uint64_t nowMillis) {
+        auto entry = messages.find(messageId);
+        if(entry == messages.end() || entry->second.destination != source){
+            return;
+        }
+        Message &msg = entry->second;
+        msg.time = nowMillis;
+        for(uint32_t i = first; i < msg.count && i - first < count; i++){
+            if(!msg.queued[i]){
+                msg.queued[i] = true;
+                msg.queue.push_back(i);
+            }
+        }
+    }
+
+    std::vector<Fragment> FragmentSender::next(int burst, uint64_t nowMillis) {
+        std::vector<Fragment> result;
+        //oldest messages first
+        for(auto &entry : messages){
+            Message &msg = entry.second;
+            while((int)result.size() < burst && !msg.queue.empty()){
+                uint32_t index = msg.queue.front();
+                msg.queue.pop_front();
+                msg.queued[index] = false;
+                msg.time = nowMillis;
+                result.push_back({msg.destination, entry.first, index, msg.count, msg.compressed,
+                    msg.data.substr((size_t)index * msg.fragmentSize, msg.fragmentSize)});
+            }
+        }
+        return result;
+    }
+
+    bool FragmentSender::pending() {
+        for(auto &entry : messages){
+            if(!entry.second.queue.empty()){
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void FragmentSender::expire(uint64_t nowMillis) {
+        for(auto entry = messages.begin(); entry != messages.end();){
+            if(entry->second.queue.empty() && nowMillis - entry->second.time > (uint64_t)timeout){
+                bytes -= entry->second.data.size();
+                entry = messages.erase(entry);
+            }else{
+                entry++;
+            }
+        }
+    }
+
+    FragmentReassembler::FragmentReassembler() {
+        timeout = 5000;
+        repairDelay = 50;
+        maxBytes = 64 * 1024 * 1024;
+        bytes = 0;
+    }
+
+    bool FragmentReassembler::add(const Fragment &fragment, uint64_t nowMillis, std::string &msg, bool &compressed) {
+        Key key(fragment.peer, fragment.messageId);
+        if(fragment.count == 0 || fragment.index >= fragment.count || completed.find(key) != completed.end()){
+            return false;
+        }
+        //fragments of a message have the same size except the last one, which may be shorter
+        bool last = fragment.index == fragment.count - 1;
+        if(!last && fragment.data.size() < minFragmentSize){
+            return false;
+        }
+        auto entry = messages.find(key);
+        if(entry == messages.end()){
+            uint64_t fragmentSize = last ? minFragmentSize : fragment.data.size();
+            if(fragment.count > (uint64_t)maxBytes / fragmentSize + 1){
+                return false;
+            }
+            entry = messages.emplace(key, Message()).first;
+            Message &message = entry->second;
+            message.count = fragment.count;
+            message.received = 0;
+            message.compressed = fragment.compressed;
+            message.fragments.resize(fragment.count);
+            message.present.assign(fragment.count, false);
+            message.nacked = 0;
+            //the strings of the fragments count as well, they are more than the payload of small fragments
+            message.bytes = fragment.count * sizeof(std::string);
+            bytes += message.bytes;
+        }
+        Message &message = entry->second;
+        if(message.count != fragment.count || message.present[fragment.index]){
+            return false;
+        }
+        message.present[fragment.index] = true;
+        message.fragments[fragment.index] = fragment.data;
+        message.received++;
+        message.progress = nowMillis;
+        message.bytes += fragment.data.size();
+        bytes += fragment.data.size();
+
+        if(message.received == message.count){
+            msg.clear();
+            msg.reserve(message.bytes - message.count * sizeof(std::string));
+            for(auto &data : message.fragments){
+                msg += data;
+            }
+            compressed = message.compressed;
+            bytes -= message.bytes;
+            messages.erase(entry);
+            completed[key] = nowMillis;
+            return true;
+        }
+
+        while(bytes > maxBytes){
+            auto oldest = messages.begin();
+            for(auto other = messages.begin(); other != messages.end(); other++){
+                if(other->second.progress < oldest->second.progress){
+                    oldest = other;
+                }
+            }
+            bytes -= oldest->second.bytes;
+            messages.erase(oldest);
+        }
+        return false;
+    }
+
+    std::vector<FragmentReassembler::Nack> FragmentReassembler::poll(uint64_t nowMillis) {
+        std::vector<Nack> result;
+        for(auto entry = messages.begin(); entry != messages.end();){
+            Message &message = entry->second;
+            if(nowMillis - message.progress > (uint64_t)timeout){
+                bytes -= message.bytes;
+                entry = messages.erase(entry);
+                continue;
+            }
+            if(nowMillis - message.progress >= (uint64_t)repairDelay && nowMillis - message.nacked >= (uint64_t)repairDelay){
+                message.nacked = nowMillis;
+                int ranges = 0;
+                for(uint32_t i = 0; i < message.count && ranges < maxNackRanges; i++){
+                    if(!message.present[i]){
+                        uint32_t first = i;
+                        while(i < message.count && !message.present[i]){
+                            i++;
+                        }
+                        result.push_back({entry->first.first, entry->first.second, first, i - first});
+                        ranges++;
+                    }
+                }
+            }
+            entry++;
+        }
+        for(auto entry = completed.begin(); entry != completed.end();){
+            if(nowMillis - entry->second > (uint64_t)timeout){
+                entry = completed.erase(entry);
+            }else{
+                entry++;
+            }
+        }
+        return result;
+    }
+
+    bool FragmentReassembler::empty() {
+        return messages.empty();
+    }
+
+}
@@ -0,0 +1,108 @@
+//
+// Copyright (c) 2020 Julian Hinxlage. All rights reserved.
+//
+
+#ifndef SOCKET_FRAGMENTATION_H
+#define SOCKET_FRAGMENTATION_H
+
+#include "PeerRoutingTable.h"
+#include <string>
+#include <vector>
+#include <deque>
+#include <map>
+
+namespace pnet {
+
+    class Fragment{
+    public:
+        PeerId peer;
+        uint32_t messageId;
+        uint32_t index;
+        uint32_t count;
+        bool compressed;
+        std::string data;
+    };
+
+    //messages split into fragments, sent a burst at a time and kept to answer retransmission requests
+    class FragmentSender{
+    public:
+        //milliseconds a message is kept after its last fragment was sent
+        int timeout;
+        //bytes of all kept messages, the oldest are dropped first
+        int maxBytes;
+
+        FragmentSender();
+        void add(const PeerId &destination, std::string &data, bool compressed, int fragmentSize, uint64_t nowMillis);
+        //queue the fragments first to first + count - 1 again
+        void nack(const PeerId &source, uint32_t messageId, uint32_t first, uint32_t count, uint64_t nowMillis);
+        //up to burst queued fragments
+        std::vector<Fragment> next(int burst, uint64_t nowMillis);
+        bool pending();
+    private:
+        class Message{
+        public:
+            PeerId destination;
+            bool compressed;
+            std::string data;
+            int fragmentSize;
+            uint32_t count;
+            std::deque<uint32_t> queue;
+            std::vector<bool> queued;
+            uint64_t time;
+        };
+        std::map<uint32_t, Message> messages;
+        uint32_t nextId;
+        int bytes;
+
+        void expire(uint64_t nowMillis);
+    };
+
+    //reassembly of fragmented messages with a memory cap and timeouts,
+    //missing fragments are requested again when a message makes no progress
+    class FragmentReassembler{
+    public:
+        //milliseconds without a new fragment until a message is dropped
+        int timeout;
+        //milliseconds without a new fragment until missing ones are requested, and between requests
+        int repairDelay;
+        //bytes of all incomplete messages, the ones without progress for the longest time are dropped first
+        int maxBytes;
+        //bytes fragments other than the last one carry at least, messages are never split into smaller ones
+        static constexpr int minFragmentSize = 64;
+
+        class Nack{
+        public:
+            PeerId source;
+            uint32_t messageId;
+            uint32_t first;
+            uint32_t count;
+        };
+
+        FragmentReassembler();
+        //returns true with the whole message in msg when the last fragment arrived
+        bool add(const Fragment &fragment, uint64_t nowMillis, std::string &msg, bool &compressed);
+        //drop timed out messages, returns the missing ranges of stalled ones
+        std::vector<Nack> poll(uint64_t nowMillis);
+        bool empty();
+    private:
+        class Message{
+        public:
+            uint32_t count;
+            uint32_t received;
+            bool compressed;
+            std::vector<std::string> fragments;
+            std::vector<bool> present;
+            uint64_t progress;
+            uint64_t nacked;
+            int bytes;
+        };
+        typedef std::pair<PeerId, uint32_t> Key;
+        std::map<Key, Message> messages;
+        //finished messages, late duplicates of their fragments are ignored
+        std::map<Key, uint64_t> completed;
+        int bytes;
+    };
+
+}
+
+#endif //SOCKET_FRAGMENTATION_H
@@ -0,0 +1,238 @@
+//
+// Copyright (c) 2020 Julian Hinxlage. All rights reserved.
+//
+
+#include "KeyValueStore.h"
+#include "pnet/Schema.h"
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+
+namespace pnet {
+
+    //log layout: fixed size WIRE_V1 header followed by entries of a size, a checksum and a record in WIRE_V2.
+    //the file is longer than its entries, a size of 0 marks the end
+    class StoreLogHeader{
+    public:
+        static constexpr uint32_t magicValue = 0x564b4e50;
+        static constexpr uint32_t versionValue = 1;
+
+        uint32_t magic;
+        uint32_t version;
+
+        static constexpr auto fields(){
+            return std::make_tuple(&StoreLogHeader::magic, &StoreLogHeader::version);
+        }
+    };
+
+    class StoreLogRecord{
+    public:
+        uint64_t version;
+        uint8_t deleted;
+        std::string_view key;
+        std::string_view value;
+
+        static constexpr auto fields(){
+            return std::make_tuple(&StoreLogRecord::version, &StoreLogRecord::deleted, &StoreLogRecord::key, &StoreLogRecord::value);
+        }
+    };
+
+    static constexpr int headerSize = Schema<StoreLogHeader>::minSize<WIRE_V1>;
+    //size and checksum in front of each record
+    static constexpr int entryHeaderSize = 2 * sizeof(uint32_t);
+    //smaller logs are not compacted
+    static constexpr int minCompactSize = 1024 * 1024;
+
+    static uint32_t checksum(const char *ptr, const char *end){
+        uint32_t hash = 2166136261u;
+        for(; ptr < end; ptr++){
+            hash = (hash ^ (uint8_t)*ptr) * 16777619u;
+        }
+        return hash;
+    }
+
+    static StoreLogRecord logRecord(const std::string &key, const KeyValueStore::Record &record){
+        return StoreLogRecord{record.version, (uint8_t)record.deleted, key, record.value};
+    }
+
+    static int entrySize(const std::string &key, const KeyValueStore::Record &record){
+        return entryHeaderSize + Schema<StoreLogRecord>::size(logRecord(key, record), WIRE_V2);
+    }
+
+    static char *writeEntry(char *ptr, const std::string &key, const KeyValueStore::Record &record){
+        char *begin = ptr + entryHeaderSize;
+        char *end = Schema<StoreLogRecord>::write(begin, logRecord(key, record), WIRE_V2);
+        uint32_t size = end - begin;
+        uint32_t sum = checksum(begin, end);
+        std::memcpy(ptr, &size, sizeof(size));
+        std::memcpy(ptr + sizeof(size), &sum, sizeof(sum));
+        return end;
+    }
+
+    KeyValueStore::KeyValueStore() {
+        logEnd = 0;
+        liveBytes = 0;
+    }
+
+    Error KeyValueStore::open(const std::string &path) {
+        close();
+        records.clear();
+        this->path = path;
+
+        Error error = log.open(path);
+        if(error){
+            //a new log
+            error = log.create(path, headerSize + minCompactSize / 16);
+            if(error){
+                return error;
+            }
+            Schema<StoreLogHeader>::write(log.data(), StoreLogHeader{StoreLogHeader::magicValue, StoreLogHeader::versionValue}, WIRE_V1);
+            logEnd = headerSize;
+            return Error();
+        }
+
+        const char *end = log.data() + log.size();
+        StoreLogHeader header;
+        const char *ptr = Schema<StoreLogHeader>::read(log.data(), end, header, WIRE_V1);
+        if(ptr == nullptr || header.magic != StoreLogHeader::magicValue || header.version != StoreLogHeader::versionValue){
+            log.close();
+            return Error("invalid store log");
+        }
+        //replay up to the first entry that is incomplete or torn by a crash
+        while(end - ptr >= entryHeaderSize){
+            uint32_t size;
+            uint32_t sum;
+            std::memcpy(&size, ptr, sizeof(size));
+            std::memcpy(&sum, ptr + sizeof(size), sizeof(sum));
+            const char *begin = ptr + entryHeaderSize;
+            if(size == 0 || size > end - begin || checksum(begin, begin + size) != sum){
+                break;
+            }
+            StoreLogRecord record;
+            if(Schema<StoreLogRecord>::read(begin, begin + size, record, WIRE_V2) == nullptr){
+                break;
+            }
+            Record &stored = records[std::string(record.key)];
+            if(record.version >= stored.version){
+                stored.value = record.value;
+                stored.version = record.version;
+                stored.deleted = record.deleted;
+            }
+            ptr = begin + size;
+        }
+        logEnd = ptr - log.data();
+        //entries after a torn one are dropped, they must not be read after the next append
+        std::memset(log.data() + logEnd, 0, log.size() - logEnd);
+
+        liveBytes = 0;
+        for(auto &entry : records){
+            liveBytes += entrySize(entry.first, entry.second);
+        }
+        if(logEnd - headerSize > 2 * liveBytes && logEnd > minCompactSize){
+            return compact();
+        }
+        return Error();
+    }
+
+    void KeyValueStore::close() {
+        if(log.isOpen()){
+            log.flush();
+            log.close();
+        }
+        logEnd = 0;
+        liveBytes = 0;
+    }
+
+    bool KeyValueStore::apply(const std::string &key, std::string_view value, uint64_t version, bool deleted) {
+        auto entry = records.find(key);
+        if(entry != records.end() && entry->second.version >= version){
+            return false;
+        }
+        if(entry == records.end()){
+            entry = records.emplace(key, Record()).first;
+        }else if(log.isOpen()){
+            liveBytes -= entrySize(key, entry->second);
+        }
+        Record &record = entry->second;
+        record.value = deleted ? std::string_view() : value;
+        record.version = version;
+        record.deleted = deleted;
+        if(log.isOpen()){
+            Error error = append(key, record);
+            if(error){
+                //keep serving from memory, the log is only needed for a restart
+                log.close();
+            }
+        }
+        return true;
+    }
+
+    KeyValueStore::Record *KeyValueStore::find(const std::string &key) {
+        auto entry = records.find(key);
+        if(entry == records.end()){
+            return nullptr;
+        }
+        return &entry->second;
+    }
+
+    Error KeyValueStore::flush() {
+        if(log.isOpen()){
+            return log.flush();
+        }
+        return Error();
+    }
+
+    int KeyValueStore::logSize() {
+        return log.isOpen() ? logEnd : 0;
+    }
+
+    PeerId KeyValueStore::keyId(std::string_view key) {
+        return hashId(key);
+    }
+
+    Error KeyValueStore::append(const std::string &key, const Record &record) {
+        int size = entrySize(key, record);
+        liveBytes += size;
+        if(logEnd - headerSize > 2 * liveBytes && logEnd > minCompactSize){
+            return compact();
+        }
+        //room for the entry and the end marker
+        if(logEnd + size + entryHeaderSize > log.size()){
+            Error error = log.resize(std::max(log.size() * 2, logEnd + size + entryHeaderSize));
+            if(error){
+                return error;
+            }
+        }
+        logEnd = writeEntry(log.data() + logEnd, key, record) - log.data();
+        return Error();
+    }
+
+    //write the current records to a new file and replace the log with it
+    Error KeyValueStore::compact() {
+        std::string tmpPath = path + ".tmp";
+        MappedFile file;
+        Error error = file.create(tmpPath, headerSize + liveBytes * 3 / 2 + entryHeaderSize);
+        if(error){
+            return error;
+        }
+        Schema<StoreLogHeader>::write(file.data(), StoreLogHeader{StoreLogHeader::magicValue, StoreLogHeader::versionValue}, WIRE_V1);
+        char *ptr = file.data() + headerSize;
+        for(auto &entry : records){
+            ptr = writeEntry(ptr, entry.first, entry.second);
+        }
+        int end = ptr - file.data();
+        file.flush();
+        file.close();
+        if(std::rename(tmpPath.c_str(), path.c_str()) != 0){
+            std::remove(tmpPath.c_str());
+            return Error("could not replace store log");
+        }
+        error = log.open(path);
+        if(error){
+            return error;
+        }
+        logEnd = end;
+        return Error();
+    }
+
+}
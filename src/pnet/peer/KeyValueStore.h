@@ -0,0 +1,59 @@
+//
+// Copyright (c) 2020 Julian Hinxlage. All rights reserved.
+//
+
+#ifndef SOCKET_KEYVALUESTORE_H
+#define SOCKET_KEYVALUESTORE_H
+
+#include "PeerRoutingTable.h"
+#include "pnet/MappedFile.h"
+#include <string>
+#include <string_view>
+#include <unordered_map>
+
+namespace pnet {
+
+    //records of the replicated store kept by one peer, in a hash table and optionally in an append-only log.
+    //the log is a memory mapped file replayed at open, it is rewritten with only the current records
+    //when it grows to twice their size
+    class KeyValueStore{
+    public:
+        class Record{
+        public:
+            std::string value;
+            //a record only replaces one with a lower version, erased records are kept with deleted set
+            uint64_t version = 0;
+            bool deleted = false;
+            //fingerprint of the peers the record was last replicated to, not logged
+            uint64_t placement = 0;
+        };
+
+        std::unordered_map<std::string, Record> records;
+
+        KeyValueStore();
+        //loads the log at path, it is created if missing, and appends later changes to it
+        Error open(const std::string &path);
+        void close();
+        //returns false if the stored record has the same or a higher version
+        bool apply(const std::string &key, std::string_view value, uint64_t version, bool deleted);
+        Record *find(const std::string &key);
+        //schedules writing the log back to the file, changes are in the page cache as soon as they are applied
+        Error flush();
+        //bytes of the log including replaced records
+        int logSize();
+        //position of a key in the id space, the records are stored on the peers closest to it
+        static PeerId keyId(std::string_view key);
+    private:
+        MappedFile log;
+        std::string path;
+        int logEnd;
+        //bytes the current records take in the log
+        int liveBytes;
+
+        Error append(const std::string &key, const Record &record);
+        Error compact();
+    };
+
+}
+
+#endif //SOCKET_KEYVALUESTORE_H
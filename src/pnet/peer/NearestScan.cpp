@@ -0,0 +1,181 @@
+//
+// Copyright (c) 2020 Julian Hinxlage. All rights reserved.
+//
+
+#include "NearestScan.h"
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+namespace pnet {
+
+    int nearestScalar(const uint64_t *high, const uint64_t *low, int count,
+            uint64_t targetHigh, uint64_t targetLow, uint64_t exceptHigh, uint64_t exceptLow) {
+        int index = -1;
+        uint64_t minHigh = 0;
+        uint64_t minLow = 0;
+        for(int i = 0; i < count; i++){
+            if(high[i] == exceptHigh && low[i] == exceptLow){
+                continue;
+            }
+            uint64_t distanceHigh = high[i] ^ targetHigh;
+            uint64_t distanceLow = low[i] ^ targetLow;
+            if(index == -1 || distanceHigh < minHigh || (distanceHigh == minHigh && distanceLow < minLow)){
+                minHigh = distanceHigh;
+                minLow = distanceLow;
+                index = i;
+            }
+        }
+        return index;
+    }
+
+#if defined(__x86_64__) || defined(__i386__)
+
+    //the vector scans run two passes:
+    //the minimum of the high distance words, with except masked to the maximum,
+    //then the minimum low distance word of the entries that have the minimum high distance.
+    //SSE4.2 and AVX2 only compare signed 64 bit integers, flipping the sign bit maps unsigned order onto signed order
+    static const uint64_t signBit = 0x8000000000000000ull;
+
+    //second pass for a single entry
+    static inline void nearestLow(const uint64_t *high, const uint64_t *low, int i, uint64_t targetLow,
+            uint64_t exceptHigh, uint64_t exceptLow, int &index, uint64_t &minLow) {
+        if(high[i] == exceptHigh && low[i] == exceptLow){
+            return;
+        }
+        uint64_t distance = low[i] ^ targetLow;
+        if(index == -1 || distance < minLow){
+            minLow = distance;
+            index = i;
+        }
+    }
+
+    __attribute__((target("sse4.2")))
+    int nearestSse42(const uint64_t *high, const uint64_t *low, int count,
+            uint64_t targetHigh, uint64_t targetLow, uint64_t exceptHigh, uint64_t exceptLow) {
+        const __m128i sign = _mm_set1_epi64x(signBit);
+        const __m128i target = _mm_set1_epi64x(targetHigh);
+        const __m128i exceptH = _mm_set1_epi64x(exceptHigh);
+        const __m128i exceptL = _mm_set1_epi64x(exceptLow);
+        const __m128i maximum = _mm_set1_epi64x(~signBit);
+
+        int i = 0;
+        __m128i minimum = maximum;
+        for(; i + 2 <= count; i += 2){
+            __m128i h = _mm_loadu_si128((const __m128i*)(high + i));
+            __m128i l = _mm_loadu_si128((const __m128i*)(low + i));
+            __m128i except = _mm_and_si128(_mm_cmpeq_epi64(h, exceptH), _mm_cmpeq_epi64(l, exceptL));
+            __m128i distance = _mm_xor_si128(_mm_xor_si128(h, target), sign);
+            distance = _mm_blendv_epi8(distance, maximum, except);
+            minimum = _mm_blendv_epi8(minimum, distance, _mm_cmpgt_epi64(minimum, distance));
+        }
+        int64_t lanes[2];
+        _mm_storeu_si128((__m128i*)lanes, minimum);
+        uint64_t minHigh = (uint64_t)(lanes[0] < lanes[1] ? lanes[0] : lanes[1]) ^ signBit;
+        for(int j = i; j < count; j++){
+            if(!(high[j] == exceptHigh && low[j] == exceptLow) && (high[j] ^ targetHigh) < minHigh){
+                minHigh = high[j] ^ targetHigh;
+            }
+        }
+
+        int index = -1;
+        uint64_t minLow = 0;
+        const __m128i match = _mm_set1_epi64x(minHigh ^ targetHigh);
+        for(i = 0; i + 2 <= count; i += 2){
+            __m128i h = _mm_loadu_si128((const __m128i*)(high + i));
+            int mask = _mm_movemask_pd(_mm_castsi128_pd(_mm_cmpeq_epi64(h, match)));
+            for(; mask != 0; mask &= mask - 1){
+                nearestLow(high, low, i + __builtin_ctz(mask), targetLow, exceptHigh, exceptLow, index, minLow);
+            }
+        }
+        for(; i < count; i++){
+            if((high[i] ^ targetHigh) == minHigh){
+                nearestLow(high, low, i, targetLow, exceptHigh, exceptLow, index, minLow);
+            }
+        }
+        return index;
+    }
+
+    __attribute__((target("avx2")))
+    int nearestAvx2(const uint64_t *high, const uint64_t *low, int count,
+            uint64_t targetHigh, uint64_t targetLow, uint64_t exceptHigh, uint64_t exceptLow) {
+        const __m256i sign = _mm256_set1_epi64x(signBit);
+        const __m256i target = _mm256_set1_epi64x(targetHigh);
+        const __m256i exceptH = _mm256_set1_epi64x(exceptHigh);
+        const __m256i exceptL = _mm256_set1_epi64x(exceptLow);
+        const __m256i maximum = _mm256_set1_epi64x(~signBit);
+
+        int i = 0;
+        __m256i minimum = maximum;
+        for(; i + 4 <= count; i += 4){
+            __m256i h = _mm256_loadu_si256((const __m256i*)(high + i));
+            __m256i l = _mm256_loadu_si256((const __m256i*)(low + i));
+            __m256i except = _mm256_and_si256(_mm256_cmpeq_epi64(h, exceptH), _mm256_cmpeq_epi64(l, exceptL));
+            __m256i distance = _mm256_xor_si256(_mm256_xor_si256(h, target), sign);
+            distance = _mm256_blendv_epi8(distance, maximum, except);
+            minimum = _mm256_blendv_epi8(minimum, distance, _mm256_cmpgt_epi64(minimum, distance));
+        }
+        int64_t lanes[4];
+        _mm256_storeu_si256((__m256i*)lanes, minimum);
+        int64_t biased = lanes[0];
+        for(int j = 1; j < 4; j++){
+            if(lanes[j] < biased){
+                biased = lanes[j];
+            }
+        }
+        uint64_t minHigh = (uint64_t)biased ^ signBit;
+        for(int j = i; j < count; j++){
+            if(!(high[j] == exceptHigh && low[j] == exceptLow) && (high[j] ^ targetHigh) < minHigh){
+                minHigh = high[j] ^ targetHigh;
+            }
+        }
+
+        int index = -1;
+        uint64_t minLow = 0;
+        const __m256i match = _mm256_set1_epi64x(minHigh ^ targetHigh);
+        for(i = 0; i + 4 <= count; i += 4){
+            __m256i h = _mm256_loadu_si256((const __m256i*)(high + i));
+            int mask = _mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpeq_epi64(h, match)));
+            for(; mask != 0; mask &= mask - 1){
+                nearestLow(high, low, i + __builtin_ctz(mask), targetLow, exceptHigh, exceptLow, index, minLow);
+            }
+        }
+        for(; i < count; i++){
+            if((high[i] ^ targetHigh) == minHigh){
+                nearestLow(high, low, i, targetLow, exceptHigh, exceptLow, index, minLow);
+            }
+        }
+        return index;
+    }
+
+#endif
+
+    static NearestScan selectNearestScan(const char *&name) {
+#if defined(__x86_64__) || defined(__i386__)
+        __builtin_cpu_init();
+        if(__builtin_cpu_supports("avx2")){
+            name = "avx2";
+            return nearestAvx2;
+        }
+        if(__builtin_cpu_supports("sse4.2")){
+            name = "sse4.2";
+            return nearestSse42;
+        }
+#endif
+        name = "scalar";
+        return nearestScalar;
+    }
+
+    static const char *selectedName = nullptr;
+
+    NearestScan nearestScan() {
+        static const NearestScan scan = selectNearestScan(selectedName);
+        return scan;
+    }
+
+    const char *nearestScanName() {
+        nearestScan();
+        return selectedName;
+    }
+
+}
@@ -0,0 +1,35 @@
+//
+// Copyright (c) 2020 Julian Hinxlage. All rights reserved.
+//
+
+#ifndef SOCKET_NEARESTSCAN_H
+#define SOCKET_NEARESTSCAN_H
+
+#include <cstdint>
+
+namespace pnet {
+
+    //128 bit ids stored as parallel arrays of their high and low 64 bit words
+    //returns the index of the id with the smallest XOR distance to target,
+    //ids equal to except are skipped, -1 if there is no other id
+    typedef int (*NearestScan)(const uint64_t *high, const uint64_t *low, int count,
+            uint64_t targetHigh, uint64_t targetLow, uint64_t exceptHigh, uint64_t exceptLow);
+
+    int nearestScalar(const uint64_t *high, const uint64_t *low, int count,
+            uint64_t targetHigh, uint64_t targetLow, uint64_t exceptHigh, uint64_t exceptLow);
+
+#if defined(__x86_64__) || defined(__i386__)
+    //only call these if the cpu supports the instruction set
+    int nearestSse42(const uint64_t *high, const uint64_t *low, int count,
+            uint64_t targetHigh, uint64_t targetLow, uint64_t exceptHigh, uint64_t exceptLow);
+    int nearestAvx2(const uint64_t *high, const uint64_t *low, int count,
+            uint64_t targetHigh, uint64_t targetLow, uint64_t exceptHigh, uint64_t exceptLow);
+#endif
+
+    //the fastest implementation the cpu supports, selected on first use
+    NearestScan nearestScan();
+    const char *nearestScanName();
+
+}
+
+#endif //SOCKET_NEARESTSCAN_H
@@ -0,0 +1,69 @@
+//
+// Copyright (c) 2020 Julian Hinxlage. All rights reserved.
+//
+
+#include "NextHopCache.h"
+
+namespace pnet {
+
+    NextHopCache::NextHopCache(int capacity) {
+        int sets = 1;
+        while(sets * ways < capacity){
+            sets *= 2;
+        }
+        nodes.resize(capacity > 0 ? sets * ways : 0);
+        setMask = sets - 1;
+        clock = 0;
+        epoch = 1;
+        localId = 0;
+        counters = std::make_shared<Counters>();
+    }
+
+    void NextHopCache::insert(const Entry &entry) {
+        if(nodes.empty()){
+            return;
+        }
+        Node *nodes = set(entry.destination);
+        Node *victim = &nodes[0];
+        for(int i = 0; i < ways; i++){
+            if(nodes[i].epoch == epoch && nodes[i].entry.destination == entry.destination){
+                victim = &nodes[i];
+                break;
+            }
+            //a free entry first, else the least recently used one
+            if(victim->epoch == epoch && (nodes[i].epoch != epoch || nodes[i].used < victim->used)){
+                victim = &nodes[i];
+            }
+        }
+        victim->entry = entry;
+        victim->epoch = epoch;
+        victim->used = ++clock;
+    }
+
+    void NextHopCache::setLocalId(const PeerId &id) {
+        if(localId != id){
+            localId = id;
+            clear();
+        }
+    }
+
+    void NextHopCache::clear() {
+        if(++epoch == 0){
+            //the epoch wrapped, old entries could look valid again
+            for(auto &node : nodes){
+                node.epoch = 0;
+            }
+            epoch = 1;
+        }
+    }
+
+    NextHopCache::Counters &NextHopCache::stats() {
+        return *counters;
+    }
+
+    NextHopCache::Node *NextHopCache::set(const PeerId &destination) {
+        //ids are random, their low bits spread evenly
+        return &nodes[(destination.word(0) & setMask) * ways];
+    }
+
+}
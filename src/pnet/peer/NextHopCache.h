@@ -0,0 +1,92 @@
+//
+// Copyright (c) 2020 Julian Hinxlage. All rights reserved.
+//
+
+#ifndef SOCKET_NEXTHOPCACHE_H
+#define SOCKET_NEXTHOPCACHE_H
+
+#include "PeerId.h"
+#include <vector>
+#include <memory>
+#include <atomic>
+#include <cstdint>
+
+namespace pnet {
+
+    //next hops by destination in a fixed number of entries, the routing table checks on each hit that the entry is still current.
+    //set associative like a cpu cache: a destination can only be in one set of 4 entries, the least recently used one of the set is replaced
+    class NextHopCache{
+    public:
+        class Entry{
+        public:
+            PeerId destination;
+            //index of the next hop in the peers of the routing table
+            int slot;
+            //bucket of the next hop, -1 for the local peer
+            int level;
+            //generation of that bucket when the entry was computed
+            uint64_t generation;
+            PeerId next;
+            //closest peer of that bucket, the next hop differs from it if a peer with a lower rtt was preferred
+            PeerId closest;
+        };
+        //shared by copies of the cache, so hits of the forwarding threads are counted too
+        class Counters{
+        public:
+            std::atomic<uint64_t> hits = 0;
+            std::atomic<uint64_t> misses = 0;
+            std::atomic<uint64_t> invalidations = 0;
+        };
+
+        //capacity is rounded up to a power of two, 0 disables the cache
+        NextHopCache(int capacity = 1024);
+        //nullptr if not cached, an entry the function returns false for is dropped
+        template<typename Func>
+        const Entry *find(const PeerId &destination, const Func &current){
+            if(nodes.empty()){
+                return nullptr;
+            }
+            Node *nodes = set(destination);
+            for(int i = 0; i < ways; i++){
+                if(nodes[i].epoch == epoch && nodes[i].entry.destination == destination){
+                    if(!current(nodes[i].entry)){
+                        nodes[i].epoch = epoch - 1;
+                        counters->invalidations++;
+                        break;
+                    }
+                    nodes[i].used = ++clock;
+                    counters->hits++;
+                    return &nodes[i].entry;
+                }
+            }
+            counters->misses++;
+            return nullptr;
+        }
+        void insert(const Entry &entry);
+        //the entries are computed for a local id, a different one clears the cache
+        void setLocalId(const PeerId &id);
+        void clear();
+        Counters &stats();
+    private:
+        static constexpr int ways = 4;
+        class Node{
+        public:
+            Entry entry;
+            //the entry is valid if this is the epoch of the cache
+            uint32_t epoch = 0;
+            uint32_t used = 0;
+        };
+        std::vector<Node> nodes;
+        uint64_t setMask;
+        uint32_t clock;
+        //incremented to drop all entries at once
+        uint32_t epoch;
+        PeerId localId;
+        std::shared_ptr<Counters> counters;
+
+        Node *set(const PeerId &destination);
+    };
+
+}
+
+#endif //SOCKET_NEXTHOPCACHE_H
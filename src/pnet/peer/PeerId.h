@@ -0,0 +1,16 @@
+//
+// Copyright (c) 2020 Julian Hinxlage. All rights reserved.
+//
+
+#ifndef SOCKET_PEERID_H
+#define SOCKET_PEERID_H
+
+#include "pnet/Blob.h"
+
+namespace pnet {
+
+    typedef Blob<16> PeerId;
+
+}
+
+#endif //SOCKET_PEERID_H
@@ -0,0 +1,101 @@
+//
+// Copyright (c) 2020 Julian Hinxlage. All rights reserved.
+//
+
+#include "PeerLookup.h"
+#include <algorithm>
+
+namespace pnet {
+
+    PeerLookup::PeerLookup(const PeerId &target, const PeerId &localId, int parallelism, int resultSize)
+        : target(target), parallelism(parallelism), resultSize(resultSize), localId(localId), inFlight(0) {}
+
+    void PeerLookup::addContact(const PeerId &id, const Endpoint &ep) {
+        if(id == localId){
+            return;
+        }
+        PeerId distance = id ^ target;
+        auto pos = std::lower_bound(contacts.begin(), contacts.end(), distance, [&](const Contact &contact, const PeerId &distance){
+            return (contact.peer.id ^ target) < distance;
+        });
+        if(pos != contacts.end() && pos->peer.id == id){
+            return;
+        }
+        Contact contact;
+        contact.peer.id = id;
+        contact.peer.ep = ep;
+        contact.state = NEW;
+        contact.sent = 0;
+        contacts.insert(pos, contact);
+    }
+
+    uint64_t PeerLookup::answer(const PeerId &id, const Endpoint &ep) {
+        for(auto &contact : contacts){
+            if(contact.state == QUERIED && contact.peer.id == id){
+                contact.state = ANSWERED;
+                inFlight--;
+                return contact.sent;
+            }
+        }
+        for(auto &contact : contacts){
+            if(contact.state == QUERIED && contact.peer.ep == ep){
+                contact.state = FAILED;
+                inFlight--;
+            }
+        }
+        return 0;
+    }
+
+    void PeerLookup::expire(uint64_t time) {
+        for(auto &contact : contacts){
+            if(contact.state == QUERIED && contact.sent < time){
+                contact.state = FAILED;
+                inFlight--;
+            }
+        }
+    }
+
+    std::vector<Peer> PeerLookup::next(uint64_t time) {
+        std::vector<Peer> result;
+        int closest = 0;
+        for(size_t i = 0; i < contacts.size() && closest < resultSize && inFlight < parallelism; i++){
+            auto &contact = contacts[i];
+            if(contact.state == FAILED){
+                continue;
+            }
+            closest++;
+            if(contact.state == NEW){
+                contact.state = QUERIED;
+                contact.sent = time;
+                inFlight++;
+                result.push_back(contact.peer);
+            }
+        }
+        return result;
+    }
+
+    bool PeerLookup::done() {
+        int closest = 0;
+        for(size_t i = 0; i < contacts.size() && closest < resultSize; i++){
+            if(contacts[i].state == FAILED){
+                continue;
+            }
+            if(contacts[i].state != ANSWERED){
+                return false;
+            }
+            closest++;
+        }
+        return true;
+    }
+
+    std::vector<Peer> PeerLookup::result() {
+        std::vector<Peer> result;
+        for(size_t i = 0; i < contacts.size() && (int)result.size() < resultSize; i++){
+            if(contacts[i].state == ANSWERED){
+                result.push_back(contacts[i].peer);
+            }
+        }
+        return result;
+    }
+
+}
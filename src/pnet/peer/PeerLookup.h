@@ -0,0 +1,60 @@
+//
+// Copyright (c) 2020 Julian Hinxlage. All rights reserved.
+//
+
+#ifndef SOCKET_PEERLOOKUP_H
+#define SOCKET_PEERLOOKUP_H
+
+#include "PeerRoutingTable.h"
+#include <future>
+#include <functional>
+
+namespace pnet {
+
+    //state of an iterative Kademlia FIND_NODE lookup: the contacts known to be close to the target,
+    //the closest ones are queried directly, at most parallelism at a time, and return closer contacts
+    //until the resultSize closest contacts have all answered or failed
+    class PeerLookup{
+    public:
+        PeerId target;
+        int parallelism;
+        int resultSize;
+        std::promise<std::vector<Peer>> promise;
+        std::function<void(const std::vector<Peer> &peers)> callback;
+
+        //the local peer is never a contact
+        PeerLookup(const PeerId &target, const PeerId &localId, int parallelism, int resultSize);
+        void addContact(const PeerId &id, const Endpoint &ep);
+        //returns the time the query was sent at, 0 if the contact was not queried,
+        //a query answered by a different id at the same endpoint failed, the contact was stale
+        uint64_t answer(const PeerId &id, const Endpoint &ep);
+        //queries sent before time failed
+        void expire(uint64_t time);
+        //contacts to query now, they are marked as queried at time
+        std::vector<Peer> next(uint64_t time);
+        //the closest resultSize contacts that did not fail have answered
+        bool done();
+        //the contacts that answered, ordered by distance to the target
+        std::vector<Peer> result();
+    private:
+        enum State{
+            NEW,
+            QUERIED,
+            ANSWERED,
+            FAILED,
+        };
+        class Contact{
+        public:
+            Peer peer;
+            State state;
+            uint64_t sent;
+        };
+        PeerId localId;
+        //ordered by distance to the target
+        std::vector<Contact> contacts;
+        int inFlight;
+    };
+
+}
+
+#endif //SOCKET_PEERLOOKUP_H
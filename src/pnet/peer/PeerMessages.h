@@ -0,0 +1,459 @@
+//
+// Copyright (c) 2020 Julian Hinxlage. All rights reserved.
+//
+
+#ifndef SOCKET_PEERMESSAGES_H
+#define SOCKET_PEERMESSAGES_H
+
+#include "PeerRoutingTable.h"
+#include "pnet/Schema.h"
+#include <tuple>
+
+namespace pnet {
+
+    enum class PeerOpcode{
+        NONE,
+        PING,
+        PONG,
+        HANDSHAKE,
+        HANDSHAKE_REPLY,
+        LOOKUP,
+        LOOKUP_REPLY,
+        ROUTE,
+        BROADCAST,
+        MESSAGE,
+        DISCONNECT,
+        //the sender understands the compact wire format, appended to HANDSHAKE and HANDSHAKE_REPLY
+        COMPACT,
+        //the sender can decompress WIRE_V2 MESSAGE and BROADCAST payloads, appended to HANDSHAKE and HANDSHAKE_REPLY
+        COMPRESSION,
+        //iterative lookup query, answered directly with FIND_NODE_REPLY followed by NODE messages
+        FIND_NODE,
+        FIND_NODE_REPLY,
+        //a contact close to the target of the preceding FIND_NODE_REPLY
+        NODE,
+        //broadcast along a tree of XOR buckets, the receiver forwards it to its buckets below limit
+        TREE_BROADCAST,
+        //the sender has the TREE_BROADCAST with the id, the receiver answers IWANT if it missed it
+        IHAVE,
+        IWANT,
+        //reliable ordered message, answered with an ACK routed back to the source
+        RELIABLE,
+        ACK,
+        //part of a MESSAGE too large for one datagram, the receiver answers FRAGMENT_NACK for missing parts
+        FRAGMENT,
+        FRAGMENT_NACK,
+        //replicated store requests routed to the peer closest to the hash of the key, which asks the other replicas
+        //with STORE_REPLICA set. writes are answered with PUT_REPLY, reads with GET_REPLY
+        PUT,
+        DELETE,
+        PUT_REPLY,
+        GET,
+        GET_REPLY,
+        //topic trees: SUBSCRIBE is sent hop by hop towards the topic id, each hop adds the sender as child
+        //and only sends it on if it was not in the tree yet. PUBLISH is routed to the root and sent down to the children
+        SUBSCRIBE,
+        UNSUBSCRIBE,
+        PUBLISH,
+        //segment of the byte streams from the sender to the receiver, answered with a STREAM_ACK routed back to the source.
+        //segments are acknowledged like RELIABLE ones but applied as they arrive, each stream is put in order on its own
+        STREAM,
+        STREAM_ACK,
+    };
+
+    //set in a WIRE_V2 opcode byte when the payload of a MESSAGE, RELIABLE, FRAGMENT, BROADCAST or TREE_BROADCAST is compressed
+    static constexpr uint8_t COMPRESSED_FLAG = 0x80;
+
+    //set in the flags of PUT, DELETE and GET sent by the peer coordinating a request to a replica
+    static constexpr uint8_t STORE_REPLICA = 1;
+
+    //set in the flags of a PUBLISH sent by a parent to its children
+    static constexpr uint8_t PUBLISH_DOWN = 1;
+
+    //flags of a stream frame: the stream ends after its data
+    static constexpr uint8_t STREAM_FIN = 1;
+    //the receiver of the stream allows bytes up to offset, sent in the session of the opposite direction
+    static constexpr uint8_t STREAM_WINDOW = 2;
+
+    //state of a GET_REPLY
+    static constexpr uint8_t STORE_MISSING = 0;
+    static constexpr uint8_t STORE_FOUND = 1;
+    static constexpr uint8_t STORE_DELETED = 2;
+    //the replicas did not answer in time
+    static constexpr uint8_t STORE_FAILED = 3;
+
+    //switch the wire format for the following messages of a datagram, a datagram starts in WIRE_V1
+    //neither value can be the first byte of a WIRE_V1 or WIRE_V2 opcode, even with COMPRESSED_FLAG set
+    static constexpr uint8_t WIRE_V1_MARKER = 0xc1;
+    static constexpr uint8_t WIRE_V2_MARKER = 0xc2;
+
+    //wire layout of the messages following each opcode,
+    //message bodies are views, when read they point into the packet and are not copied
+
+    class PingMessage{
+    public:
+        static constexpr PeerOpcode opcode = PeerOpcode::PING;
+        static constexpr auto fields(){
+            return std::make_tuple();
+        }
+    };
+
+    class PongMessage{
+    public:
+        static constexpr PeerOpcode opcode = PeerOpcode::PONG;
+        static constexpr auto fields(){
+            return std::make_tuple();
+        }
+    };
+
+    class HandshakeMessage{
+    public:
+        static constexpr PeerOpcode opcode = PeerOpcode::HANDSHAKE;
+        PeerId id;
+        static constexpr auto fields(){
+            return std::make_tuple(&HandshakeMessage::id);
+        }
+    };
+
+    class HandshakeReplyMessage{
+    public:
+        static constexpr PeerOpcode opcode = PeerOpcode::HANDSHAKE_REPLY;
+        PeerId id;
+        static constexpr auto fields(){
+            return std::make_tuple(&HandshakeReplyMessage::id);
+        }
+    };
+
+    class LookupMessage{
+    public:
+        static constexpr PeerOpcode opcode = PeerOpcode::LOOKUP;
+        //first hop of the requester, replies are routed back through it
+        PeerId relayId;
+        static constexpr auto fields(){
+            return std::make_tuple(&LookupMessage::relayId);
+        }
+    };
+
+    class LookupReplyMessage{
+    public:
+        static constexpr PeerOpcode opcode = PeerOpcode::LOOKUP_REPLY;
+        PeerId id;
+        uint16_t port;
+        std::string address;
+        static constexpr auto fields(){
+            return std::make_tuple(&LookupReplyMessage::id, &LookupReplyMessage::port, &LookupReplyMessage::address);
+        }
+    };
+
+    class FindNodeMessage{
+    public:
+        static constexpr PeerOpcode opcode = PeerOpcode::FIND_NODE;
+        uint32_t lookupId;
+        //the sender, the receiver adds it like a HANDSHAKE
+        PeerId id;
+        PeerId target;
+        static constexpr auto fields(){
+            return std::make_tuple(&FindNodeMessage::lookupId, &FindNodeMessage::id, &FindNodeMessage::target);
+        }
+    };
+
+    class FindNodeReplyMessage{
+    public:
+        static constexpr PeerOpcode opcode = PeerOpcode::FIND_NODE_REPLY;
+        uint32_t lookupId;
+        PeerId id;
+        static constexpr auto fields(){
+            return std::make_tuple(&FindNodeReplyMessage::lookupId, &FindNodeReplyMessage::id);
+        }
+    };
+
+    class NodeMessage{
+    public:
+        static constexpr PeerOpcode opcode = PeerOpcode::NODE;
+        PeerId id;
+        uint16_t port;
+        std::string address;
+        static constexpr auto fields(){
+            return std::make_tuple(&NodeMessage::id, &NodeMessage::port, &NodeMessage::address);
+        }
+    };
+
+    class RouteMessage{
+    public:
+        static constexpr PeerOpcode opcode = PeerOpcode::ROUTE;
+        PeerId source;
+        PeerId destination;
+        int payloadSize;
+        static constexpr auto fields(){
+            return std::make_tuple(&RouteMessage::source, &RouteMessage::destination, &RouteMessage::payloadSize);
+        }
+    };
+
+    class BroadcastMessage{
+    public:
+        static constexpr PeerOpcode opcode = PeerOpcode::BROADCAST;
+        PeerId source;
+        Blob<32> broadcastId;
+        std::string_view msg;
+        static constexpr auto fields(){
+            return std::make_tuple(&BroadcastMessage::source, &BroadcastMessage::broadcastId, &BroadcastMessage::msg);
+        }
+    };
+
+    class TreeBroadcastMessage{
+    public:
+        static constexpr PeerOpcode opcode = PeerOpcode::TREE_BROADCAST;
+        //first field, forwarders overwrite it in place
+        uint8_t limit;
+        PeerId source;
+        Blob<32> broadcastId;
+        std::string_view msg;
+        static constexpr auto fields(){
+            return std::make_tuple(&TreeBroadcastMessage::limit, &TreeBroadcastMessage::source,
+                &TreeBroadcastMessage::broadcastId, &TreeBroadcastMessage::msg);
+        }
+    };
+
+    class IHaveMessage{
+    public:
+        static constexpr PeerOpcode opcode = PeerOpcode::IHAVE;
+        Blob<32> broadcastId;
+        static constexpr auto fields(){
+            return std::make_tuple(&IHaveMessage::broadcastId);
+        }
+    };
+
+    class IWantMessage{
+    public:
+        static constexpr PeerOpcode opcode = PeerOpcode::IWANT;
+        Blob<32> broadcastId;
+        static constexpr auto fields(){
+            return std::make_tuple(&IWantMessage::broadcastId);
+        }
+    };
+
+    class DataMessage{
+    public:
+        static constexpr PeerOpcode opcode = PeerOpcode::MESSAGE;
+        std::string_view msg;
+        static constexpr auto fields(){
+            return std::make_tuple(&DataMessage::msg);
+        }
+    };
+
+    class ReliableMessage{
+    public:
+        static constexpr PeerOpcode opcode = PeerOpcode::RELIABLE;
+        uint32_t session;
+        uint32_t sequence;
+        //1 if the message continues in the next sequence
+        uint8_t more;
+        std::string_view msg;
+        static constexpr auto fields(){
+            return std::make_tuple(&ReliableMessage::session, &ReliableMessage::sequence, &ReliableMessage::more, &ReliableMessage::msg);
+        }
+    };
+
+    class AckMessage{
+    public:
+        static constexpr PeerOpcode opcode = PeerOpcode::ACK;
+        uint32_t session;
+        //all sequences before expected were received
+        uint32_t expected;
+        //bit i is set if expected + 1 + i was received
+        uint64_t mask;
+        static constexpr auto fields(){
+            return std::make_tuple(&AckMessage::session, &AckMessage::expected, &AckMessage::mask);
+        }
+    };
+
+    class FragmentMessage{
+    public:
+        static constexpr PeerOpcode opcode = PeerOpcode::FRAGMENT;
+        //per sender, fragments of a message have the same id and count
+        uint32_t messageId;
+        uint32_t index;
+        uint32_t count;
+        std::string_view data;
+        static constexpr auto fields(){
+            return std::make_tuple(&FragmentMessage::messageId, &FragmentMessage::index, &FragmentMessage::count, &FragmentMessage::data);
+        }
+    };
+
+    class FragmentNackMessage{
+    public:
+        static constexpr PeerOpcode opcode = PeerOpcode::FRAGMENT_NACK;
+        uint32_t messageId;
+        //the fragments first to first + count - 1 are missing
+        uint32_t first;
+        uint32_t count;
+        static constexpr auto fields(){
+            return std::make_tuple(&FragmentNackMessage::messageId, &FragmentNackMessage::first, &FragmentNackMessage::count);
+        }
+    };
+
+    class PutMessage{
+    public:
+        static constexpr PeerOpcode opcode = PeerOpcode::PUT;
+        //answered with the same id, 0 if no answer is needed
+        uint32_t requestId;
+        //set by the coordinating peer, ignored without STORE_REPLICA
+        uint64_t version;
+        uint8_t flags;
+        std::string_view key;
+        std::string_view value;
+        static constexpr auto fields(){
+            return std::make_tuple(&PutMessage::requestId, &PutMessage::version, &PutMessage::flags, &PutMessage::key, &PutMessage::value);
+        }
+    };
+
+    class DeleteMessage{
+    public:
+        static constexpr PeerOpcode opcode = PeerOpcode::DELETE;
+        uint32_t requestId;
+        uint64_t version;
+        uint8_t flags;
+        std::string_view key;
+        static constexpr auto fields(){
+            return std::make_tuple(&DeleteMessage::requestId, &DeleteMessage::version, &DeleteMessage::flags, &DeleteMessage::key);
+        }
+    };
+
+    class PutReplyMessage{
+    public:
+        static constexpr PeerOpcode opcode = PeerOpcode::PUT_REPLY;
+        uint32_t requestId;
+        //0 if the write quorum was not reached
+        uint8_t stored;
+        static constexpr auto fields(){
+            return std::make_tuple(&PutReplyMessage::requestId, &PutReplyMessage::stored);
+        }
+    };
+
+    class GetMessage{
+    public:
+        static constexpr PeerOpcode opcode = PeerOpcode::GET;
+        uint32_t requestId;
+        uint8_t flags;
+        std::string_view key;
+        static constexpr auto fields(){
+            return std::make_tuple(&GetMessage::requestId, &GetMessage::flags, &GetMessage::key);
+        }
+    };
+
+    class GetReplyMessage{
+    public:
+        static constexpr PeerOpcode opcode = PeerOpcode::GET_REPLY;
+        //0 for a hot record pushed to the previous hop of a GET, which caches it
+        uint32_t requestId;
+        uint8_t state;
+        uint64_t version;
+        std::string_view key;
+        std::string_view value;
+        static constexpr auto fields(){
+            return std::make_tuple(&GetReplyMessage::requestId, &GetReplyMessage::state, &GetReplyMessage::version,
+                &GetReplyMessage::key, &GetReplyMessage::value);
+        }
+    };
+
+    class SubscribeMessage{
+    public:
+        static constexpr PeerOpcode opcode = PeerOpcode::SUBSCRIBE;
+        PeerId topicId;
+        //the sender, it becomes a child of the receiver
+        PeerId id;
+        static constexpr auto fields(){
+            return std::make_tuple(&SubscribeMessage::topicId, &SubscribeMessage::id);
+        }
+    };
+
+    class UnsubscribeMessage{
+    public:
+        static constexpr PeerOpcode opcode = PeerOpcode::UNSUBSCRIBE;
+        PeerId topicId;
+        PeerId id;
+        static constexpr auto fields(){
+            return std::make_tuple(&UnsubscribeMessage::topicId, &UnsubscribeMessage::id);
+        }
+    };
+
+    class PublishMessage{
+    public:
+        static constexpr PeerOpcode opcode = PeerOpcode::PUBLISH;
+        PeerId topicId;
+        uint8_t flags;
+        PeerId source;
+        //peers in the tree of a topic more than once while it is repaired drop duplicates
+        Blob<32> publishId;
+        std::string_view msg;
+        static constexpr auto fields(){
+            return std::make_tuple(&PublishMessage::topicId, &PublishMessage::flags, &PublishMessage::source,
+                &PublishMessage::publishId, &PublishMessage::msg);
+        }
+    };
+
+    class StreamMessage{
+    public:
+        static constexpr PeerOpcode opcode = PeerOpcode::STREAM;
+        uint32_t session;
+        uint32_t sequence;
+        //a StreamFrame in WIRE_V2
+        std::string_view frame;
+        static constexpr auto fields(){
+            return std::make_tuple(&StreamMessage::session, &StreamMessage::sequence, &StreamMessage::frame);
+        }
+    };
+
+    class StreamAckMessage{
+    public:
+        static constexpr PeerOpcode opcode = PeerOpcode::STREAM_ACK;
+        uint32_t session;
+        //all sequences before expected were received
+        uint32_t expected;
+        //bit i is set if expected + 1 + i was received
+        uint64_t mask;
+        static constexpr auto fields(){
+            return std::make_tuple(&StreamAckMessage::session, &StreamAckMessage::expected, &StreamAckMessage::mask);
+        }
+    };
+
+    //bytes of one stream carried by a STREAM segment
+    class StreamFrame{
+    public:
+        uint32_t stream;
+        //position of data in the stream, the new limit with STREAM_WINDOW
+        uint64_t offset;
+        uint8_t flags;
+        std::string_view data;
+        static constexpr auto fields(){
+            return std::make_tuple(&StreamFrame::stream, &StreamFrame::offset, &StreamFrame::flags, &StreamFrame::data);
+        }
+    };
+
+    class CompactMessage{
+    public:
+        static constexpr PeerOpcode opcode = PeerOpcode::COMPACT;
+        static constexpr auto fields(){
+            return std::make_tuple();
+        }
+    };
+
+    class CompressionMessage{
+    public:
+        static constexpr PeerOpcode opcode = PeerOpcode::COMPRESSION;
+        static constexpr auto fields(){
+            return std::make_tuple();
+        }
+    };
+
+    class DisconnectMessage{
+    public:
+        static constexpr PeerOpcode opcode = PeerOpcode::DISCONNECT;
+        static constexpr auto fields(){
+            return std::make_tuple();
+        }
+    };
+
+}
+
+#endif //SOCKET_PEERMESSAGES_H
@@ -6,6 +6,8 @@
 #include "pnet/util.h"
 #include <random>
 #include <unordered_map>
+#include <cstring>
+#include <algorithm>
 
 namespace pnet {
 
@@ -47,6 +49,50 @@ namespace pnet {
                 return "MESSAGE";
             case PeerNetwork::DISCONNECT:
                 return "DISCONNECT";
+            case PeerNetwork::COMPACT:
+                return "COMPACT";
+            case PeerNetwork::COMPRESSION:
+                return "COMPRESSION";
+            case PeerNetwork::FIND_NODE:
+                return "FIND_NODE";
+            case PeerNetwork::FIND_NODE_REPLY:
+                return "FIND_NODE_REPLY";
+            case PeerNetwork::NODE:
+                return "NODE";
+            case PeerNetwork::TREE_BROADCAST:
+                return "TREE_BROADCAST";
+            case PeerNetwork::IHAVE:
+                return "IHAVE";
+            case PeerNetwork::IWANT:
+                return "IWANT";
+            case PeerNetwork::RELIABLE:
+                return "RELIABLE";
+            case PeerNetwork::ACK:
+                return "ACK";
+            case PeerNetwork::FRAGMENT:
+                return "FRAGMENT";
+            case PeerNetwork::FRAGMENT_NACK:
+                return "FRAGMENT_NACK";
+            case PeerNetwork::PUT:
+                return "PUT";
+            case PeerNetwork::DELETE:
+                return "DELETE";
+            case PeerNetwork::PUT_REPLY:
+                return "PUT_REPLY";
+            case PeerNetwork::GET:
+                return "GET";
+            case PeerNetwork::GET_REPLY:
+                return "GET_REPLY";
+            case PeerNetwork::SUBSCRIBE:
+                return "SUBSCRIBE";
+            case PeerNetwork::UNSUBSCRIBE:
+                return "UNSUBSCRIBE";
+            case PeerNetwork::PUBLISH:
+                return "PUBLISH";
+            case PeerNetwork::STREAM:
+                return "STREAM";
+            case PeerNetwork::STREAM_ACK:
+                return "STREAM_ACK";
             default:
                 return "INVALID";
         }
@@ -55,6 +101,57 @@ namespace pnet {
     PeerNetwork::PeerNetwork() {
         thread = nullptr;
         readBuffer.resize(1024);
+        compressionThreshold = 256;
+        refreshInterval = 2000;
+        lookupReplyCount = 4;
+        lookupParallelism = 3;
+        lookupTimeout = 500;
+        nextLookupId = 1;
+        treeBroadcast = true;
+        broadcastRedundancy = 1;
+        meshTimeout = 15000;
+        gossipInterval = 1000;
+        gossipFanout = 3;
+        gossipWindow = 5000;
+        gossipCacheBytes = 16 * 1024 * 1024;
+        gossipCacheSize = 0;
+        mesh.resize(PeerId::bits);
+        reliableMinRto = 200;
+        reliableTimer = -1;
+        streamWindow = 256 * 1024;
+        maxDatagramSize = 1200;
+        coalesceDelay = 0;
+        processingThreads = 0;
+        tableChanged = false;
+        outboundTimer = -1;
+        fragmentBurst = 64;
+        fragmentRepairDelay = 50;
+        reassemblyTimeout = 5000;
+        reassemblyBytes = 64 * 1024 * 1024;
+        fragmentTimer = -1;
+        sentDatagrams = 0;
+        sentBytes = 0;
+        broadcastWindow = 30000;
+        broadcastCapacity = 16384;
+        pingInterval = 5000;
+        proximityBits = 1;
+        directRate = 0;
+        maxDirectLinks = 16;
+        snapshotInterval = 10000;
+        validationTimeout = 1000;
+        validationTimer = -1;
+        peerTimeout = 0;
+        storeReplicas = 3;
+        storeWriteQuorum = 2;
+        storeReadQuorum = 2;
+        storeTimeout = 1000;
+        hotKeyReads = 16;
+        storeCacheTime = 1000;
+        storeClockSkew = 3600000;
+        nextStoreRequestId = 1;
+        cachedKeys = 0;
+        placementChanged = false;
+        topicRefreshInterval = 2000;
     }
 
     Error PeerNetwork::start(uint16_t port, const char *address) {
@@ -68,25 +165,128 @@ namespace pnet {
             return error;
         }
 
+        routingTable.proximityBits = proximityBits;
+        broadcastIds.reset(broadcastCapacity, broadcastWindow);
+        fragmentSender.timeout = reassemblyTimeout;
+        fragmentSender.maxBytes = reassemblyBytes;
+        reassembler.timeout = reassemblyTimeout;
+        reassembler.maxBytes = reassemblyBytes;
+        reassembler.repairDelay = fragmentRepairDelay;
+        if(linkDelay){
+            handler.addTimer(1, [&](){
+                writeDelayed();
+            });
+        }
+
+        if(!snapshotPath.empty()){
+            restoreSnapshot();
+            handler.addTimer(snapshotInterval, [&](){
+                std::lock_guard<std::recursive_mutex> lock(mutex);
+                Error error = routingTable.saveSnapshot(snapshotPath);
+                if(error){
+                    logError(error);
+                }
+            });
+        }
+
+        if(!storePath.empty()){
+            Error error = store.open(storePath);
+            if(error){
+                logError(error);
+            }
+        }
+        handler.addTimer(std::max(storeTimeout / 4, 1), [&](){
+            std::lock_guard<std::recursive_mutex> lock(mutex);
+            expireStoreRequests();
+        });
+        handler.addTimer(1000, [&](){
+            std::lock_guard<std::recursive_mutex> lock(mutex);
+            maintainStore();
+        });
+        handler.addTimer(topicRefreshInterval, [&](){
+            std::lock_guard<std::recursive_mutex> lock(mutex);
+            refreshTopics();
+        });
+
         //set packet processing callback
         handler.add(socket.getHandle(), [&](){
             readPacket(0);
         });
+        handler.addTimer(refreshInterval, [&](){
+            std::lock_guard<std::recursive_mutex> lock(mutex);
+            if(isConnected()){
+                refresh();
+            }
+        });
+        handler.addTimer(pingInterval, [&](){
+            std::lock_guard<std::recursive_mutex> lock(mutex);
+            if(peerTimeout > 0){
+                removeSilentPeers();
+            }
+            ping();
+            publishTable(true);
+        });
+        if(gossipInterval > 0){
+            handler.addTimer(gossipInterval, [&](){
+                std::lock_guard<std::recursive_mutex> lock(mutex);
+                gossip();
+            });
+        }
+        handler.addTimer(std::max(lookupTimeout / 4, 1), [&](){
+            std::lock_guard<std::recursive_mutex> lock(mutex);
+            expireLookups();
+        });
+        if(directRate > 0){
+            handler.addTimer(1000, [&](){
+                std::lock_guard<std::recursive_mutex> lock(mutex);
+                reviewDirectLinks();
+            });
+        }
+
+        log(str("port: ", port), true);
+        log(str("id: ", hex(routingTable.localPeer().id)), true);
+
+        publishTable(true);
+        //copies of the cache share its counters
+        forwardHops = routingTable.nextHops;
 
         //start handler and read packets
         thread = std::make_shared<std::thread>([&](){
             handler.run();
         });
-
-        log(str("port: ", port), true);
-        log(str("id: ", hex(localId())), true);
+        shards.clear();
+        localShard = nullptr;
+        if(processingThreads > 0){
+            localShard = std::make_unique<Shard>();
+            localShard->thread = std::thread([this](){
+                runLocalShard();
+            });
+        }
+        for(int i = 0; i < processingThreads; i++){
+            shards.push_back(std::make_unique<Shard>());
+            Shard *shard = shards.back().get();
+            shard->nextHops = routingTable.nextHops;
+            shard->thread = std::thread([this, shard](){
+                runShard(*shard);
+            });
+        }
 
         return Error();
     }
 
     void PeerNetwork::stop() {
+        {
+            std::lock_guard<std::recursive_mutex> lock(mutex);
+            flushOutbound(true);
+        }
         handler.stop();
         handler.remove(socket.getHandle());
+        for(auto &shard : shards){
+            shard->stop();
+        }
+        if(localShard){
+            localShard->stop();
+        }
     }
 
     void PeerNetwork::readPacket(int millisTimeout) {
@@ -101,219 +301,1710 @@ namespace pnet {
                 return;
             }
         }
-        Packet packet(readBuffer, bytes);
-        processPacket(packet, source);
+        if(shards.empty()){
+            processDatagram(readBuffer, bytes, source);
+            return;
+        }
+
+        //datagrams from one endpoint go to the same shard, so their order is kept
+        Shard &shard = *shards[std::hash<Endpoint>()(source) % shards.size()];
+        ReceivedDatagram datagram{std::move(readBuffer), bytes, 0, WIRE_V1, source};
+        if(!shard.push(std::move(datagram))){
+            //the shard does not keep up, drop like a full socket buffer would
+            readBuffer.swap(datagram.data);
+            return;
+        }
+        std::lock_guard<std::mutex> lock(bufferMutex);
+        if(!freeBuffers.empty()){
+            readBuffer.swap(freeBuffers.back());
+            freeBuffers.pop_back();
+        }
+        readBuffer.resize(std::max<size_t>(readBuffer.size(), 1024));
+    }
+
+    void PeerNetwork::runShard(Shard &shard) {
+        ReceivedDatagram datagram;
+        while(shard.pop(datagram)){
+            Packet packet;
+            packet.buffer.swap(datagram.data);
+            packet.bytes = datagram.bytes;
+            forwardRoutes(packet, datagram.ep, datagram.format, shard.nextHops);
+            datagram.data.swap(packet.buffer);
+            datagram.offset = packet.offset;
+            if(packet.size() == 0 || !localShard->push(std::move(datagram))){
+                recycleBuffer(datagram.data);
+            }
+        }
+    }
+
+    void PeerNetwork::runLocalShard() {
+        ReceivedDatagram datagram;
+        while(localShard->pop(datagram)){
+            Packet packet;
+            packet.buffer.swap(datagram.data);
+            packet.bytes = datagram.bytes;
+            packet.offset = datagram.offset;
+            {
+                std::lock_guard<std::recursive_mutex> lock(mutex);
+                processPacket(packet, datagram.ep, datagram.format);
+                flushBatch();
+                publishTable();
+            }
+            recycleBuffer(packet.buffer);
+        }
+    }
+
+    void PeerNetwork::recycleBuffer(std::vector<char> &buffer) {
+        std::lock_guard<std::mutex> lock(bufferMutex);
+        if(freeBuffers.size() < 64){
+            freeBuffers.push_back(std::move(buffer));
+        }
+    }
+
+    bool PeerNetwork::Shard::push(ReceivedDatagram &&datagram) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if(queue.size() >= maxShardQueue){
+                return false;
+            }
+            queue.push_back(std::move(datagram));
+        }
+        ready.notify_one();
+        return true;
+    }
+
+    bool PeerNetwork::Shard::pop(ReceivedDatagram &datagram) {
+        std::unique_lock<std::mutex> lock(mutex);
+        ready.wait(lock, [&](){
+            return !queue.empty() || stopped;
+        });
+        if(stopped){
+            return false;
+        }
+        datagram = std::move(queue.front());
+        queue.pop_front();
+        return true;
+    }
+
+    void PeerNetwork::Shard::stop() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopped = true;
+        }
+        ready.notify_one();
+    }
+
+    //forwarding takes only the shared lock of the routing table, everything else is processed under the mutex
+    void PeerNetwork::processDatagram(std::vector<char> &buffer, int bytes, const Endpoint &source) {
+        //process in place, the packet borrows the buffer
+        Packet packet;
+        packet.buffer.swap(buffer);
+        packet.bytes = bytes;
+        WireFormat format = WIRE_V1;
+        forwardRoutes(packet, source, format, forwardHops);
+        if(packet.size() > 0){
+            std::lock_guard<std::recursive_mutex> lock(mutex);
+            processPacket(packet, source, format);
+            flushBatch();
+            publishTable();
+        }
+        buffer.swap(packet.buffer);
+    }
+
+    //forward the ROUTE messages at the start of a datagram that are not for the local peer,
+    //stops at the first other message, format is the format in effect there
+    void PeerNetwork::forwardRoutes(Packet &packet, const Endpoint &sourceEp, WireFormat &format, NextHopCache &nextHops) {
+        while(packet.size() > 0){
+            uint8_t marker = packet.data()[0];
+            if(marker == WIRE_V1_MARKER || marker == WIRE_V2_MARKER){
+                format = marker == WIRE_V2_MARKER ? WIRE_V2 : WIRE_V1;
+                packet.skip(1);
+                continue;
+            }
+
+            int packetStart = packet.offset;
+            Opcode opcode;
+            bool compressed = false;
+            RouteMessage msg;
+            if(!readOpcode(packet, opcode, compressed, format) || opcode != ROUTE
+                || !Schema<RouteMessage>::read(packet, msg, format) || msg.payloadSize < 0 || msg.payloadSize > packet.size()){
+                packet.offset = packetStart;
+                return;
+            }
+            //GETs may be answered from storeCache, which is guarded by the mutex
+            GetMessage get;
+            if(cachedKeys > 0 && peekGet(packet, format, get)){
+                packet.offset = packetStart;
+                return;
+            }
+            auto table = publishedTable.read();
+            //a published snapshot is shared by all readers and never written, each forwarding thread has its own cache
+            const PeerRoutingTable &routes = *table;
+            const Peer &next = routes.getNext(msg.destination, routes.get(sourceEp).id, nextHops);
+            if(next.id == routes.localPeer().id){
+                packet.offset = packetStart;
+                return;
+            }
+            forwardRoute(packet, packetStart, msg, format, next);
+            packet.skip(msg.payloadSize);
+        }
     }
 
-    void PeerNetwork::processPacket(Packet &packet, const Endpoint &sourceEp) {
-        Peer hop;
-        if(routingTable.has(sourceEp)){
-            hop = routingTable.get(sourceEp);
+    //send a ROUTE message whose header was just read on to next, its payload follows at the packet offset
+    void PeerNetwork::forwardRoute(Packet &packet, int packetStart, const RouteMessage &msg, WireFormat format, const Peer &next) {
+        if(format == WIRE_V2 && next.format != WIRE_V2){
+            //rewrite the header for a next hop that only reads WIRE_V1
+            const char *payload = packet.data();
+            int payloadSize = msg.payloadSize;
+            if(payloadSize > 0 && (uint8_t)payload[0] == WIRE_V1_MARKER){
+                payload++;
+                payloadSize--;
+            }
+            Packet forward(routeHeaderSize);
+            forward.add(payload, payloadSize);
+            prependRoute(forward, msg.source, msg.destination, WIRE_V1);
+            write(forward.data(), forward.size(), next.ep);
         }else{
-            hop.ep = sourceEp;
-            hop.id = 0;
+            forwardPacket(packet, packetStart, packet.offset - packetStart + msg.payloadSize, format, next.ep);
+        }
+    }
+
+    void PeerNetwork::processPacket(Packet &packet, const Endpoint &sourceEp, WireFormat format) {
+        //the peer the datagram came from, id 0 if unknown
+        Peer *hop = routingTable.find(sourceEp);
+        PeerId hopId = hop != nullptr ? hop->id : PeerId(0);
+        if(hop != nullptr){
+            hop->lastSeen = unixMillis();
         }
+        const Endpoint &hopEp = sourceEp;
 
-        PeerId source = hop.id;
-        PeerId destination = localId();
+        PeerId source = hopId;
+        PeerId destination = routingTable.localPeer().id;
+        //lookup of the last FIND_NODE_REPLY, the following NODE messages are its contacts
+        uint32_t replyLookupId = 0;
+        //IWANTs for the IHAVEs of the datagram
+        Packet wantPacket;
 
         while(packet.size() > 0){
+            uint8_t marker = packet.data()[0];
+            if(marker == WIRE_V1_MARKER || marker == WIRE_V2_MARKER){
+                format = marker == WIRE_V2_MARKER ? WIRE_V2 : WIRE_V1;
+                packet.skip(1);
+                continue;
+            }
+
             int packetStart = packet.offset;
-            Opcode opcode = packet.get<Opcode>();
+            Opcode opcode;
+            bool compressed = false;
+            if(!readOpcode(packet, opcode, compressed, format)){
+                log("invalid packet", true);
+                return;
+            }
 
-            log(str("[", opcodeName(opcode), "] ", hex(source, true), " ", hop.ep.getAddress(), " ", hop.ep.getPort()), true);
+            if(logCallback){
+                log(str("[", opcodeName(opcode), "] ", hex(source, true), " ", hopEp.getAddress(), " ", hopEp.getPort()), true);
+            }
 
             switch (opcode) {
                 case NONE:
                     break;
                 case PING:{
-                    Packet response;
-                    response.add(PONG);
-                    sendPacket(response, source);
+                    Packet response(routeHeaderSize);
+                    addMessage(response, PongMessage(), formatOf(source));
+                    if(source == hopId){
+                        //answer over the same link, the sender measures the link rtt
+                        write(response.data(), response.size(), hopEp);
+                    }else{
+                        sendPacket(response, source);
+                    }
                     break;
                 }
-                case PONG:
+                case PONG:{
+                    auto sent = pingTimes.find(hopEp);
+                    if(sent != pingTimes.end() && source == hopId){
+                        addRttSample(hopId, steadyMicros() - sent->second);
+                        pingTimes.erase(sent);
+                    }
                     break;
+                }
                 case HANDSHAKE:{
-                    PeerId id = packet.get<PeerId>();
-                    if(!routingTable.has(id)){
-                        log(str("connect: ", hex(id, false)), false);
-                        routingTable.add(id, hop.ep);
+                    HandshakeMessage msg;
+                    if(!readMessage(packet, msg, format)){
+                        return;
+                    }
+                    if(addPeer(Peer{msg.id, hopEp, WIRE_V1, false, unixMillis()})){
+                        log(str("connect: ", hex(msg.id, false)), false);
                     }
-                    hop.id = id;
-                    source = hop.id;
+                    hopId = msg.id;
+                    source = hopId;
 
-                    Packet response;
-                    response.add(HANDSHAKE_REPLY);
-                    response.add(localId());
-                    sendPacket(response, source);
+                    Packet response(routeHeaderSize);
+                    addMessage(response, HandshakeReplyMessage{routingTable.localPeer().id});
+                    addMessage(response, CompactMessage());
+                    addMessage(response, CompressionMessage());
+                    //reply directly, the peer is not in the table if its bucket is full
+                    write(response.data(), response.size(), hopEp);
                     break;
                 }
                 case HANDSHAKE_REPLY:{
-                    PeerId id = packet.get<PeerId>();
-                    if(!routingTable.has(id)){
-                        log(str("connect: ", hex(id, false)), false);
-                        routingTable.add(id, hop.ep);
+                    HandshakeReplyMessage msg;
+                    if(!readMessage(packet, msg, format)){
+                        return;
+                    }
+                    if(addPeer(Peer{msg.id, hopEp, WIRE_V1, false, unixMillis()})){
+                        log(str("connect: ", hex(msg.id, false)), false);
+                    }
+                    hopId = msg.id;
+                    source = hopId;
+
+                    auto sent = handshakeTimes.find(hopEp);
+                    if(sent != handshakeTimes.end()){
+                        addRttSample(msg.id, steadyMicros() - sent->second);
+                        handshakeTimes.erase(sent);
+                    }
+                    //the direct path works, a peer that did not fit into its bucket is pinned
+                    if(upgrades.erase(msg.id) && routingTable.pin(Peer{msg.id, hopEp, WIRE_V1, false, unixMillis()})){
+                        tableChanged = true;
+                        log(str("direct link: ", hex(msg.id, false)), true);
                     }
-                    hop.id = id;
-                    source = hop.id;
                     break;
                 }
-                case LOOKUP:{
-                    PeerId relayId = packet.get<PeerId>();
+                case FIND_NODE:{
+                    FindNodeMessage msg;
+                    if(!readMessage(packet, msg, format)){
+                        return;
+                    }
+                    if(addPeer(Peer{msg.id, hopEp, WIRE_V1, false, unixMillis()})){
+                        log(str("connect: ", hex(msg.id, false)), false);
+                    }
+                    hopId = msg.id;
+                    source = hopId;
+
+                    WireFormat replyFormat = formatOf(hopId);
                     Packet response;
-                    response.add(LOOKUP_REPLY);
-                    response.add(localId());
-                    response.add(routingTable.localPeer().ep.getPort());
-                    response.addStr(routingTable.localPeer().ep.getAddress());
-
-                    Packet route;
-                    route.add(ROUTE);
-                    route.add(localId());
-                    route.add(source);
-                    route.add((int)response.size());
-                    route.add(response.data(), response.size());
-
-                    Packet route2;
-                    route2.add(ROUTE);
-                    route2.add(localId());
-                    route2.add(relayId);
-                    route2.add((int) route.size());
-                    route2.add(route.data(), route.size());
-                    auto &next = routingTable.getNext(relayId, localId());
-                    socket.write(route2.data(), route2.size(), next.ep);
+                    addMessage(response, FindNodeReplyMessage{msg.lookupId, routingTable.localPeer().id}, replyFormat);
+                    addMessage(response, CompactMessage(), replyFormat);
+                    addMessage(response, CompressionMessage(), replyFormat);
+                    for(auto &peer : routingTable.getClosest(msg.target, routingTable.bucketSize, hopId)){
+                        addMessage(response, NodeMessage{peer.id, peer.ep.getPort(), peer.ep.getAddress()}, replyFormat);
+                    }
+                    //reply directly, the querier might not be in the table
+                    write(response.data(), response.size(), hopEp);
                     break;
                 }
-                case LOOKUP_REPLY:{
-                    PeerId id = packet.get<PeerId>();
-                    uint16_t port = packet.get<uint16_t>();
-                    std::string address = packet.getStr();
+                case FIND_NODE_REPLY:{
+                    FindNodeReplyMessage msg;
+                    if(!readMessage(packet, msg, format)){
+                        return;
+                    }
+                    if(addPeer(Peer{msg.id, hopEp, WIRE_V1, false, unixMillis()})){
+                        log(str("connect: ", hex(msg.id, false)), false);
+                    }
+                    hopId = msg.id;
+                    source = hopId;
 
-                    Endpoint ep(address.c_str(), port, true);
-                    if(!routingTable.has(id)) {
-                        log(str("connect: ", hex(id, false)), false);
-                        routingTable.add(id, ep);
+                    //packed datagrams can hold the replies of several lookups
+                    if(replyLookupId != 0){
+                        stepLookup(replyLookupId);
+                    }
+                    replyLookupId = 0;
+                    auto entry = lookups.find(msg.lookupId);
+                    if(entry != lookups.end()){
+                        uint64_t sent = entry->second.answer(msg.id, hopEp);
+                        if(sent != 0){
+                            addRttSample(msg.id, steadyMicros() - sent);
+                            replyLookupId = msg.lookupId;
+                        }else{
+                            stepLookup(msg.lookupId);
+                        }
+                    }
+                    break;
+                }
+                case NODE:{
+                    NodeMessage msg;
+                    if(!readMessage(packet, msg, format)){
+                        return;
+                    }
+                    auto entry = lookups.find(replyLookupId);
+                    if(entry != lookups.end()){
+                        entry->second.addContact(msg.id, Endpoint(msg.address.c_str(), msg.port, true));
+                    }
+                    break;
+                }
+                case LOOKUP:{
+                    LookupMessage msg;
+                    if(!readMessage(packet, msg, format)){
+                        return;
+                    }
+                    Packet response(2 * routeHeaderSize);
+                    addMessage(response, LookupReplyMessage{routingTable.localPeer().id, routingTable.localPeer().ep.getPort(), routingTable.localPeer().ep.getAddress()}, formatOf(source));
+                    //the peers closest to the looked up id (the ROUTE destination) as well,
+                    //routing ends at the closest peer the path knows, which might not be the closest peer
+                    for(auto &peer : routingTable.getClosest(destination, lookupReplyCount, source)){
+                        addMessage(response, LookupReplyMessage{peer.id, peer.ep.getPort(), peer.ep.getAddress()}, formatOf(source));
+                    }
 
-                        Packet response;
-                        response.add(HANDSHAKE);
-                        response.add(localId());
-                        socket.write(response.data(), response.size(), ep);
+                    //route back to the source through the relay, the inner header is read by the relay
+                    auto &next = routingTable.getNext(msg.relayId, routingTable.localPeer().id);
+                    prependRoute(response, routingTable.localPeer().id, source, formatOf(msg.relayId));
+                    prependRoute(response, routingTable.localPeer().id, msg.relayId, next.format);
+                    write(response.data(), response.size(), next.ep);
+                    break;
+                }
+                case LOOKUP_REPLY:{
+                    LookupReplyMessage msg;
+                    if(!readMessage(packet, msg, format)){
+                        return;
+                    }
+
+                    Endpoint ep(msg.address.c_str(), msg.port, true);
+                    if(!routingTable.has(msg.id)) {
+                        if(addPeer(Peer{msg.id, ep})){
+                            log(str("connect: ", hex(msg.id, false)), false);
+                        }
+                        //handshake even if our bucket is full, the peer may need us in one of its closer buckets
+                        handshake(ep);
                     }
                     break;
                 }
                 case ROUTE:{
-                    source = packet.get<PeerId>();
-                    destination = packet.get<PeerId>();
-                    int payloadSize = packet.get<int>();
-                    auto &next = routingTable.getNext(destination, hop.id);
-                    if(next.id != localId()){
-                        socket.write(&packet.buffer[packetStart], packet.offset - packetStart + payloadSize, next.ep);
-                        packet.skip(payloadSize);
-                        source = hop.id;
-                        destination = localId();
+                    RouteMessage msg;
+                    if(!readMessage(packet, msg, format)){
+                        return;
+                    }
+                    if(msg.payloadSize < 0 || msg.payloadSize > packet.size()){
+                        log("invalid ROUTE payload size", true);
+                        return;
+                    }
+                    source = msg.source;
+                    destination = msg.destination;
+                    auto &next = routingTable.getNext(destination, hopId);
+                    if(next.id != routingTable.localPeer().id){
+                        if(cachedKeys == 0 || !answerFromCache(packet, msg, format, hopId)){
+                            forwardRoute(packet, packetStart, msg, format, next);
+                        }
+                        packet.skip(msg.payloadSize);
+                        source = hopId;
+                        destination = routingTable.localPeer().id;
                     }
                     break;
                 }
                 case BROADCAST:{
-                    PeerId broadcastSource = packet.get<PeerId>();
-                    Blob<32> broadcastId = packet.get<Blob<32>>();
-                    std::string msg = packet.getStr();
-                    if(broadcastIds.find(broadcastId) == broadcastIds.end()){
-                        broadcastIds[broadcastId] = true;
+                    BroadcastMessage msg;
+                    if(!readMessage(packet, msg, format)){
+                        return;
+                    }
+                    if(broadcastIds.insert(msg.broadcastId, steadyMicros() / 1000)){
+                        std::string text;
+                        if(compressed && !compressor.decompress(msg.msg.data(), msg.msg.size(), text)){
+                            log("could not decompress BROADCAST", true);
+                            break;
+                        }
+                        if(compressed){
+                            msg.msg = text;
+                        }
+
+                        //peers that can not read the received encoding get the message re-encoded in their format
+                        Packet packets[2];
                         for(auto &peer : routingTable.peers){
-                            if(peer.ep != hop.ep && peer.id != localId()){
-                                if((broadcastSource ^ peer.id) > (broadcastSource ^ localId())){
-                                    socket.write(&packet.buffer[packetStart], packet.offset - packetStart, peer.ep);
+                            if(peer.ep != hopEp && peer.id != routingTable.localPeer().id){
+                                if((msg.source ^ peer.id) > (msg.source ^ routingTable.localPeer().id)){
+                                    if(canForward(peer, format, compressed)){
+                                        forwardPacket(packet, packetStart, packet.offset - packetStart, format, peer.ep);
+                                    }else{
+                                        Packet &encoded = packets[peer.format == WIRE_V2 ? 1 : 0];
+                                        if(encoded.size() == 0){
+                                            addMessage(encoded, msg, payloadFormat(peer.format, msg.msg));
+                                        }
+                                        write(encoded.data(), encoded.size(), peer.ep);
+                                    }
+                                }
+                            }
+                        }
+                        if(compressed){
+                            deliver(msg.source, std::move(text));
+                        }else{
+                            deliver(msg.source, msg.msg);
+                        }
+                    }
+                    break;
+                }
+                case TREE_BROADCAST:{
+                    TreeBroadcastMessage msg;
+                    if(!readMessage(packet, msg, format)){
+                        return;
+                    }
+                    if(broadcastIds.insert(msg.broadcastId, steadyMicros() / 1000)){
+                        std::string text;
+                        if(compressed && !compressor.decompress(msg.msg.data(), msg.msg.size(), text)){
+                            log("could not decompress TREE_BROADCAST", true);
+                            break;
+                        }
+                        if(compressed){
+                            msg.msg = text;
+                        }
+
+                        //the limit is the first byte after the opcode, it is patched for each bucket
+                        int limitPosition = packetStart + (format == WIRE_V2 ? 1 : sizeof(Opcode));
+                        Packet packets[2];
+                        for(int level = std::min<int>(msg.limit, PeerId::bits) - 1; level >= 0; level--){
+                            for(auto &peer : meshPeers(level)){
+                                if(canForward(peer, format, compressed)){
+                                    packet.set(limitPosition, (uint8_t)level);
+                                    forwardPacket(packet, packetStart, packet.offset - packetStart, format, peer.ep);
+                                }else{
+                                    //peers that can not read the received encoding get the message re-encoded in their format
+                                    Packet &encoded = packets[peer.format == WIRE_V2 ? 1 : 0];
+                                    WireFormat encodedFormat = payloadFormat(peer.format, msg.msg);
+                                    if(encoded.size() == 0){
+                                        addMessage(encoded, msg, encodedFormat);
+                                    }
+                                    encoded.set(encoded.offset + (encodedFormat == WIRE_V2 ? 2 : sizeof(Opcode)), (uint8_t)level);
+                                    write(encoded.data(), encoded.size(), peer.ep);
                                 }
                             }
                         }
-                        if(msgCallback){
-                            msgCallback(broadcastSource, msg);
+                        cacheBroadcast(msg.broadcastId, msg.source, msg.msg);
+                        if(compressed){
+                            deliver(msg.source, std::move(text));
+                        }else{
+                            deliver(msg.source, msg.msg);
                         }
                     }
                     break;
                 }
+                case IHAVE:{
+                    IHaveMessage msg;
+                    if(!readMessage(packet, msg, format)){
+                        return;
+                    }
+                    if(gossipInterval > 0 && !broadcastIds.contains(msg.broadcastId)){
+                        uint64_t now = steadyMicros() / 1000;
+                        auto want = wants.find(msg.broadcastId);
+                        //ask the next peer that has it if the last IWANT was not answered within a round
+                        if(want == wants.end() || now - want->second > gossipInterval){
+                            wants[msg.broadcastId] = now;
+                            addMessage(wantPacket, IWantMessage{msg.broadcastId}, formatOf(hopId));
+                        }
+                    }
+                    break;
+                }
+                case IWANT:{
+                    IWantMessage msg;
+                    if(!readMessage(packet, msg, format)){
+                        return;
+                    }
+                    auto cached = gossipCache.find(msg.broadcastId);
+                    if(cached != gossipCache.end()){
+                        //limit 0, the requester does not forward it, its subtree repairs itself the same way
+                        const Peer &peer = routingTable.get(hopId);
+                        std::string compressed;
+                        bool useCompression = peer.format == WIRE_V2 && peer.compression && compressPayload(cached->second.msg, compressed);
+                        std::string_view payload = useCompression ? compressed : cached->second.msg;
+                        Packet response;
+                        addMessage(response, TreeBroadcastMessage{0, cached->second.source, msg.broadcastId, payload},
+                            payloadFormat(peer.format, payload), useCompression);
+                        write(response.data(), response.size(), hopEp);
+                    }
+                    break;
+                }
                 case MESSAGE:{
-                    std::string msg = packet.getStr();
-                    if(destination.data[sizeof(PeerId)-1] == localId().data[sizeof(PeerId)-1]){
-                        if(destination.data[sizeof(PeerId)-2] == localId().data[sizeof(PeerId)-2]){
-                            if(msgCallback){
-                                msgCallback(source, msg);
+                    DataMessage msg;
+                    if(!readMessage(packet, msg, format)){
+                        return;
+                    }
+                    if(destination.data[sizeof(PeerId)-1] == routingTable.localPeer().id.data[sizeof(PeerId)-1]){
+                        if(destination.data[sizeof(PeerId)-2] == routingTable.localPeer().id.data[sizeof(PeerId)-2]){
+                            std::string text;
+                            if(compressed && !compressor.decompress(msg.msg.data(), msg.msg.size(), text)){
+                                log("could not decompress MESSAGE", true);
+                                break;
+                            }
+                            if(compressed){
+                                deliver(source, std::move(text));
+                            }else{
+                                deliver(source, msg.msg);
+                            }
+                        }
+                    }
+                    break;
+                }
+                case RELIABLE:{
+                    ReliableMessage msg;
+                    if(!readMessage(packet, msg, format)){
+                        return;
+                    }
+                    if(source == PeerId(0)){
+                        break;
+                    }
+                    std::string text;
+                    if(compressed && !compressor.decompress(msg.msg.data(), msg.msg.size(), text)){
+                        //not acknowledged, the sender retransmits it
+                        log("could not decompress RELIABLE", true);
+                        break;
+                    }
+                    if(!compressed){
+                        text = msg.msg;
+                    }
+                    auto receiver = receivers.find(source);
+                    if(receiver == receivers.end() || receiver->second.session != msg.session){
+                        //a new session, the sender restarted or gave up on the previous one
+                        receiver = receivers.insert_or_assign(source, ReliableReceiver(msg.session, reassemblyBytes)).first;
+                    }
+                    std::vector<std::string> messages;
+                    receiver->second.receive(msg.sequence, msg.more != 0, text, messages);
+
+                    Packet ack(routeHeaderSize);
+                    addMessage(ack, AckMessage{msg.session, receiver->second.expected, receiver->second.mask()}, formatOf(source));
+                    sendPacket(ack, source);
+                    for(auto &text : messages){
+                        deliver(source, std::move(text));
+                    }
+                    break;
+                }
+                case ACK:{
+                    AckMessage msg;
+                    if(!readMessage(packet, msg, format)){
+                        return;
+                    }
+                    auto sender = senders.find(source);
+                    if(sender != senders.end() && sender->second.session == msg.session){
+                        sender->second.ack(msg.expected, msg.mask, steadyMicros());
+                        flushReliable(source);
+                    }
+                    break;
+                }
+                case STREAM:{
+                    StreamMessage msg;
+                    if(!readMessage(packet, msg, format)){
+                        return;
+                    }
+                    StreamFrame frame;
+                    if(source == PeerId(0) || Schema<StreamFrame>::read(msg.frame.data(), msg.frame.data() + msg.frame.size(), frame, WIRE_V2) == nullptr){
+                        break;
+                    }
+                    auto receiver = streamReceivers.find(source);
+                    if(receiver == streamReceivers.end() || receiver->second.session != msg.session){
+                        //a new session, the sender restarted or gave up on the previous one
+                        receiver = streamReceivers.insert_or_assign(source, StreamReceiver(msg.session, streamWindow)).first;
+                    }
+                    std::vector<StreamReceiver::Delivery> deliveries;
+                    if(receiver->second.accept(msg.sequence)){
+                        if(frame.flags & STREAM_WINDOW){
+                            //for a stream of the local peer
+                            auto sender = streamSenders.find(source);
+                            if(sender != streamSenders.end()){
+                                sender->second.extend(frame.stream, frame.offset);
                             }
+                        }else{
+                            uint64_t limit = receiver->second.receive(frame, deliveries);
+                            if(limit != 0){
+                                streamSender(source).sendWindow(frame.stream, limit);
+                            }
+                        }
+                    }
+
+                    Packet ack(routeHeaderSize);
+                    addMessage(ack, StreamAckMessage{msg.session, receiver->second.expected, receiver->second.mask()}, WIRE_V2);
+                    sendPacket(ack, source);
+                    flushStreams(source);
+                    if(streamCallback){
+                        for(auto &delivery : deliveries){
+                            streamCallback(source, delivery.stream, delivery.data, delivery.fin);
                         }
                     }
                     break;
                 }
+                case STREAM_ACK:{
+                    StreamAckMessage msg;
+                    if(!readMessage(packet, msg, format)){
+                        return;
+                    }
+                    auto sender = streamSenders.find(source);
+                    if(sender != streamSenders.end() && sender->second.reliable.session == msg.session){
+                        sender->second.reliable.ack(msg.expected, msg.mask, steadyMicros());
+                        flushStreams(source);
+                    }
+                    break;
+                }
+                case FRAGMENT:{
+                    FragmentMessage msg;
+                    if(!readMessage(packet, msg, format)){
+                        return;
+                    }
+                    if(source == PeerId(0)){
+                        break;
+                    }
+                    std::string whole;
+                    bool wholeCompressed = false;
+                    Fragment fragment{source, msg.messageId, msg.index, msg.count, compressed, std::string(msg.data)};
+                    if(reassembler.add(fragment, steadyMicros() / 1000, whole, wholeCompressed)){
+                        std::string text;
+                        if(wholeCompressed && !compressor.decompress(whole.data(), whole.size(), text)){
+                            log("could not decompress FRAGMENT", true);
+                            break;
+                        }
+                        deliver(source, std::move(wholeCompressed ? text : whole));
+                    }
+                    scheduleFragments();
+                    break;
+                }
+                case FRAGMENT_NACK:{
+                    FragmentNackMessage msg;
+                    if(!readMessage(packet, msg, format)){
+                        return;
+                    }
+                    fragmentSender.nack(source, msg.messageId, msg.first, msg.count, steadyMicros() / 1000);
+                    scheduleFragments();
+                    break;
+                }
                 case DISCONNECT:{
-                    if(source == hop.id) {
-                        if (routingTable.remove(source)) {
+                    if(source == hopId) {
+                        if (removePeer(source)) {
                             log(str("disconnect: ", hex(source, false)), false);
                             lookup(routingTable.lookupTarget(routingTable.getLevel(source)));
                         }
+                    }
+                    break;
+                }
+                case PUT:{
+                    PutMessage msg;
+                    if(!readMessage(packet, msg, format)){
+                        return;
+                    }
+                    if(msg.flags & STORE_REPLICA){
+                        //a version from too far in the future could never be replaced
+                        bool plausible = plausibleVersion(msg.version);
+                        if(plausible){
+                            store.apply(std::string(msg.key), msg.value, msg.version, false);
+                        }
+                        if(msg.requestId != 0){
+                            //a newer version counts as stored as well. reply directly, the coordinator might not be in the table
+                            Packet response;
+                            addMessage(response, PutReplyMessage{msg.requestId, (uint8_t)plausible}, WIRE_V2);
+                            write(response.data(), response.size(), hopEp);
+                        }
+                    }else{
+                        coordinate(addStoreRequest(PUT, std::string(msg.key), source, msg.requestId, hopId), msg.value);
+                    }
+                    break;
+                }
+                case DELETE:{
+                    DeleteMessage msg;
+                    if(!readMessage(packet, msg, format)){
+                        return;
+                    }
+                    if(msg.flags & STORE_REPLICA){
+                        bool plausible = plausibleVersion(msg.version);
+                        if(plausible){
+                            store.apply(std::string(msg.key), std::string_view(), msg.version, true);
+                        }
+                        if(msg.requestId != 0){
+                            Packet response;
+                            addMessage(response, PutReplyMessage{msg.requestId, (uint8_t)plausible}, WIRE_V2);
+                            write(response.data(), response.size(), hopEp);
+                        }
+                    }else{
+                        coordinate(addStoreRequest(DELETE, std::string(msg.key), source, msg.requestId, hopId), std::string_view());
+                    }
+                    break;
+                }
+                case PUT_REPLY:{
+                    PutReplyMessage msg;
+                    if(!readMessage(packet, msg, format)){
+                        return;
+                    }
+                    auto entry = storeRequests.find(msg.requestId);
+                    if(entry == storeRequests.end()){
+                        break;
+                    }
+                    if(!entry->second.coordinating){
+                        finishStoreRequest(msg.requestId, msg.stored);
+                    }else if(msg.stored && ++entry->second.answers == entry->second.needed){
+                        finishStoreRequest(msg.requestId, true);
+                    }
+                    break;
+                }
+                case GET:{
+                    GetMessage msg;
+                    if(!readMessage(packet, msg, format)){
+                        return;
+                    }
+                    if(msg.flags & STORE_REPLICA){
+                        KeyValueStore::Record *record = store.find(std::string(msg.key));
+                        uint8_t state = record == nullptr ? STORE_MISSING : record->deleted ? STORE_DELETED : STORE_FOUND;
+                        Packet response;
+                        addMessage(response, GetReplyMessage{msg.requestId, state, record ? record->version : 0,
+                            msg.key, record ? std::string_view(record->value) : std::string_view()}, WIRE_V2);
+                        write(response.data(), response.size(), hopEp);
+                    }else{
+                        coordinate(addStoreRequest(GET, std::string(msg.key), source, msg.requestId, hopId), std::string_view());
+                    }
+                    break;
+                }
+                case GET_REPLY:{
+                    GetReplyMessage msg;
+                    if(!readMessage(packet, msg, format)){
+                        return;
+                    }
+                    //a record with a version from too far in the future is not cached or repaired to other replicas
+                    if(msg.state != STORE_FAILED && !plausibleVersion(msg.version)){
+                        msg.state = STORE_FAILED;
+                    }
+                    if(msg.requestId == 0){
+                        //a hot record from a peer this one forwarded GETs to
+                        if(storeCacheTime > 0 && (msg.state == STORE_FOUND || msg.state == STORE_DELETED)){
+                            CachedRecord &cached = storeCache[std::string(msg.key)];
+                            if(msg.version >= cached.record.version){
+                                cached.record.value = msg.value;
+                                cached.record.version = msg.version;
+                                cached.record.deleted = msg.state == STORE_DELETED;
+                                cached.expires = steadyMicros() / 1000 + storeCacheTime;
+                            }
+                            cachedKeys = storeCache.size();
+                        }
                         break;
                     }
+                    auto entry = storeRequests.find(msg.requestId);
+                    if(entry == storeRequests.end() || (msg.state == STORE_FAILED && entry->second.coordinating)){
+                        break;
+                    }
+                    StoreRequest &request = entry->second;
+                    if(msg.state != STORE_FAILED && msg.version >= request.record.version){
+                        request.record.value = msg.value;
+                        request.record.version = msg.version;
+                        request.record.deleted = msg.state != STORE_FOUND;
+                    }
+                    if(!request.coordinating){
+                        finishStoreRequest(msg.requestId, msg.state != STORE_FAILED);
+                    }else{
+                        request.versions.push_back({source, hopEp, msg.version});
+                        if(++request.answers == request.needed){
+                            finishStoreRequest(msg.requestId, true);
+                        }
+                    }
+                    break;
+                }
+                case SUBSCRIBE:{
+                    SubscribeMessage msg;
+                    if(!readMessage(packet, msg, format)){
+                        return;
+                    }
+                    bool member = topics.find(msg.topicId) != topics.end();
+                    Topic &topic = topics[msg.topicId];
+                    uint64_t now = steadyMicros() / 1000;
+                    auto child = std::find_if(topic.children.begin(), topic.children.end(), [&](const TopicChild &child){
+                        return child.id == msg.id;
+                    });
+                    if(child != topic.children.end()){
+                        child->ep = hopEp;
+                        child->refreshed = now;
+                    }else{
+                        topic.children.push_back({msg.id, hopEp, now});
+                    }
+                    //the path to the root exists from here on
+                    if(!member){
+                        joinTopic(msg.topicId);
+                    }
+                    break;
+                }
+                case UNSUBSCRIBE:{
+                    UnsubscribeMessage msg;
+                    if(!readMessage(packet, msg, format)){
+                        return;
+                    }
+                    auto entry = topics.find(msg.topicId);
+                    if(entry != topics.end()){
+                        auto &children = entry->second.children;
+                        children.erase(std::remove_if(children.begin(), children.end(), [&](const TopicChild &child){
+                            return child.id == msg.id;
+                        }), children.end());
+                        leaveTopic(msg.topicId);
+                    }
+                    break;
+                }
+                case PUBLISH:{
+                    PublishMessage msg;
+                    if(!readMessage(packet, msg, format)){
+                        return;
+                    }
+                    //routed to the root, or sent down by the parent
+                    publishDown(msg, (msg.flags & PUBLISH_DOWN) ? hopEp : Endpoint());
+                    break;
+                }
+                case COMPACT:{
+                    routingTable.setFormat(hopId, WIRE_V2);
+                    tableChanged = true;
+                    break;
+                }
+                case COMPRESSION:{
+                    routingTable.setCompression(hopId, true);
+                    tableChanged = true;
+                    break;
                 }
                 default:
+                    //the size of unknown messages is unknown, the rest of the packet can not be parsed
                     log("invalid opcode");
+                    return;
             }
 
             if(opcode != ROUTE){
-                source = hop.id;
-                destination = localId();
+                source = hopId;
+                destination = routingTable.localPeer().id;
             }
         }
-    }
 
-    void PeerNetwork::lookup(const PeerId &target) {
-        auto &next = routingTable.getNext(target, localId());
-        Packet packet;
-        packet.add(LOOKUP);
-        packet.add(next.id);//relayId for routing back through the first hop
-        sendPacket(packet, target);
+        if(replyLookupId != 0){
+            stepLookup(replyLookupId);
+        }
+        if(wantPacket.size() > 0){
+            write(wantPacket.data(), wantPacket.size(), hopEp);
+        }
     }
 
-    void PeerNetwork::sendPacket(Packet &packet, const PeerId &destination) {
-        auto &next = routingTable.getNext(destination, localId());
-        if(next.id == destination){
-            socket.write(packet.data(), packet.size(), next.ep);
+    template<typename T>
+    void PeerNetwork::addMessage(Packet &packet, const T &msg, WireFormat format, bool compressed) {
+        int size = Schema<T>::size(msg, format);
+        if(format == WIRE_V2){
+            //packets are built in one format, only the first message needs a marker
+            packet.reserve(2 + size);
+            if(packet.size() == 0){
+                packet.add(WIRE_V2_MARKER);
+            }
+            packet.add((uint8_t)((uint8_t)T::opcode | (compressed ? COMPRESSED_FLAG : 0)));
         }else{
-            Packet route;
-            route.add(ROUTE);
-            route.add(localId());
-            route.add(destination);
-            route.add((int)packet.size());
-            route.add(packet.data(), packet.size());
-            socket.write(route.data(), route.size(), next.ep);
+            packet.reserve(sizeof(Opcode) + size);
+            packet.add(T::opcode);
         }
+        Schema<T>::write(packet.extend(size), msg, format);
     }
 
-    void PeerNetwork::broadcast(const std::string &msg){
-        Blob<32> broadcastId = randomId<32>();
-
-        Packet packet;
-        packet.add(BROADCAST);
-        packet.add(localId());
-        packet.add(broadcastId);
-        packet.addStr(msg);
-
-        broadcastIds[broadcastId] = true;
-        for(auto &peer : routingTable.peers){
-            if(peer.id != localId()){
-                socket.write(packet.data(), packet.size(), peer.ep);
-            }
+    template<typename T>
+    void PeerNetwork::prependMessage(Packet &packet, const T &msg, WireFormat format) {
+        int size = Schema<T>::size(msg, format);
+        if(format == WIRE_V2){
+            char *ptr = packet.extendFront(1 + size);
+            *ptr = (char)T::opcode;
+            Schema<T>::write(ptr + 1, msg, format);
+        }else{
+            char *ptr = packet.extendFront(sizeof(Opcode) + size);
+            std::memcpy(ptr, &T::opcode, sizeof(Opcode));
+            Schema<T>::write(ptr + sizeof(Opcode), msg, format);
         }
     }
 
-    void PeerNetwork::send(const std::string &msg, const PeerId &id) {
+    template<typename T>
+    bool PeerNetwork::readMessage(Packet &packet, T &msg, WireFormat format) {
+        if(!Schema<T>::read(packet, msg, format)){
+            log(str("invalid ", opcodeName(T::opcode), " message"), true);
+            return false;
+        }
+        return true;
+    }
+
+    bool PeerNetwork::readOpcode(Packet &packet, Opcode &opcode, bool &compressed, WireFormat format) {
+        if(format == WIRE_V2){
+            uint8_t value = 0;
+            if(!packet.read(value)){
+                return false;
+            }
+            compressed = value & COMPRESSED_FLAG;
+            opcode = (Opcode)(value & ~COMPRESSED_FLAG);
+            return true;
+        }else{
+            compressed = false;
+            return packet.read(opcode);
+        }
+    }
+
+    void PeerNetwork::publishTable(bool force) {
+        if(tableChanged || force){
+            publishedTable.publish(std::make_unique<PeerRoutingTable>(routingTable));
+            tableChanged = false;
+        }
+    }
+
+    //peers added or removed are published after the datagram, rtt samples only with the next forced publish
+    bool PeerNetwork::addPeer(const Peer &peer) {
+        if(!routingTable.has(peer.id) && routingTable.add(peer)){
+            tableChanged = true;
+            placementChanged = true;
+            return true;
+        }
+        return false;
+    }
+
+    bool PeerNetwork::removePeer(const PeerId &id) {
+        int level = routingTable.getLevel(id);
+        if(routingTable.remove(id)){
+            bucketRefreshes.erase(level);
+            tableChanged = true;
+            placementChanged = true;
+            if(!topics.empty()){
+                repairTopics(id);
+            }
+            return true;
+        }
+        return false;
+    }
+
+    void PeerNetwork::addRttSample(const PeerId &id, int micros) {
+        routingTable.addRttSample(id, micros);
+    }
+
+    //the callbacks get views, batchCallback after the datagram is processed
+    void PeerNetwork::deliver(const PeerId &source, std::string_view msg) {
+        std::span<const std::byte> view((const std::byte*)msg.data(), msg.size());
+        if(dataCallback){
+            dataCallback(source, view);
+        }
+        if(msgCallback){
+            msgCallback(source, std::string(msg));
+        }
+        if(batchCallback){
+            batch.push_back({source, view});
+        }
+    }
+
+    //a message that is not in the receive buffer, kept until the batch is delivered
+    void PeerNetwork::deliver(const PeerId &source, std::string &&msg) {
+        if(batchCallback){
+            batchStorage.push_back(std::move(msg));
+            deliver(source, std::string_view(batchStorage.back()));
+        }else{
+            deliver(source, std::string_view(msg));
+        }
+    }
+
+    void PeerNetwork::flushBatch() {
+        if(!batch.empty()){
+            if(batchCallback){
+                batchCallback(batch);
+            }
+            batch.clear();
+        }
+        batchStorage.clear();
+    }
+
+    bool PeerNetwork::compressPayload(std::string_view msg, std::string &output) {
+        if(compressionThreshold < 0 || (int)msg.size() < compressionThreshold){
+            return false;
+        }
+        return compressor.compress(msg.data(), msg.size(), output);
+    }
+
+    //payloads with NUL can only be encoded in WIRE_V2, the ROUTE and format markers let every hop carry them
+    WireFormat PeerNetwork::payloadFormat(WireFormat format, std::string_view payload) {
+        if(format == WIRE_V1 && std::memchr(payload.data(), '\0', payload.size()) != nullptr){
+            return WIRE_V2;
+        }
+        return format;
+    }
+
+    //the peer can read a message received in format, compressed or not
+    bool PeerNetwork::canForward(const Peer &peer, WireFormat format, bool compressed) {
+        return (format != WIRE_V2 || peer.format == WIRE_V2) && (!compressed || peer.compression);
+    }
+
+    WireFormat PeerNetwork::formatOf(const PeerId &id) {
+        return routingTable.get(id).format;
+    }
+
+    std::future<std::vector<Peer>> PeerNetwork::lookup(const PeerId &target, std::function<void(const std::vector<Peer> &peers)> callback) {
+        std::lock_guard<std::recursive_mutex> lock(mutex);
+        uint32_t lookupId = nextLookupId++;
+        if(nextLookupId == 0){
+            nextLookupId = 1;
+        }
+        auto &lookup = lookups.try_emplace(lookupId, target, routingTable.localPeer().id, lookupParallelism, routingTable.bucketSize).first->second;
+        lookup.callback = callback;
+        for(auto &peer : routingTable.getClosest(target, routingTable.bucketSize)){
+            lookup.addContact(peer.id, peer.ep);
+        }
+        auto future = lookup.promise.get_future();
+        stepLookup(lookupId);
+        return future;
+    }
+
+    //send the next queries of a lookup or finish it
+    void PeerNetwork::stepLookup(uint32_t lookupId) {
+        auto entry = lookups.find(lookupId);
+        if(entry == lookups.end()){
+            return;
+        }
+        PeerLookup &lookup = entry->second;
+        for(auto &peer : lookup.next(steadyMicros())){
+            //contacts that are not in the table get the query in WIRE_V1
+            WireFormat format = formatOf(peer.id);
+            Packet packet;
+            addMessage(packet, FindNodeMessage{lookupId, routingTable.localPeer().id, lookup.target}, format);
+            addMessage(packet, CompactMessage(), format);
+            addMessage(packet, CompressionMessage(), format);
+            write(packet.data(), packet.size(), peer.ep);
+        }
+        if(lookup.done()){
+            std::vector<Peer> result = lookup.result();
+            auto callback = std::move(lookup.callback);
+            lookup.promise.set_value(result);
+            lookups.erase(entry);
+            if(callback){
+                callback(result);
+            }
+        }
+    }
+
+    void PeerNetwork::expireLookups() {
+        if(lookups.empty()){
+            return;
+        }
+        uint64_t time = steadyMicros() - lookupTimeout * 1000ull;
+        std::vector<uint32_t> ids;
+        for(auto &entry : lookups){
+            entry.second.expire(time);
+            ids.push_back(entry.first);
+        }
+        for(uint32_t id : ids){
+            stepLookup(id);
+        }
+    }
+
+    void PeerNetwork::refresh() {
+        uint64_t now = steadyMicros() / 1000;
+        for(int level : routingTable.refreshLevels()){
+            BucketRefresh &refresh = bucketRefreshes[level];
+            if(now < refresh.next){
+                continue;
+            }
+            //a lookup costs a few dozen datagrams, buckets the network has no more peers for are looked up less often
+            int before = routingTable.getBucket(level, routingTable.bucketSize).size();
+            refresh.next = UINT64_MAX;
+            lookup(routingTable.lookupTarget(level), [this, level, before](const std::vector<Peer> &){
+                BucketRefresh &refresh = bucketRefreshes[level];
+                int after = routingTable.getBucket(level, routingTable.bucketSize).size();
+                refresh.rounds = after > before ? 1 : std::min(refresh.rounds * 2, maxRefreshRounds);
+                refresh.next = steadyMicros() / 1000 + (uint64_t)refresh.rounds * refreshInterval;
+            });
+        }
+    }
+
+    void PeerNetwork::handshake(const Endpoint &ep) {
+        //forget handshakes that were never answered
+        if(handshakeTimes.size() > 1024){
+            handshakeTimes.clear();
+        }
+        handshakeTimes[ep] = steadyMicros();
+
         Packet packet;
-        packet.add(MESSAGE);
-        packet.addStr(msg);
+        addMessage(packet, HandshakeMessage{routingTable.localPeer().id});
+        addMessage(packet, CompactMessage());
+        addMessage(packet, CompressionMessage());
+        write(packet.data(), packet.size(), ep);
+    }
+
+    void PeerNetwork::ping() {
+        //forget pings that were never answered
+        if(pingTimes.size() > 1024){
+            pingTimes.clear();
+        }
+        Packet packets[2];
+        addMessage(packets[0], PingMessage(), WIRE_V1);
+        addMessage(packets[1], PingMessage(), WIRE_V2);
+        uint64_t now = steadyMicros();
+        for(int i = 1; i < routingTable.peers.size(); i++){
+            auto &peer = routingTable.peers[i];
+            Packet &packet = packets[peer.format == WIRE_V2 ? 1 : 0];
+            pingTimes[peer.ep] = now;
+            write(packet.data(), packet.size(), peer.ep);
+        }
+        //the replies keep pinned links from being dropped as dead
+        for(auto &peer : routingTable.pinned){
+            Packet &packet = packets[peer.format == WIRE_V2 ? 1 : 0];
+            pingTimes[peer.ep] = now;
+            write(packet.data(), packet.size(), peer.ep);
+        }
+    }
+
+    void PeerNetwork::write(const char *ptr, int bytes, const Endpoint &ep) {
+        std::lock_guard<std::mutex> lock(writeMutex);
+        auto entry = outbound.find(ep);
+        //only peers that negotiated WIRE_V2 read the format markers between packed datagrams,
+        //older peers and endpoints that are not in the table get every datagram as it is
+        bool packing = entry != outbound.end() && !entry->second.data.empty();
+        if(coalesceDelay < 0 || bytes <= 0 || bytes > maxDatagramSize || (!packing && !readsMarkers(ep))){
+            //keep the order of datagrams to the endpoint
+            if(entry != outbound.end() && !entry->second.data.empty()){
+                writeDatagram(entry->second.data.data(), entry->second.data.size(), ep);
+                entry->second.data.clear();
+            }
+            writeDatagram(ptr, bytes, ep);
+            return;
+        }
+        OutboundBuffer &buffer = entry != outbound.end() ? entry->second : outbound[ep];
+        //every datagram starts in WIRE_V1, a packed one has to switch back to it
+        bool marker = (uint8_t)ptr[0] != WIRE_V1_MARKER && (uint8_t)ptr[0] != WIRE_V2_MARKER;
+        if(!buffer.data.empty() && buffer.data.size() + marker + bytes > maxDatagramSize){
+            writeDatagram(buffer.data.data(), buffer.data.size(), ep);
+            buffer.data.clear();
+        }
+        if(buffer.data.empty()){
+            buffer.deadline = steadyMicros() + coalesceDelay;
+        }else if(marker){
+            buffer.data.push_back((char)WIRE_V1_MARKER);
+        }
+        buffer.data.insert(buffer.data.end(), ptr, ptr + bytes);
+        if(outboundTimer == -1){
+            outboundTimer = handler.addMicroTimer(coalesceDelay / 2, [&](){
+                flushOutbound(false);
+            });
+        }
+    }
+
+    bool PeerNetwork::readsMarkers(const Endpoint &ep) {
+        auto table = publishedTable.read();
+        const Peer *peer = table->find(ep);
+        return peer != nullptr && peer->format == WIRE_V2;
+    }
+
+    //write packed datagrams whose deadline passed, or all of them
+    void PeerNetwork::flushOutbound(bool all) {
+        std::lock_guard<std::mutex> lock(writeMutex);
+        uint64_t now = steadyMicros();
+        for(auto entry = outbound.begin(); entry != outbound.end();){
+            OutboundBuffer &buffer = entry->second;
+            if(!buffer.data.empty() && (all || buffer.deadline <= now)){
+                writeDatagram(buffer.data.data(), buffer.data.size(), entry->first);
+                buffer.data.clear();
+            }
+            if(buffer.data.empty()){
+                entry = outbound.erase(entry);
+            }else{
+                entry++;
+            }
+        }
+        if(outbound.empty() && outboundTimer != -1){
+            handler.removeTimer(outboundTimer);
+            outboundTimer = -1;
+        }
+    }
+
+    void PeerNetwork::writeDatagram(const char *ptr, int bytes, const Endpoint &ep) {
+        sentDatagrams++;
+        sentBytes += bytes;
+        if(linkDelay){
+            int millis = linkDelay(ep);
+            if(millis < 0){
+                return;
+            }
+            if(millis > 0){
+                delayed.push_back({steadyMicros() + millis * 1000ull, std::vector<char>(ptr, ptr + bytes), ep});
+                return;
+            }
+        }
+        socket.write(ptr, bytes, ep);
+    }
+
+    void PeerNetwork::writeDelayed() {
+        std::lock_guard<std::mutex> lock(writeMutex);
+        uint64_t now = steadyMicros();
+        for(int i = 0; i < delayed.size(); i++){
+            if(delayed[i].time <= now){
+                socket.write(delayed[i].data.data(), delayed[i].data.size(), delayed[i].ep);
+                delayed[i] = std::move(delayed.back());
+                delayed.pop_back();
+                i--;
+            }
+        }
+    }
+
+    //the payload has to be encoded in the format of the destination
+    void PeerNetwork::sendPacket(Packet &packet, const PeerId &destination) {
+        auto &next = routingTable.getNext(destination, routingTable.localPeer().id);
+        bool direct = next.id == destination;
+        //a pinned peer or replacement may not know the local peer, the header tells it the source
+        if(!direct || !routingTable.has(destination)){
+            prependRoute(packet, routingTable.localPeer().id, destination, next.format);
+        }
+        if(directRate > 0){
+            countTraffic(destination, direct);
+        }
+        write(packet.data(), packet.size(), next.ep);
+    }
+
+    void PeerNetwork::countTraffic(const PeerId &destination, bool direct) {
+        if(direct){
+            auto count = directCount.find(destination);
+            if(count != directCount.end()){
+                count->second++;
+            }
+            return;
+        }
+        if(++routedCount[destination] != directRate){
+            return;
+        }
+        if(upgrades.count(destination) || routingTable.pinned.size() + upgrades.size() >= maxDirectLinks){
+            return;
+        }
+        //the target answers with its endpoint, the LOOKUP_REPLY handshakes it
+        upgrades[destination] = steadyMicros() / 1000;
+        auto &next = routingTable.getNext(destination, routingTable.localPeer().id);
+        Packet packet(routeHeaderSize);
+        addMessage(packet, LookupMessage{next.id}, next.format);
+        sendPacket(packet, destination);
+    }
+
+    void PeerNetwork::reviewDirectLinks() {
+        uint64_t now = steadyMicros() / 1000;
+        for(auto upgrade = upgrades.begin(); upgrade != upgrades.end();){
+            if(now - upgrade->second > lookupTimeout * 2){
+                upgrade = upgrades.erase(upgrade);
+            }else{
+                upgrade++;
+            }
+        }
+        uint64_t seen = unixMillis() - 2 * pingInterval;
+        std::vector<PeerId> evicted;
+        for(auto &peer : routingTable.pinned){
+            auto count = directCount.find(peer.id);
+            //pinned links start with an empty second
+            if(count == directCount.end()){
+                directCount[peer.id] = 0;
+            }else if(count->second < directRate / 2 || peer.lastSeen < seen){
+                evicted.push_back(peer.id);
+            }
+        }
+        for(auto &id : evicted){
+            routingTable.unpin(id);
+            directCount.erase(id);
+            tableChanged = true;
+            log(str("direct link dropped: ", hex(id, false)), true);
+        }
+        for(auto &count : directCount){
+            count.second = 0;
+        }
+        routedCount.clear();
+        publishTable();
+    }
+
+    void PeerNetwork::prependRoute(Packet &packet, const PeerId &source, const PeerId &destination, WireFormat format) {
+        if(format == WIRE_V2){
+            //a WIRE_V1 payload needs to switch back after the header
+            if(packet.size() == 0 || (uint8_t)packet.data()[0] != WIRE_V2_MARKER){
+                packet.prepend(WIRE_V1_MARKER);
+            }
+            prependMessage(packet, RouteMessage{source, destination, packet.size()}, WIRE_V2);
+            packet.prepend(WIRE_V2_MARKER);
+        }else{
+            prependMessage(packet, RouteMessage{source, destination, packet.size()}, WIRE_V1);
+        }
+    }
+
+    //send already received bytes of a packet, format is the format the bytes are encoded in
+    void PeerNetwork::forwardPacket(Packet &packet, int start, int bytes, WireFormat format, const Endpoint &ep) {
+        if(format == WIRE_V2){
+            if((uint8_t)packet.buffer[start - 1] != WIRE_V2_MARKER){
+                //in a packed datagram the byte before start ends the previous message, which may be queued
+                //for delivery as a view into the buffer, so it is not overwritten
+                Packet forward;
+                forward.add(WIRE_V2_MARKER);
+                forward.add(&packet.buffer[start], bytes);
+                write(forward.data(), forward.size(), ep);
+                return;
+            }
+            //the message follows the marker, it is sent together with it
+            start--;
+            bytes++;
+        }
+        write(&packet.buffer[start], bytes, ep);
+    }
+
+    void PeerNetwork::broadcast(const std::string &msg){
+        broadcast(msg.data(), msg.size());
+    }
+
+    void PeerNetwork::broadcast(std::span<const std::byte> msg){
+        broadcast(msg.data(), msg.size());
+    }
+
+    void PeerNetwork::broadcast(const void *data, size_t size){
+        std::lock_guard<std::recursive_mutex> lock(mutex);
+        std::string_view msg((const char*)data, size);
+        if(treeBroadcast){
+            broadcastTree(msg);
+            return;
+        }
+        Blob<32> broadcastId = randomId<32>();
+
+        //plain WIRE_V1, plain WIRE_V2 and compressed WIRE_V2
+        Packet packets[3];
+        addMessage(packets[0], BroadcastMessage{routingTable.localPeer().id, broadcastId, msg}, payloadFormat(WIRE_V1, msg));
+        addMessage(packets[1], BroadcastMessage{routingTable.localPeer().id, broadcastId, msg}, WIRE_V2);
+        std::string compressed;
+        if(compressPayload(msg, compressed)){
+            addMessage(packets[2], BroadcastMessage{routingTable.localPeer().id, broadcastId, compressed}, WIRE_V2, true);
+        }
+
+        broadcastIds.insert(broadcastId, steadyMicros() / 1000);
+        for(auto &peer : routingTable.peers){
+            if(peer.id != routingTable.localPeer().id){
+                int index = peer.format == WIRE_V2 ? 1 : 0;
+                if(index == 1 && peer.compression && packets[2].size() > 0){
+                    index = 2;
+                }
+                write(packets[index].data(), packets[index].size(), peer.ep);
+            }
+        }
+    }
+
+    //Kademlia style broadcast: the peers sent to in bucket level are responsible for all ids that differ from
+    //the local id first at bit level, they forward the message to their buckets below level in the same way
+    void PeerNetwork::broadcastTree(std::string_view msg) {
+        Blob<32> broadcastId = randomId<32>();
+
+        //plain WIRE_V1, plain WIRE_V2 and compressed WIRE_V2
+        Packet packets[3];
+        WireFormat plainFormat = payloadFormat(WIRE_V1, msg);
+        addMessage(packets[0], TreeBroadcastMessage{0, routingTable.localPeer().id, broadcastId, msg}, plainFormat);
+        addMessage(packets[1], TreeBroadcastMessage{0, routingTable.localPeer().id, broadcastId, msg}, WIRE_V2);
+        std::string compressed;
+        if(compressPayload(msg, compressed)){
+            addMessage(packets[2], TreeBroadcastMessage{0, routingTable.localPeer().id, broadcastId, compressed}, WIRE_V2, true);
+        }
+
+        broadcastIds.insert(broadcastId, steadyMicros() / 1000);
+        cacheBroadcast(broadcastId, routingTable.localPeer().id, msg);
+        for(int level = PeerId::bits - 1; level >= 0; level--){
+            for(auto &peer : meshPeers(level)){
+                int index = peer.format == WIRE_V2 ? 1 : 0;
+                if(index == 1 && peer.compression && packets[2].size() > 0){
+                    index = 2;
+                }
+                //after the opcode, and the format marker in WIRE_V2
+                packets[index].set(packets[index].offset + (index == 0 && plainFormat == WIRE_V1 ? sizeof(Opcode) : 2), (uint8_t)level);
+                write(packets[index].data(), packets[index].size(), peer.ep);
+            }
+        }
+    }
+
+    //the mesh peers of a bucket, peers that left the table or were not heard from in meshTimeout are replaced
+    std::vector<Peer> PeerNetwork::meshPeers(int level) {
+        std::vector<Peer> result;
+        std::vector<PeerId> &ids = mesh[level];
+        uint64_t seen = unixMillis() - meshTimeout;
+        for(int i = 0; i < ids.size(); i++){
+            const Peer &peer = routingTable.get(ids[i]);
+            if(peer.id == ids[i] && peer.lastSeen >= seen && result.size() < broadcastRedundancy){
+                result.push_back(peer);
+            }else{
+                ids[i] = ids.back();
+                ids.pop_back();
+                i--;
+            }
+        }
+        if(result.size() < broadcastRedundancy){
+            //graft the lowest rtt peers that are alive, any peer is better than leaving the bucket out
+            auto candidates = routingTable.getBucket(level, routingTable.bucketSize);
+            for(bool alive : {true, false}){
+                for(auto &peer : candidates){
+                    if(result.size() >= broadcastRedundancy){
+                        break;
+                    }
+                    if((!alive || peer.lastSeen >= seen) && std::find(ids.begin(), ids.end(), peer.id) == ids.end()){
+                        ids.push_back(peer.id);
+                        result.push_back(peer);
+                    }
+                }
+            }
+        }
+        return result;
+    }
+
+    void PeerNetwork::cacheBroadcast(const Blob<32> &broadcastId, const PeerId &source, std::string_view msg) {
+        wants.erase(broadcastId);
+        if(gossipInterval <= 0 || msg.size() > gossipCacheBytes){
+            return;
+        }
+        gossipCache[broadcastId] = CachedBroadcast{source, std::string(msg), steadyMicros() / 1000};
+        gossipOrder.push_back(broadcastId);
+        gossipCacheSize += msg.size();
+        while(gossipCacheSize > gossipCacheBytes){
+            auto cached = gossipCache.find(gossipOrder.front());
+            gossipCacheSize -= cached->second.msg.size();
+            gossipCache.erase(cached);
+            gossipOrder.pop_front();
+        }
+    }
+
+    //expire cached bodies and send IHAVE digests of the recent ones to random peers
+    void PeerNetwork::gossip() {
+        uint64_t now = steadyMicros() / 1000;
+        while(!gossipOrder.empty()){
+            auto cached = gossipCache.find(gossipOrder.front());
+            if(now - cached->second.time <= gossipWindow){
+                break;
+            }
+            gossipCacheSize -= cached->second.msg.size();
+            gossipCache.erase(cached);
+            gossipOrder.pop_front();
+        }
+        for(auto want = wants.begin(); want != wants.end();){
+            if(now - want->second > gossipWindow){
+                want = wants.erase(want);
+            }else{
+                want++;
+            }
+        }
+
+        //broadcasts of the last three rounds, a peer hears about each one from several peers
+        std::vector<Blob<32>> ids;
+        for(auto id = gossipOrder.rbegin(); id != gossipOrder.rend(); id++){
+            if(now - gossipCache[*id].time > 3 * gossipInterval){
+                break;
+            }
+            ids.push_back(*id);
+        }
+        if(ids.empty() || routingTable.peers.size() <= 1){
+            return;
+        }
+
+        std::vector<int> indices;
+        for(int i = 1; i < routingTable.peers.size(); i++){
+            indices.push_back(i);
+        }
+        for(int i = 0; i < gossipFanout && i < indices.size(); i++){
+            std::swap(indices[i], indices[i + std::rand() % (indices.size() - i)]);
+            const Peer &peer = routingTable.peers[indices[i]];
+            //digests stay below a typical MTU
+            for(int begin = 0; begin < ids.size(); begin += 32){
+                Packet packet;
+                for(int j = begin; j < ids.size() && j < begin + 32; j++){
+                    addMessage(packet, IHaveMessage{ids[j]}, peer.format);
+                }
+                write(packet.data(), packet.size(), peer.ep);
+            }
+        }
+    }
+
+    void PeerNetwork::send(const std::string &msg, const PeerId &id, bool reliable) {
+        send(msg.data(), msg.size(), id, reliable);
+    }
+
+    void PeerNetwork::send(std::span<const std::byte> msg, const PeerId &id, bool reliable) {
+        send(msg.data(), msg.size(), id, reliable);
+    }
+
+    void PeerNetwork::send(const void *data, size_t size, const PeerId &id, bool reliable) {
+        std::lock_guard<std::recursive_mutex> lock(mutex);
+        std::string_view msg((const char*)data, size);
+        if(reliable){
+            auto sender = senders.find(id);
+            if(sender == senders.end()){
+                sender = senders.try_emplace(id, randomId<4>().word(0), reliableMinRto).first;
+            }
+            //segments are compressed one by one when sent
+            size_t segmentSize = fragmentSize();
+            for(size_t offset = 0; offset == 0 || offset < msg.size(); offset += segmentSize){
+                sender->second.push(std::string(msg.substr(offset, segmentSize)), offset + segmentSize < msg.size());
+            }
+            flushReliable(id);
+            return;
+        }
+        const Peer &peer = routingTable.get(id);
+        std::string compressed;
+        bool useCompression = peer.format == WIRE_V2 && peer.compression && compressPayload(msg, compressed);
+
+        std::string_view payload = useCompression ? compressed : msg;
+        if((int)payload.size() > fragmentSize()){
+            std::string data(payload);
+            fragmentSender.add(id, data, useCompression, fragmentSize(), steadyMicros() / 1000);
+            //a running timer sends the fragments with the next burst, calls in quick succession are paced as well
+            if(fragmentTimer == -1){
+                flushFragments();
+            }
+            return;
+        }
+        Packet packet(routeHeaderSize);
+        addMessage(packet, DataMessage{payload}, payloadFormat(peer.format, payload), useCompression);
         sendPacket(packet, id);
     }
 
+    //send what the window of a reliable sender allows, the timer retransmits until everything is acknowledged
+    void PeerNetwork::flushReliable(const PeerId &id) {
+        auto entry = senders.find(id);
+        if(entry == senders.end()){
+            return;
+        }
+        ReliableSender &sender = entry->second;
+        const Peer &peer = routingTable.get(id);
+        for(auto *segment : sender.poll(steadyMicros())){
+            std::string compressed;
+            bool useCompression = peer.format == WIRE_V2 && peer.compression && compressPayload(segment->msg, compressed);
+            std::string_view payload = useCompression ? compressed : segment->msg;
+            Packet packet(routeHeaderSize);
+            addMessage(packet, ReliableMessage{sender.session, segment->sequence, (uint8_t)segment->more, payload},
+                payloadFormat(peer.format, payload), useCompression);
+            sendPacket(packet, id);
+        }
+        if(sender.failed){
+            log(str("reliable messages to ", hex(id, false), " were not acknowledged"), false);
+            senders.erase(entry);
+            return;
+        }
+        if(!sender.idle()){
+            scheduleReliable();
+        }
+    }
+
+    void PeerNetwork::retransmitReliable() {
+        std::vector<PeerId> ids;
+        for(auto &entry : senders){
+            if(!entry.second.idle()){
+                ids.push_back(entry.first);
+            }
+        }
+        std::vector<PeerId> streamIds;
+        for(auto &entry : streamSenders){
+            if(!entry.second.idle()){
+                streamIds.push_back(entry.first);
+            }
+        }
+        for(auto &id : ids){
+            flushReliable(id);
+        }
+        for(auto &id : streamIds){
+            flushStreams(id);
+        }
+        if(ids.empty() && streamIds.empty()){
+            handler.removeTimer(reliableTimer);
+            reliableTimer = -1;
+        }
+    }
+
+    void PeerNetwork::scheduleReliable() {
+        if(reliableTimer == -1){
+            reliableTimer = handler.addTimer(std::max(reliableMinRto / 4, 1), [&](){
+                std::lock_guard<std::recursive_mutex> lock(mutex);
+                retransmitReliable();
+            });
+        }
+    }
+
+    uint32_t PeerNetwork::openStream(const PeerId &id) {
+        std::lock_guard<std::recursive_mutex> lock(mutex);
+        return streamSender(id).open();
+    }
+
+    bool PeerNetwork::writeStream(const PeerId &id, uint32_t stream, std::string_view data) {
+        std::lock_guard<std::recursive_mutex> lock(mutex);
+        auto entry = streamSenders.find(id);
+        if(entry == streamSenders.end() || !entry->second.write(stream, data)){
+            return false;
+        }
+        flushStreams(id);
+        return true;
+    }
+
+    void PeerNetwork::closeStream(const PeerId &id, uint32_t stream) {
+        std::lock_guard<std::recursive_mutex> lock(mutex);
+        auto entry = streamSenders.find(id);
+        if(entry != streamSenders.end()){
+            entry->second.close(stream);
+            flushStreams(id);
+        }
+    }
+
+    size_t PeerNetwork::streamQueued(const PeerId &id, uint32_t stream) {
+        std::lock_guard<std::recursive_mutex> lock(mutex);
+        auto entry = streamSenders.find(id);
+        return entry == streamSenders.end() ? 0 : entry->second.queued(stream);
+    }
+
+    StreamSender &PeerNetwork::streamSender(const PeerId &id) {
+        auto entry = streamSenders.find(id);
+        if(entry == streamSenders.end()){
+            entry = streamSenders.try_emplace(id, randomId<4>().word(0), reliableMinRto, streamWindow).first;
+        }
+        return entry->second;
+    }
+
+    void PeerNetwork::flushStreams(const PeerId &id) {
+        auto entry = streamSenders.find(id);
+        if(entry == streamSenders.end()){
+            return;
+        }
+        StreamSender &sender = entry->second;
+        //the STREAM and frame headers fit into the room fragmentSize leaves for a second ROUTE header
+        sender.schedule(fragmentSize());
+        for(auto *segment : sender.reliable.poll(steadyMicros())){
+            Packet packet(routeHeaderSize);
+            addMessage(packet, StreamMessage{sender.reliable.session, segment->sequence, segment->msg}, WIRE_V2);
+            sendPacket(packet, id);
+        }
+        if(sender.reliable.failed){
+            log(str("stream segments to ", hex(id, false), " were not acknowledged"), false);
+            streamSenders.erase(entry);
+            return;
+        }
+        if(!sender.idle()){
+            scheduleReliable();
+        }
+    }
+
+    //send the next burst of queued fragments and request missing ones of stalled messages
+    void PeerNetwork::flushFragments() {
+        uint64_t now = steadyMicros() / 1000;
+        auto fragments = fragmentSender.next(fragmentBurst, now);
+        for(auto &fragment : fragments){
+            Packet packet(routeHeaderSize);
+            addMessage(packet, FragmentMessage{fragment.messageId, fragment.index, fragment.count, fragment.data},
+                payloadFormat(formatOf(fragment.peer), fragment.data), fragment.compressed);
+            sendPacket(packet, fragment.peer);
+        }
+
+        //the ranges for one source share datagrams
+        std::map<PeerId, Packet> nacks;
+        for(auto &nack : reassembler.poll(now)){
+            Packet &packet = nacks.try_emplace(nack.source, routeHeaderSize).first->second;
+            addMessage(packet, FragmentNackMessage{nack.messageId, nack.first, nack.count}, formatOf(nack.source));
+            if(packet.size() + routeHeaderSize * 2 > maxDatagramSize){
+                sendPacket(packet, nack.source);
+                packet = Packet(routeHeaderSize);
+            }
+        }
+        for(auto &entry : nacks){
+            if(entry.second.size() > 0){
+                sendPacket(entry.second, entry.first);
+            }
+        }
+
+        //the timer keeps running for one more round after a burst, so that sends right after it are paced too
+        if(fragments.empty() && !fragmentSender.pending() && reassembler.empty()){
+            if(fragmentTimer != -1){
+                handler.removeTimer(fragmentTimer);
+                fragmentTimer = -1;
+            }
+        }else{
+            scheduleFragments();
+        }
+    }
+
+    void PeerNetwork::scheduleFragments() {
+        if(fragmentTimer == -1){
+            fragmentTimer = handler.addTimer(1, [&](){
+                std::lock_guard<std::recursive_mutex> lock(mutex);
+                flushFragments();
+            });
+        }
+    }
+
+    //payload bytes per fragment or reliable segment, the rest of maxDatagramSize is left for the headers
+    int PeerNetwork::fragmentSize() {
+        return std::max(maxDatagramSize - routeHeaderSize * 2, FragmentReassembler::minFragmentSize);
+    }
+
     Error PeerNetwork::join() {
         std::unordered_map<int, bool> map;
-        for(int i = 0; i < entryNodes.size(); i++){
+        //a restored routing table is used right away, entry nodes are only needed without one
+        for(int i = 0; i < entryNodes.size() && !isConnected(); i++){
             int index = 0;
             do{
                 index = std::rand() % entryNodes.size();
@@ -321,15 +2012,17 @@ namespace pnet {
             map[index] = true;
 
             if(entryNodes[index] != routingTable.localPeer().ep) {
-                Packet packet;
-                packet.add(HANDSHAKE);
-                packet.add(localId());
-
-                socket.write(packet.data(), packet.size(), entryNodes[index]);
+                {
+                    std::lock_guard<std::recursive_mutex> lock(mutex);
+                    handshake(entryNodes[index]);
+                }
 
                 log(str("try entry node: ", entryNodes[index].getAddress(), " ", entryNodes[index].getPort()), true);
 
-                readPacket(200);
+                //the reply is processed on the handler thread
+                for(int millis = 0; millis < 200 && !isConnected(); millis += 5){
+                    std::this_thread::sleep_for(std::chrono::milliseconds(5));
+                }
                 if (isConnected()) {
                     break;
                 }
@@ -339,22 +2032,115 @@ namespace pnet {
             return Error("could not find an entry node");
         }
 
-        for(int level = sizeof(PeerId) * 8 - 1; level >= 0; level--){
-            lookup(routingTable.lookupTarget(level));
+        //a few rounds of failed queries, the lookups never finish if the network is stopped
+        auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(lookupTimeout * 8);
+
+        //the lookup of the local id fills the closest buckets and tells which levels are still worth a lookup,
+        //those lookups run concurrently, join returns when all of them converged
+        lookup(localId()).wait_until(deadline);
+        std::vector<std::future<std::vector<Peer>>> results;
+        {
+            std::lock_guard<std::recursive_mutex> lock(mutex);
+            for(int level : routingTable.refreshLevels()){
+                results.push_back(lookup(routingTable.lookupTarget(level)));
+            }
+        }
+        for(auto &result : results){
+            result.wait_until(deadline);
         }
 
         return Error();
     }
 
+    void PeerNetwork::restoreSnapshot() {
+        PeerId id;
+        std::vector<Peer> peers;
+        Error error = PeerRoutingTable::loadSnapshot(snapshotPath, id, peers);
+        if(error){
+            log(str("no snapshot restored: ", error.message), true);
+            return;
+        }
+
+        //keep the identity the other peers know, the restored peers route immediately
+        routingTable.localPeer().id = id;
+        for(auto &peer : peers){
+            addPeer(peer);
+        }
+        log(str("restored ", routingTable.peers.size() - 1, " peer(s)"), true);
+
+        //validate all restored peers in parallel
+        uint64_t restoreTime = unixMillis();
+        for(int i = 1; i < routingTable.peers.size(); i++){
+            handshake(routingTable.peers[i].ep);
+        }
+        validationTimer = handler.addTimer(validationTimeout, [this, restoreTime](){
+            std::lock_guard<std::recursive_mutex> lock(mutex);
+            validatePeers(restoreTime);
+        });
+    }
+
+    void PeerNetwork::removeSilentPeers() {
+        uint64_t seen = unixMillis() - peerTimeout;
+        std::vector<PeerId> silent;
+        for(int i = 1; i < routingTable.peers.size(); i++){
+            //0 if never heard from, e.g. added from a LOOKUP_REPLY and not answered the handshake yet
+            if(routingTable.peers[i].lastSeen != 0 && routingTable.peers[i].lastSeen < seen){
+                silent.push_back(routingTable.peers[i].id);
+            }
+        }
+        for(auto &id : silent){
+            if(removePeer(id)){
+                log(str("timeout: ", hex(id, false)), false);
+                lookup(routingTable.lookupTarget(routingTable.getLevel(id)));
+            }
+        }
+    }
+
+    void PeerNetwork::validatePeers(uint64_t restoreTime) {
+        handler.removeTimer(validationTimer);
+        validationTimer = -1;
+
+        std::vector<PeerId> stale;
+        for(int i = 1; i < routingTable.peers.size(); i++){
+            if(routingTable.peers[i].lastSeen < restoreTime){
+                stale.push_back(routingTable.peers[i].id);
+            }
+        }
+        for(auto &id : stale){
+            if(removePeer(id)){
+                log(str("disconnect: ", hex(id, false)), false);
+            }
+        }
+        publishTable();
+        if(!isConnected()){
+            //the whole snapshot is outdated, join through the entry nodes
+            for(auto &ep : entryNodes){
+                if(ep != routingTable.localPeer().ep){
+                    handshake(ep);
+                }
+            }
+            return;
+        }
+        //refill the levels that lost peers
+        for(auto &id : stale){
+            lookup(routingTable.lookupTarget(routingTable.getLevel(id)));
+        }
+    }
+
     void PeerNetwork::disconnect() {
-        Packet packet;
-        packet.add(DISCONNECT);
+        std::lock_guard<std::recursive_mutex> lock(mutex);
+        Packet packets[2];
+        addMessage(packets[0], DisconnectMessage(), WIRE_V1);
+        addMessage(packets[1], DisconnectMessage(), WIRE_V2);
         for(int i = 1; i < routingTable.peers.size(); i++){
-            socket.write(packet.data(), packet.size(), routingTable.peers[i].ep);
+            Packet &packet = packets[routingTable.peers[i].format == WIRE_V2 ? 1 : 0];
+            write(packet.data(), packet.size(), routingTable.peers[i].ep);
         }
+        flushOutbound(true);
     }
 
     bool PeerNetwork::isConnected() {
+        std::lock_guard<std::recursive_mutex> lock(mutex);
         return routingTable.peers.size() > 1;
     }
 
@@ -375,6 +2161,7 @@ namespace pnet {
     }
 
     PeerId PeerNetwork::localId() {
+        std::lock_guard<std::recursive_mutex> lock(mutex);
         return routingTable.localPeer().id;
     }
 
@@ -384,10 +2171,470 @@ namespace pnet {
                 thread->join();
             }
         }
+        for(auto &shard : shards){
+            if(shard->thread.joinable()){
+                shard->thread.join();
+            }
+        }
+        if(localShard && localShard->thread.joinable()){
+            localShard->thread.join();
+        }
+    }
+
+    NextHopCache::Counters &PeerNetwork::nextHopStats() {
+        return routingTable.nextHops.stats();
+    }
+
+    std::vector<Peer> PeerNetwork::getPeers() {
+        return publishedTable.read()->peers;
+    }
+
+    std::vector<Peer> PeerNetwork::getDirectLinks() {
+        return publishedTable.read()->pinned;
+    }
+
+    std::future<PeerNetwork::StoreResult> PeerNetwork::put(const std::string &key, const std::string &value, std::function<void(const StoreResult &result)> callback) {
+        return request(PUT, key, value, callback);
+    }
+
+    std::future<PeerNetwork::StoreResult> PeerNetwork::get(const std::string &key, std::function<void(const StoreResult &result)> callback) {
+        return request(GET, key, std::string(), callback);
+    }
+
+    std::future<PeerNetwork::StoreResult> PeerNetwork::erase(const std::string &key, std::function<void(const StoreResult &result)> callback) {
+        return request(DELETE, key, std::string(), callback);
+    }
+
+    //store messages are WIRE_V2, keys and values are binary and every peer that knows them reads it
+    std::future<PeerNetwork::StoreResult> PeerNetwork::request(Opcode opcode, const std::string &key, const std::string &value, std::function<void(const StoreResult &result)> callback) {
+        std::lock_guard<std::recursive_mutex> lock(mutex);
+        uint32_t requestId = addStoreRequest(opcode, key, routingTable.localPeer().id, 0, PeerId(0));
+        StoreRequest &request = storeRequests[requestId];
+        request.callback = callback;
+        auto future = request.promise.get_future();
+
+        Packet packet(routeHeaderSize);
+        if(opcode == PUT){
+            addMessage(packet, PutMessage{requestId, 0, 0, key, value}, WIRE_V2);
+        }else if(opcode == DELETE){
+            addMessage(packet, DeleteMessage{requestId, 0, 0, key}, WIRE_V2);
+        }else{
+            addMessage(packet, GetMessage{requestId, 0, key}, WIRE_V2);
+        }
+        if(routeHeaderSize + packet.size() > maxDatagramSize){
+            log("store request too large", true);
+            finishStoreRequest(requestId, false);
+            return future;
+        }
+        if(opcode == GET){
+            auto cached = storeCache.find(key);
+            if(cached != storeCache.end() && cached->second.expires >= steadyMicros() / 1000){
+                request.record = cached->second.record;
+                finishStoreRequest(requestId, true);
+                return future;
+            }
+        }
+
+        PeerId target = KeyValueStore::keyId(key);
+        if(routingTable.getNext(target, PeerId(0)).id == routingTable.localPeer().id){
+            coordinate(requestId, value);
+        }else{
+            sendPacket(packet, target);
+        }
+        return future;
     }
 
-    const std::vector<Peer> &PeerNetwork::getPeers() {
-        return routingTable.peers;
+    uint32_t PeerNetwork::addStoreRequest(Opcode opcode, const std::string &key, const PeerId &requester, uint32_t requesterId, const PeerId &previousHop) {
+        uint32_t requestId = nextStoreRequestId++;
+        if(nextStoreRequestId == 0){
+            nextStoreRequestId = 1;
+        }
+        StoreRequest &request = storeRequests[requestId];
+        request.opcode = opcode;
+        request.key = key;
+        request.requester = requester;
+        request.requesterId = requesterId;
+        request.previousHop = previousHop;
+        request.deadline = steadyMicros() / 1000 + storeTimeout;
+        return requestId;
+    }
+
+    void PeerNetwork::coordinate(uint32_t requestId, std::string_view value) {
+        StoreRequest &request = storeRequests[requestId];
+        bool local;
+        std::vector<Peer> replicas = replicaPeers(KeyValueStore::keyId(request.key), local);
+        request.coordinating = true;
+        //answer the requester before it gives up
+        if(request.requester != routingTable.localPeer().id){
+            request.deadline = steadyMicros() / 1000 + storeTimeout / 2;
+        }
+        request.answers = 1;
+
+        KeyValueStore::Record *record = store.find(request.key);
+        if(request.opcode == GET){
+            request.needed = std::min<int>(storeReadQuorum, replicas.size() + 1);
+            if(record != nullptr){
+                request.record = *record;
+            }
+            request.versions.push_back({routingTable.localPeer().id, routingTable.localPeer().ep, request.record.version});
+            for(auto &peer : replicas){
+                Packet packet(routeHeaderSize);
+                addMessage(packet, GetMessage{requestId, STORE_REPLICA, request.key}, WIRE_V2);
+                sendPacket(packet, peer.id);
+            }
+        }else{
+            request.needed = std::min<int>(storeWriteQuorum, replicas.size() + 1);
+            //versions follow the wall clock, the low bits of the coordinator id tell apart writes in the same millisecond.
+            //a write always replaces the version the coordinator knows
+            uint64_t tieBreak = routingTable.localPeer().id.word(0) & 0xffff;
+            uint64_t version = (unixMillis() << 16) | tieBreak;
+            if(record != nullptr && record->version >= version){
+                version = (record->version >> 16) < (UINT64_MAX >> 16) ? (((record->version >> 16) + 1) << 16) | tieBreak : 0;
+            }
+            if(version == 0 || !plausibleVersion(version)){
+                log(str("store version out of range: ", request.key), true);
+                finishStoreRequest(requestId, false);
+                return;
+            }
+            store.apply(request.key, value, version, request.opcode == DELETE);
+            record = store.find(request.key);
+            for(auto &peer : replicas){
+                sendRecord(peer.id, requestId, request.key, *record);
+            }
+        }
+        if(request.answers >= request.needed){
+            finishStoreRequest(requestId, true);
+        }
+    }
+
+    std::vector<Peer> PeerNetwork::replicaPeers(const PeerId &target, bool &local) {
+        std::vector<Peer> peers = routingTable.getClosest(target, storeReplicas);
+        PeerId distance = target ^ routingTable.localPeer().id;
+        int closer = 0;
+        for(auto &peer : peers){
+            if((peer.id ^ target) < distance){
+                closer++;
+            }
+        }
+        local = closer < storeReplicas;
+        if(local && peers.size() >= storeReplicas){
+            peers.pop_back();
+        }
+        return peers;
+    }
+
+    void PeerNetwork::finishStoreRequest(uint32_t requestId, bool ok) {
+        auto entry = storeRequests.find(requestId);
+        if(entry == storeRequests.end()){
+            return;
+        }
+        //callbacks may make new requests
+        StoreRequest request = std::move(entry->second);
+        storeRequests.erase(entry);
+        KeyValueStore::Record &record = request.record;
+
+        if(request.coordinating && request.opcode == GET && ok && record.version != 0){
+            //read repair of the replicas that answered an older version
+            for(auto &version : request.versions){
+                if(version.version >= record.version){
+                    continue;
+                }
+                if(version.id == routingTable.localPeer().id){
+                    store.apply(request.key, record.value, record.version, record.deleted);
+                }else if(version.id != PeerId(0)){
+                    sendRecord(version.id, 0, request.key, record);
+                }else{
+                    sendRecord(version.ep, 0, request.key, record);
+                }
+            }
+            countRead(request.key, record, request.previousHop, request.requester);
+        }
+
+        if(request.requester == routingTable.localPeer().id){
+            StoreResult result;
+            result.ok = ok;
+            result.found = ok && request.opcode == GET && record.version != 0 && !record.deleted;
+            if(result.found){
+                result.value = std::move(record.value);
+            }
+            if(request.callback){
+                request.callback(result);
+            }
+            request.promise.set_value(std::move(result));
+            return;
+        }
+        Packet response(routeHeaderSize);
+        if(request.opcode == GET){
+            uint8_t state = !ok ? STORE_FAILED : record.version == 0 ? STORE_MISSING : record.deleted ? STORE_DELETED : STORE_FOUND;
+            addMessage(response, GetReplyMessage{request.requesterId, state, record.version, request.key, record.value}, WIRE_V2);
+        }else{
+            addMessage(response, PutReplyMessage{request.requesterId, (uint8_t)ok}, WIRE_V2);
+        }
+        sendPacket(response, request.requester);
+    }
+
+    void PeerNetwork::sendRecord(const PeerId &id, uint32_t requestId, const std::string &key, const KeyValueStore::Record &record) {
+        Packet packet(routeHeaderSize);
+        addRecord(packet, requestId, key, record);
+        sendPacket(packet, id);
+    }
+
+    void PeerNetwork::sendRecord(const Endpoint &ep, uint32_t requestId, const std::string &key, const KeyValueStore::Record &record) {
+        Packet packet;
+        addRecord(packet, requestId, key, record);
+        write(packet.data(), packet.size(), ep);
+    }
+
+    void PeerNetwork::addRecord(Packet &packet, uint32_t requestId, const std::string &key, const KeyValueStore::Record &record) {
+        if(record.deleted){
+            addMessage(packet, DeleteMessage{requestId, record.version, STORE_REPLICA, key}, WIRE_V2);
+        }else{
+            addMessage(packet, PutMessage{requestId, record.version, STORE_REPLICA, key, record.value}, WIRE_V2);
+        }
+    }
+
+    bool PeerNetwork::plausibleVersion(uint64_t version) {
+        return (version >> 16) <= unixMillis() + storeClockSkew;
+    }
+
+    bool PeerNetwork::peekGet(Packet &packet, WireFormat format, GetMessage &msg) {
+        int offset = packet.offset;
+        if(packet.size() > 0){
+            uint8_t marker = packet.data()[0];
+            if(marker == WIRE_V1_MARKER || marker == WIRE_V2_MARKER){
+                format = marker == WIRE_V2_MARKER ? WIRE_V2 : WIRE_V1;
+                packet.skip(1);
+            }
+        }
+        Opcode opcode;
+        bool compressed = false;
+        bool get = readOpcode(packet, opcode, compressed, format) && opcode == GET && Schema<GetMessage>::read(packet, msg, format);
+        packet.offset = offset;
+        return get && !(msg.flags & STORE_REPLICA);
+    }
+
+    bool PeerNetwork::answerFromCache(Packet &packet, const RouteMessage &msg, WireFormat format, const PeerId &hopId) {
+        GetMessage get;
+        if(!peekGet(packet, format, get)){
+            return false;
+        }
+        auto cached = storeCache.find(std::string(get.key));
+        if(cached == storeCache.end() || cached->second.expires < steadyMicros() / 1000){
+            return false;
+        }
+        KeyValueStore::Record &record = cached->second.record;
+        Packet response(routeHeaderSize);
+        addMessage(response, GetReplyMessage{get.requestId, record.deleted ? STORE_DELETED : STORE_FOUND, record.version, get.key, record.value}, WIRE_V2);
+        sendPacket(response, msg.source);
+        countRead(cached->first, record, hopId, msg.source);
+        return true;
+    }
+
+    //every hotKeyReads reads of a record within a second it is pushed to the previous hop of the read,
+    //caches spread from the replicas towards the requesters as long as the record stays hot
+    void PeerNetwork::countRead(const std::string &key, const KeyValueStore::Record &record, const PeerId &previousHop, const PeerId &requester) {
+        if(storeCacheTime <= 0 || hotKeyReads <= 0 || record.version == 0){
+            return;
+        }
+        if(++keyReads[key] % hotKeyReads != 0){
+            return;
+        }
+        if(previousHop == PeerId(0) || previousHop == requester || previousHop == routingTable.localPeer().id){
+            return;
+        }
+        Packet packet(routeHeaderSize);
+        addMessage(packet, GetReplyMessage{0, record.deleted ? STORE_DELETED : STORE_FOUND, record.version, key, record.value}, WIRE_V2);
+        sendPacket(packet, previousHop);
+    }
+
+    void PeerNetwork::expireStoreRequests() {
+        uint64_t now = steadyMicros() / 1000;
+        std::vector<uint32_t> expired;
+        for(auto &entry : storeRequests){
+            if(entry.second.deadline < now){
+                expired.push_back(entry.first);
+            }
+        }
+        for(uint32_t requestId : expired){
+            finishStoreRequest(requestId, false);
+        }
+    }
+
+    void PeerNetwork::maintainStore() {
+        //records whose replicas changed with the peers are sent to the replicas they have now,
+        //a peer that is no longer one of them hands them over and keeps its copy
+        if(placementChanged){
+            placementChanged = false;
+            for(auto &entry : store.records){
+                bool local;
+                std::vector<Peer> replicas = replicaPeers(KeyValueStore::keyId(entry.first), local);
+                uint64_t placement = 1;
+                for(auto &peer : replicas){
+                    placement += (peer.id.word(0) ^ peer.id.word(1)) * 0x9e3779b97f4a7c15ull;
+                }
+                if(entry.second.placement != placement){
+                    entry.second.placement = placement;
+                    for(auto &peer : replicas){
+                        sendRecord(peer.id, 0, entry.first, entry.second);
+                    }
+                }
+            }
+        }
+
+        uint64_t now = steadyMicros() / 1000;
+        for(auto entry = storeCache.begin(); entry != storeCache.end();){
+            if(entry->second.expires < now){
+                entry = storeCache.erase(entry);
+            }else{
+                entry++;
+            }
+        }
+        cachedKeys = storeCache.size();
+        keyReads.clear();
+
+        Error error = store.flush();
+        if(error){
+            logError(error);
+        }
+    }
+
+    void PeerNetwork::subscribe(const std::string &topic, std::function<void(const PeerId &source, const std::string &msg)> callback) {
+        std::lock_guard<std::recursive_mutex> lock(mutex);
+        PeerId topicId = hashId(topic);
+        bool member = topics.find(topicId) != topics.end();
+        topics[topicId].callback = callback;
+        if(!member){
+            joinTopic(topicId);
+        }
+    }
+
+    void PeerNetwork::unsubscribe(const std::string &topic) {
+        std::lock_guard<std::recursive_mutex> lock(mutex);
+        PeerId topicId = hashId(topic);
+        auto entry = topics.find(topicId);
+        if(entry != topics.end()){
+            entry->second.callback = nullptr;
+            leaveTopic(topicId);
+        }
+    }
+
+    void PeerNetwork::publish(const std::string &topic, std::string_view msg) {
+        std::lock_guard<std::recursive_mutex> lock(mutex);
+        PublishMessage publish{hashId(topic), 0, routingTable.localPeer().id, randomId<32>(), msg};
+        if(routingTable.getNext(publish.topicId, PeerId(0)).id == routingTable.localPeer().id){
+            publishDown(publish, Endpoint());
+            return;
+        }
+        Packet packet(routeHeaderSize);
+        addMessage(packet, publish, WIRE_V2);
+        if(routeHeaderSize + packet.size() > maxDatagramSize){
+            log("publish too large", true);
+            return;
+        }
+        sendPacket(packet, publish.topicId);
+    }
+
+    void PeerNetwork::joinTopic(const PeerId &topicId) {
+        Topic &topic = topics[topicId];
+        auto &next = routingTable.getNext(topicId, PeerId(0));
+        PeerId parent = next.id != routingTable.localPeer().id ? next.id : PeerId(0);
+        if(topic.parent != parent && topic.parent != PeerId(0)){
+            //the old parent would keep sending until the child times out
+            Packet packet;
+            addMessage(packet, UnsubscribeMessage{topicId, routingTable.localPeer().id}, WIRE_V2);
+            write(packet.data(), packet.size(), topic.parentEp);
+        }
+        topic.parent = parent;
+        topic.parentEp = next.ep;
+        if(parent != PeerId(0)){
+            Packet packet;
+            addMessage(packet, SubscribeMessage{topicId, routingTable.localPeer().id}, WIRE_V2);
+            write(packet.data(), packet.size(), next.ep);
+        }
+    }
+
+    void PeerNetwork::leaveTopic(const PeerId &topicId) {
+        auto entry = topics.find(topicId);
+        if(entry == topics.end() || entry->second.callback || !entry->second.children.empty()){
+            return;
+        }
+        if(entry->second.parent != PeerId(0)){
+            Packet packet;
+            addMessage(packet, UnsubscribeMessage{topicId, routingTable.localPeer().id}, WIRE_V2);
+            write(packet.data(), packet.size(), entry->second.parentEp);
+        }
+        topics.erase(entry);
+    }
+
+    void PeerNetwork::publishDown(const PublishMessage &msg, const Endpoint &from) {
+        if(!broadcastIds.insert(msg.publishId, steadyMicros() / 1000)){
+            return;
+        }
+        auto entry = topics.find(msg.topicId);
+        if(entry == topics.end()){
+            return;
+        }
+        Topic &topic = entry->second;
+        if(!topic.children.empty()){
+            PublishMessage down = msg;
+            down.flags = PUBLISH_DOWN;
+            Packet packet;
+            addMessage(packet, down, WIRE_V2);
+            for(auto &child : topic.children){
+                if(child.ep != from){
+                    write(packet.data(), packet.size(), child.ep);
+                }
+            }
+        }
+        if(topic.callback){
+            //the callback may unsubscribe
+            auto callback = topic.callback;
+            callback(msg.source, std::string(msg.msg));
+        }
+    }
+
+    void PeerNetwork::refreshTopics() {
+        uint64_t timeout = steadyMicros() / 1000 - 3 * topicRefreshInterval;
+        std::vector<PeerId> empty;
+        for(auto &entry : topics){
+            auto &children = entry.second.children;
+            children.erase(std::remove_if(children.begin(), children.end(), [&](const TopicChild &child){
+                return child.refreshed < timeout;
+            }), children.end());
+            if(!entry.second.callback && children.empty()){
+                empty.push_back(entry.first);
+            }else{
+                //also moves to a closer parent that joined since the last refresh
+                joinTopic(entry.first);
+            }
+        }
+        for(auto &topicId : empty){
+            leaveTopic(topicId);
+        }
+    }
+
+    void PeerNetwork::repairTopics(const PeerId &removed) {
+        std::vector<PeerId> orphaned;
+        std::vector<PeerId> empty;
+        for(auto &entry : topics){
+            auto &children = entry.second.children;
+            children.erase(std::remove_if(children.begin(), children.end(), [&](const TopicChild &child){
+                return child.id == removed;
+            }), children.end());
+            if(!entry.second.callback && children.empty()){
+                empty.push_back(entry.first);
+            }else if(entry.second.parent == removed){
+                orphaned.push_back(entry.first);
+            }
+        }
+        for(auto &topicId : orphaned){
+            //the removed parent does not need an UNSUBSCRIBE
+            topics[topicId].parent = PeerId(0);
+            joinTopic(topicId);
+        }
+        for(auto &topicId : empty){
+            leaveTopic(topicId);
+        }
     }
 
 }
@@ -6,31 +6,155 @@
 #define SOCKET_PEERNETWORK_H
 
 #include "PeerRoutingTable.h"
+#include "PeerMessages.h"
+#include "PeerLookup.h"
+#include "BroadcastCache.h"
+#include "ReliableChannel.h"
+#include "StreamChannel.h"
+#include "Fragmentation.h"
+#include "KeyValueStore.h"
 #include "pnet/UdpSocket.h"
 #include "pnet/SocketHandler.h"
 #include "pnet/Packet.h"
+#include "pnet/Compressor.h"
+#include "pnet/RcuPointer.h"
 #include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <unordered_map>
 #include <map>
+#include <deque>
+#include <span>
 
 namespace pnet {
 
     class PeerNetwork {
     public:
-        enum Opcode{
-            NONE,
-            PING,
-            PONG,
-            HANDSHAKE,
-            HANDSHAKE_REPLY,
-            LOOKUP,
-            LOOKUP_REPLY,
-            ROUTE,
-            BROADCAST,
-            MESSAGE,
-            DISCONNECT,
-        };
+        typedef PeerOpcode Opcode;
+        using enum PeerOpcode;
+
+        //size of a WIRE_V1 ROUTE header (opcode, source, destination, payload size),
+        //WIRE_V2 headers including their format markers are never larger
+        static constexpr int routeHeaderSize = sizeof(Opcode) + Schema<RouteMessage>::minSize<WIRE_V1>;
+
         std::function<void(int level, const std::string &msg)> logCallback;
+        class Delivery{
+        public:
+            PeerId source;
+            std::span<const std::byte> msg;
+        };
+        class StoreResult{
+        public:
+            //the quorum answered in time
+            bool ok = false;
+            //the key has a value, for get
+            bool found = false;
+            std::string value;
+        };
+
+        //called with a copy of every delivered message
         std::function<void(const PeerId &id, const std::string &msg)> msgCallback;
+        //called with a view of every delivered message, it points into the receive buffer and is valid until the callback returns
+        std::function<void(const PeerId &id, std::span<const std::byte> msg)> dataCallback;
+        //opt-in: the messages delivered by one received datagram in one call, views valid until it returns
+        std::function<void(const std::vector<Delivery> &messages)> batchCallback;
+        //called with the bytes of a stream in order, fin is set with the last ones. data is valid until the callback returns
+        std::function<void(const PeerId &id, uint32_t stream, std::string_view data, bool fin)> streamCallback;
+        //payloads of at least this many bytes are compressed for peers that support it, negative to disable
+        int compressionThreshold;
+        //codec and shared dictionary for payload compression
+        Compressor compressor;
+        //milliseconds between lookups for buckets that are not full, peers that joined later are found this way.
+        //a bucket the last lookup added no peer to waits twice as many intervals, up to maxRefreshRounds
+        int refreshInterval;
+        //number of known peers closest to the looked up id sent with a LOOKUP_REPLY
+        int lookupReplyCount;
+        //FIND_NODE queries a lookup keeps in flight (alpha)
+        int lookupParallelism;
+        //milliseconds until an unanswered FIND_NODE query counts as failed
+        int lookupTimeout;
+        //milliseconds between PINGs to all peers, the replies keep the rtt estimates current
+        int pingInterval;
+        //peers not heard from in this many milliseconds are removed like after a DISCONNECT, checked every ping round.
+        //should be a few ping intervals, 0 to keep silent peers
+        int peerTimeout;
+        //next hops may be up to this many distance bits worse than the closest peer if their rtt is lower, -1 to disable
+        int proximityBits;
+        //routed messages per second to one destination above which a direct link to it is set up with LOOKUP and HANDSHAKE,
+        //the link is pinned outside the buckets and dropped when less than half the rate is sent over it. 0 to disable
+        int directRate;
+        //pinned direct links kept at most
+        int maxDirectLinks;
+        //lower bound of the retransmission timeout of reliable sends in milliseconds
+        int reliableMinRto;
+        //bytes a stream may send ahead of what its receiver delivered, the first window of a stream is the one of the sender
+        int streamWindow;
+        //messages that would make a datagram larger than this are split into fragments, reliable ones into several segments
+        int maxDatagramSize;
+        //threads that forward ROUTE messages for other peers without the mutex, datagrams from one endpoint always go
+        //to the same thread to keep their order. the remaining messages are processed on one more thread, so callbacks
+        //do not stall forwarding. 0 to process everything on the network thread
+        int processingThreads;
+        //micro seconds small datagrams to the same endpoint are held back to be packed into one of up to maxDatagramSize,
+        //0 packs only what is sent until the network thread gets to it, negative to write every datagram right away
+        int coalesceDelay;
+        //fragments sent per millisecond, paces unreliable messages that have no congestion window
+        int fragmentBurst;
+        //milliseconds without a new fragment until the missing ones are requested again
+        int fragmentRepairDelay;
+        //incomplete messages are dropped after reassemblyTimeout milliseconds without a new fragment,
+        //or when they take more than reassemblyBytes together, senders keep fragments as long for repairs
+        int reassemblyTimeout;
+        int reassemblyBytes;
+        //test hook: milliseconds to hold back datagrams to an endpoint, emulates slow links on a local cluster,
+        //negative to drop the datagram
+        std::function<int(const Endpoint &ep)> linkDelay;
+        //broadcasts go along a tree of the XOR buckets, each peer receives them about once,
+        //false to flood them to all peers farther from the source
+        bool treeBroadcast;
+        //peers per bucket a tree broadcast is sent to, more than one tolerates failed peers at the cost of duplicates
+        int broadcastRedundancy;
+        //the peers a bucket sends tree broadcasts to (the mesh) are replaced when not heard from in this many milliseconds
+        int meshTimeout;
+        //milliseconds between IHAVE digests of recent tree broadcasts to gossipFanout random peers,
+        //peers that missed a broadcast fetch it with IWANT, 0 to disable
+        int gossipInterval;
+        int gossipFanout;
+        //tree broadcast bodies are kept for IWANT this many milliseconds, up to gossipCacheBytes
+        int gossipWindow;
+        int gossipCacheBytes;
+        //broadcasts are forwarded once, their ids are remembered for broadcastWindow milliseconds,
+        //for less if more than broadcastCapacity arrive in half the window
+        int broadcastWindow;
+        int broadcastCapacity;
+        //file the routing table is saved to every snapshotInterval milliseconds and restored from at start, empty to disable
+        std::string snapshotPath;
+        int snapshotInterval;
+        //restored peers that did not answer their handshake within this many milliseconds are removed
+        int validationTimeout;
+        //records of the replicated store are kept by the storeReplicas peers closest to KeyValueStore::keyId(key),
+        //writes and reads succeed when storeWriteQuorum and storeReadQuorum of them answered within storeTimeout milliseconds
+        int storeReplicas;
+        int storeWriteQuorum;
+        int storeReadQuorum;
+        int storeTimeout;
+        //file the local records are logged to and loaded from at start, empty to keep them in memory only
+        std::string storePath;
+        //a record read hotKeyReads times in a second is pushed to the previous hop of the reads, which answers
+        //GETs passing it for storeCacheTime milliseconds. cached values can be that much older than the latest write,
+        //0 to disable
+        int hotKeyReads;
+        int storeCacheTime;
+        //milliseconds the clock of a coordinator may be ahead of the local one, records with a newer version are rejected
+        int storeClockSkew;
+        //milliseconds between the SUBSCRIBEs members of a topic tree send to their parent to stay in it,
+        //children not heard from in three intervals are dropped
+        int topicRefreshInterval;
+
+        //datagrams and bytes written to the socket, for measurements
+        std::atomic<uint64_t> sentDatagrams;
+        std::atomic<uint64_t> sentBytes;
 
         PeerNetwork();
         void addEntryNode(const Endpoint &ep);
@@ -39,11 +163,45 @@ namespace pnet {
         Error join();
         void disconnect();
         bool isConnected();
+        //payloads are binary, ones containing NUL are always sent in WIRE_V2
+        void broadcast(const void *data, size_t size);
+        void broadcast(std::span<const std::byte> msg);
         void broadcast(const std::string &msg);
-        void send(const std::string &msg, const PeerId &id);
+        //reliable messages to a peer arrive exactly once and in order, they are retransmitted
+        //until acknowledged and paced by a congestion window
+        void send(const void *data, size_t size, const PeerId &id, bool reliable = false);
+        void send(std::span<const std::byte> msg, const PeerId &id, bool reliable = false);
+        void send(const std::string &msg, const PeerId &id, bool reliable = false);
         PeerId localId();
+        //iterative lookup of the bucketSize peers closest to target,
+        //the callback is called on the network thread when the lookup converged
+        std::future<std::vector<Peer>> lookup(const PeerId &target, std::function<void(const std::vector<Peer> &peers)> callback = nullptr);
         void waitForStop();
-        const std::vector<Peer> &getPeers();
+        //copy of the routing table as last published, the local peer first. rtt and lastSeen are refreshed every pingInterval
+        std::vector<Peer> getPeers();
+        //direct links pinned outside the buckets, as last published
+        std::vector<Peer> getDirectLinks();
+        //hits and misses of the next hop cache for sent and forwarded messages
+        NextHopCache::Counters &nextHopStats();
+        //replicated key value store, keys and values are binary and have to fit into one datagram together.
+        //the callback is called on the network thread when the quorum answered or the request timed out
+        std::future<StoreResult> put(const std::string &key, const std::string &value, std::function<void(const StoreResult &result)> callback = nullptr);
+        std::future<StoreResult> get(const std::string &key, std::function<void(const StoreResult &result)> callback = nullptr);
+        std::future<StoreResult> erase(const std::string &key, std::function<void(const StoreResult &result)> callback = nullptr);
+        //messages published to a topic reach the peers subscribed to it along a tree rooted at the peer closest to hashId(topic),
+        //the callback is called on the network thread. subscribing again replaces the callback
+        void subscribe(const std::string &topic, std::function<void(const PeerId &source, const std::string &msg)> callback);
+        void unsubscribe(const std::string &topic);
+        //the message has to fit into one datagram
+        void publish(const std::string &topic, std::string_view msg);
+        //ordered byte streams to a peer, the streams to one peer share a reliable session and its congestion window,
+        //a stream only waits for its own lost segments and flow control window. returns the id of the new stream
+        uint32_t openStream(const PeerId &id);
+        //false if the stream is closed or the session to the peer failed, the bytes are buffered until the window allows them
+        bool writeStream(const PeerId &id, uint32_t stream, std::string_view data);
+        void closeStream(const PeerId &id, uint32_t stream);
+        //bytes written to a stream that were not sent yet, for writers that pace themselves
+        size_t streamQueued(const PeerId &id, uint32_t stream);
     private:
         PeerRoutingTable routingTable;
         SocketHandler handler;
@@ -51,12 +209,282 @@ namespace pnet {
         std::shared_ptr<std::thread> thread;
         std::vector<char> readBuffer;
         std::vector<Endpoint> entryNodes;
-        std::map<Blob<32>, bool> broadcastIds;
+        BroadcastCache broadcastIds;
+        //serializes packet processing on the handler thread with calls from other threads,
+        //recursive because callbacks may call back into the network
+        std::recursive_mutex mutex;
+        //messages sent per destination in the current second, routed ones and ones over pinned links
+        std::map<PeerId, int> routedCount;
+        std::map<PeerId, int> directCount;
+        //destinations a direct link is set up to, with the time in milliseconds the LOOKUP was sent
+        std::map<PeerId, uint64_t> upgrades;
+        //immutable copy of routingTable for readers without the mutex, changes are published together after a datagram or timer
+        RcuPointer<PeerRoutingTable> publishedTable;
+        bool tableChanged;
+        //guards outbound, outboundTimer and delayed, datagrams are written from the processing threads as well
+        std::mutex writeMutex;
+        class ReceivedDatagram{
+        public:
+            std::vector<char> data;
+            int bytes;
+            //the part before offset is already processed
+            int offset;
+            //format in effect at offset
+            WireFormat format;
+            Endpoint ep;
+        };
+        class Shard{
+        public:
+            std::thread thread;
+            std::mutex mutex;
+            std::condition_variable ready;
+            std::deque<ReceivedDatagram> queue;
+            bool stopped = false;
+            //next hops of the ROUTE messages the shard forwards, checked against the published table
+            NextHopCache nextHops;
+
+            //false if the queue is full, the datagram is only moved from if it was queued
+            bool push(ReceivedDatagram &&datagram);
+            //waits for the next datagram, false when stopped
+            bool pop(ReceivedDatagram &datagram);
+            void stop();
+        };
+        //datagrams queued per shard until they are dropped
+        static constexpr size_t maxShardQueue = 8192;
+        //forwarding shards
+        std::vector<std::unique_ptr<Shard>> shards;
+        //messages for the local peer
+        std::unique_ptr<Shard> localShard;
+        //next hops of the ROUTE messages forwarded on the handler thread without shards
+        NextHopCache forwardHops;
+        //processed receive buffers for reuse
+        std::vector<std::vector<char>> freeBuffers;
+        std::mutex bufferMutex;
+        //send time of handshakes in microseconds, for the round trip time
+        std::unordered_map<Endpoint, uint64_t> handshakeTimes;
+        //send time of PINGs in microseconds
+        std::unordered_map<Endpoint, uint64_t> pingTimes;
+        class DelayedDatagram{
+        public:
+            uint64_t time;
+            std::vector<char> data;
+            Endpoint ep;
+        };
+        std::vector<DelayedDatagram> delayed;
+        //messages for batchCallback, delivered after the datagram is processed
+        std::vector<Delivery> batch;
+        //bodies of batched messages that are not in the receive buffer, decompressed or reassembled
+        std::deque<std::string> batchStorage;
+        class OutboundBuffer{
+        public:
+            std::vector<char> data;
+            //micro seconds
+            uint64_t deadline;
+        };
+        //datagrams packed per endpoint until coalesceDelay passed or maxDatagramSize is reached
+        std::unordered_map<Endpoint, OutboundBuffer> outbound;
+        int outboundTimer;
+        //mesh peers by bucket level
+        std::vector<std::vector<PeerId>> mesh;
+        class CachedBroadcast{
+        public:
+            PeerId source;
+            std::string msg;
+            uint64_t time;
+        };
+        std::map<Blob<32>, CachedBroadcast> gossipCache;
+        //cached ids, oldest first
+        std::deque<Blob<32>> gossipOrder;
+        int gossipCacheSize;
+        //time of the last IWANT for missed broadcasts
+        std::map<Blob<32>, uint64_t> wants;
+        std::map<PeerId, ReliableSender> senders;
+        std::map<PeerId, ReliableReceiver> receivers;
+        std::map<PeerId, StreamSender> streamSenders;
+        std::map<PeerId, StreamReceiver> streamReceivers;
+        //runs while reliable messages or stream segments are unacknowledged
+        int reliableTimer;
+        FragmentSender fragmentSender;
+        FragmentReassembler reassembler;
+        //runs while fragments are queued or messages incomplete
+        int fragmentTimer;
+        int validationTimer;
+        std::unordered_map<uint32_t, PeerLookup> lookups;
+        uint32_t nextLookupId;
+        static constexpr int maxRefreshRounds = 32;
+        class BucketRefresh{
+        public:
+            //milliseconds, UINT64_MAX while the lookup runs
+            uint64_t next = 0;
+            //refresh intervals until the next lookup
+            int rounds = 1;
+        };
+        //by level, dropped when a peer of the bucket is removed
+        std::unordered_map<int, BucketRefresh> bucketRefreshes;
+        //records kept by the local peer as one of the replicas
+        KeyValueStore store;
+        //a put, get or erase of the local peer, or one of another peer coordinated by the local peer
+        //because it is the closest to the key it knows
+        class StoreRequest{
+        public:
+            //PUT, DELETE or GET
+            Opcode opcode;
+            std::string key;
+            //the peer that made the request and its id for it, the local peer for its own requests
+            PeerId requester;
+            uint32_t requesterId;
+            //the peer a coordinated GET came from, it gets hot records to cache
+            PeerId previousHop;
+            //the local peer asked the replicas, answers counts the ones that stored or read the record
+            bool coordinating = false;
+            int answers = 0;
+            int needed = 0;
+            //newest record answered, and the version each replica answered with for read repair
+            KeyValueStore::Record record;
+            class Answer{
+            public:
+                //id 0 if the replica answered from an endpoint that is not in the table
+                PeerId id;
+                Endpoint ep;
+                uint64_t version;
+            };
+            std::vector<Answer> versions;
+            //milliseconds
+            uint64_t deadline;
+            std::promise<StoreResult> promise;
+            std::function<void(const StoreResult &result)> callback;
+        };
+        std::unordered_map<uint32_t, StoreRequest> storeRequests;
+        uint32_t nextStoreRequestId;
+        class CachedRecord{
+        public:
+            KeyValueStore::Record record;
+            //milliseconds
+            uint64_t expires;
+        };
+        //hot records pushed by the peers that answered GETs passing the local peer
+        std::unordered_map<std::string, CachedRecord> storeCache;
+        //size of storeCache, the forwarding threads leave routed GETs to the mutex while it is not 0
+        std::atomic<int> cachedKeys;
+        //GETs per key answered in the current second
+        std::unordered_map<std::string, int> keyReads;
+        //peers were added or removed since the records were last replicated
+        bool placementChanged;
+        class TopicChild{
+        public:
+            PeerId id;
+            Endpoint ep;
+            //milliseconds
+            uint64_t refreshed;
+        };
+        //a topic tree the local peer is a member of, because it subscribed or forwards to children
+        class Topic{
+        public:
+            std::function<void(const PeerId &source, const std::string &msg)> callback;
+            std::vector<TopicChild> children;
+            //the next hop towards the root, id 0 if the local peer is the root
+            PeerId parent;
+            Endpoint parentEp;
+        };
+        std::map<PeerId, Topic> topics;
+
+        void restoreSnapshot();
+        void validatePeers(uint64_t restoreTime);
+        void removeSilentPeers();
 
         void readPacket(int millisTimeout);
-        void processPacket(Packet &packet, const Endpoint &sourceEp);
+        void runShard(Shard &shard);
+        void runLocalShard();
+        void recycleBuffer(std::vector<char> &buffer);
+        void processDatagram(std::vector<char> &buffer, int bytes, const Endpoint &source);
+        void forwardRoutes(Packet &packet, const Endpoint &sourceEp, WireFormat &format, NextHopCache &nextHops);
+        void forwardRoute(Packet &packet, int packetStart, const RouteMessage &msg, WireFormat format, const Peer &next);
+        void processPacket(Packet &packet, const Endpoint &sourceEp, WireFormat format = WIRE_V1);
         void sendPacket(Packet &packet, const PeerId &destination);
-        void lookup(const PeerId &target);
+        void countTraffic(const PeerId &destination, bool direct);
+        //drop pinned links with too little traffic or no answers, called every second
+        void reviewDirectLinks();
+        void prependRoute(Packet &packet, const PeerId &source, const PeerId &destination, WireFormat format);
+        void forwardPacket(Packet &packet, int start, int bytes, WireFormat format, const Endpoint &ep);
+        void broadcastTree(std::string_view msg);
+        std::vector<Peer> meshPeers(int level);
+        void cacheBroadcast(const Blob<32> &broadcastId, const PeerId &source, std::string_view msg);
+        void gossip();
+        void flushReliable(const PeerId &id);
+        void retransmitReliable();
+        //send the stream segments the window of the session to a peer allows
+        void flushStreams(const PeerId &id);
+        StreamSender &streamSender(const PeerId &id);
+        void scheduleReliable();
+        void flushFragments();
+        void scheduleFragments();
+        int fragmentSize();
+        void handshake(const Endpoint &ep);
+        void ping();
+        void write(const char *ptr, int bytes, const Endpoint &ep);
+        void flushOutbound(bool all);
+        //the peer at ep negotiated WIRE_V2 in the last published table, datagrams to it can be packed
+        bool readsMarkers(const Endpoint &ep);
+        void writeDatagram(const char *ptr, int bytes, const Endpoint &ep);
+        void writeDelayed();
+        void stepLookup(uint32_t lookupId);
+        void expireLookups();
+        void refresh();
+        WireFormat formatOf(const PeerId &id);
+
+        std::future<StoreResult> request(Opcode opcode, const std::string &key, const std::string &value, std::function<void(const StoreResult &result)> callback);
+        uint32_t addStoreRequest(Opcode opcode, const std::string &key, const PeerId &requester, uint32_t requesterId, const PeerId &previousHop);
+        //ask the replicas of a request for which the local peer is the closest known peer to the key
+        void coordinate(uint32_t requestId, std::string_view value);
+        //the peers besides the local one that keep records of target, local is set if the local peer is one of them
+        std::vector<Peer> replicaPeers(const PeerId &target, bool &local);
+        void finishStoreRequest(uint32_t requestId, bool ok);
+        void sendRecord(const PeerId &id, uint32_t requestId, const std::string &key, const KeyValueStore::Record &record);
+        //send a record directly to an endpoint without a route header
+        void sendRecord(const Endpoint &ep, uint32_t requestId, const std::string &key, const KeyValueStore::Record &record);
+        void addRecord(Packet &packet, uint32_t requestId, const std::string &key, const KeyValueStore::Record &record);
+        //false for versions further ahead of the local clock than storeClockSkew
+        bool plausibleVersion(uint64_t version);
+        //reads a GET that is the payload of a ROUTE message whose header was just read, the packet offset is kept
+        bool peekGet(Packet &packet, WireFormat format, GetMessage &msg);
+        //answer a routed GET from storeCache instead of forwarding it
+        bool answerFromCache(Packet &packet, const RouteMessage &msg, WireFormat format, const PeerId &hopId);
+        void countRead(const std::string &key, const KeyValueStore::Record &record, const PeerId &previousHop, const PeerId &requester);
+        void expireStoreRequests();
+        //replicate the records whose replicas changed, expire cached records, called every second
+        void maintainStore();
+
+        //send a SUBSCRIBE to the next hop towards the root of a topic
+        void joinTopic(const PeerId &topicId);
+        //leave a topic without subscription and children
+        void leaveTopic(const PeerId &topicId);
+        //send a publish down the tree and deliver it, from is the parent it came from
+        void publishDown(const PublishMessage &msg, const Endpoint &from);
+        //drop silent children and refresh the subscriptions, called every topicRefreshInterval
+        void refreshTopics();
+        //children and parents that were removed from the routing table
+        void repairTopics(const PeerId &removed);
+
+        //copy the routing table to publishedTable if it changed or if forced
+        void publishTable(bool force = false);
+        bool addPeer(const Peer &peer);
+        bool removePeer(const PeerId &id);
+        void addRttSample(const PeerId &id, int micros);
+        void deliver(const PeerId &source, std::string_view msg);
+        void deliver(const PeerId &source, std::string &&msg);
+        void flushBatch();
+
+        bool compressPayload(std::string_view msg, std::string &output);
+        WireFormat payloadFormat(WireFormat format, std::string_view payload);
+        bool canForward(const Peer &peer, WireFormat format, bool compressed);
+
+        template<typename T>
+        void addMessage(Packet &packet, const T &msg, WireFormat format = WIRE_V1, bool compressed = false);
+        template<typename T>
+        void prependMessage(Packet &packet, const T &msg, WireFormat format = WIRE_V1);
+        template<typename T>
+        bool readMessage(Packet &packet, T &msg, WireFormat format = WIRE_V1);
+        bool readOpcode(Packet &packet, Opcode &opcode, bool &compressed, WireFormat format);
 
         void logError(Error error);
         void log(const std::string &msg, bool debug = false);
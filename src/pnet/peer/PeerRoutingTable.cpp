@@ -3,9 +3,54 @@
 //
 
 #include "PeerRoutingTable.h"
+#include "NearestScan.h"
+#include <algorithm>
+#include <climits>
+#include <cstring>
 
 namespace pnet {
 
+    //snapshot file layout: fixed size WIRE_V1 header followed by count peer records encoded in WIRE_V2
+    class SnapshotHeader{
+    public:
+        static constexpr uint32_t magicValue = 0x544e5050;
+        static constexpr uint32_t versionValue = 1;
+
+        uint32_t magic;
+        uint32_t version;
+        //FNV-1a of the records, a snapshot torn by a crash is not loaded
+        uint32_t checksum;
+        uint32_t count;
+        PeerId localId;
+
+        static constexpr auto fields(){
+            return std::make_tuple(&SnapshotHeader::magic, &SnapshotHeader::version, &SnapshotHeader::checksum,
+                &SnapshotHeader::count, &SnapshotHeader::localId);
+        }
+    };
+
+    class SnapshotPeer{
+    public:
+        PeerId id;
+        uint16_t port;
+        std::string address;
+        uint64_t lastSeen;
+        int32_t rtt;
+
+        static constexpr auto fields(){
+            return std::make_tuple(&SnapshotPeer::id, &SnapshotPeer::port, &SnapshotPeer::address,
+                &SnapshotPeer::lastSeen, &SnapshotPeer::rtt);
+        }
+    };
+
+    static uint32_t checksum(const char *ptr, const char *end){
+        uint32_t hash = 2166136261u;
+        for(; ptr < end; ptr++){
+            hash = (hash ^ (uint8_t)*ptr) * 16777619u;
+        }
+        return hash;
+    }
+
     std::string hex(PeerId id, bool shortVersion) {
         std::string str;
         for (int i = sizeof(id) - 1; i >= 0; i--) {
@@ -19,46 +64,122 @@ namespace pnet {
         return str;
     }
 
+    static uint64_t mix(uint64_t value){
+        //finalizer of splitmix64
+        value = (value ^ (value >> 30)) * 0xbf58476d1ce4e5b9ull;
+        value = (value ^ (value >> 27)) * 0x94d049bb133111ebull;
+        return value ^ (value >> 31);
+    }
+
+    PeerId hashId(std::string_view name) {
+        //two FNV-1a hashes with different offsets, mixed to spread similar names over the id space
+        uint64_t low = 14695981039346656037ull;
+        uint64_t high = 0x6c62272e07bb0142ull;
+        for(char c : name){
+            low = (low ^ (uint8_t)c) * 1099511628211ull;
+            high = (high ^ (uint8_t)c) * 1099511628211ull;
+        }
+        low = mix(low);
+        high = mix(high ^ low);
+        PeerId id;
+        std::memcpy(id.data, &low, sizeof(low));
+        std::memcpy(id.data + sizeof(low), &high, sizeof(high));
+        return id;
+    }
+
+    //levels where id differs from the local peer are closer to id than the local peer, higher levels first,
+    //levels where id matches the local peer are farther away, lower levels first
+    template<typename Func>
+    void PeerRoutingTable::forLevels(const PeerId &id, const Func &func) const {
+        PeerId distance = id ^ localPeer().id;
+        PeerId closer = distance & nonEmpty;
+        for(int level = closer.highestBit(); level != -1; level = closer.highestBit()){
+            closer.flipBit(level);
+            if(func(level)){
+                return;
+            }
+        }
+        if(func(-1)){
+            return;
+        }
+        PeerId farther = ~distance & nonEmpty;
+        for(int level = farther.lowestBit(); level != -1; level = farther.lowestBit()){
+            farther.flipBit(level);
+            if(func(level)){
+                return;
+            }
+        }
+    }
+
     PeerRoutingTable::PeerRoutingTable() {
         peers.push_back({(PeerId)0, Endpoint()});
+        buckets.resize(PeerId::bits);
+        generations.resize(PeerId::bits + 1);
+        bucketSize = 20;
+        replacementSize = 10;
+        proximityBits = 1;
     }
 
     Peer &PeerRoutingTable::localPeer() {
         return peers[0];
     }
 
-    void PeerRoutingTable::add(const Peer &peer) {
-        if(!has(peer.id)){
-            peers.push_back(peer);
-        }
+    const Peer &PeerRoutingTable::localPeer() const {
+        return peers[0];
     }
 
-    void PeerRoutingTable::add(const PeerId &id, const Endpoint &ep) {
-        if(!has(id)){
-            peers.push_back({id, ep});
+    bool PeerRoutingTable::add(const Peer &peer) {
+        int level = getLevel(peer.id);
+        if(level < 0){
+            return false;
+        }
+        if(indexOf(peer.id) != -1){
+            return true;
         }
-    }
 
-    bool PeerRoutingTable::has(const PeerId &id) {
-        for(auto &peer : peers){
-            if(peer.id == id){
-                return true;
+        Bucket &bucket = buckets[level];
+        for(int i = 0; i < bucket.replacements.size(); i++){
+            if(bucket.replacements[i].id == peer.id){
+                bucket.replacements.erase(bucket.replacements.begin() + i);
+                break;
             }
         }
-        return false;
-    }
 
-    bool PeerRoutingTable::has(const Endpoint &ep) {
-        for(auto &peer : peers){
-            if(peer.ep == ep){
-                return true;
+        if(bucket.slots.size() < bucketSize){
+            unpin(peer.id);
+            bool filled = bucket.slots.empty();
+            insert(peer, level);
+            invalidate(level, filled);
+            return true;
+        }else{
+            if(replacementSize > 0){
+                if(bucket.replacements.size() >= replacementSize){
+                    bucket.replacements.erase(bucket.replacements.begin());
+                }
+                bucket.replacements.push_back(peer);
             }
+            return false;
         }
-        return false;
+    }
+
+    bool PeerRoutingTable::add(const PeerId &id, const Endpoint &ep) {
+        return add({id, ep});
+    }
+
+    bool PeerRoutingTable::has(const PeerId &id) {
+        return indexOf(id) != -1;
+    }
+
+    bool PeerRoutingTable::has(const Endpoint &ep) {
+        return find(ep) != nullptr;
     }
 
     const Peer &PeerRoutingTable::get(const PeerId &id) {
-        for(auto &peer : peers){
+        int index = indexOf(id);
+        if(index != -1){
+            return peers[index];
+        }
+        for(auto &peer : pinned){
             if(peer.id == id){
                 return peer;
             }
@@ -66,60 +187,471 @@ namespace pnet {
         return defaultPeer;
     }
 
-    const Peer &PeerRoutingTable::get(const Endpoint &ep) {
-        for(auto &peer : peers){
+    const Peer &PeerRoutingTable::get(const Endpoint &ep) const {
+        const Peer *peer = find(ep);
+        if(peer != nullptr){
+            return *peer;
+        }
+        return defaultPeer;
+    }
+
+    Peer *PeerRoutingTable::find(const Endpoint &ep) {
+        return const_cast<Peer*>(static_cast<const PeerRoutingTable*>(this)->find(ep));
+    }
+
+    const Peer *PeerRoutingTable::find(const Endpoint &ep) const {
+        auto entry = endpointIndex.find(ep);
+        if(entry != endpointIndex.end()){
+            return &peers[entry->second];
+        }
+        if(ep == localPeer().ep){
+            return &localPeer();
+        }
+        for(auto &peer : pinned){
             if(peer.ep == ep){
-                return peer;
+                return &peer;
             }
         }
-        return defaultPeer;
+        return nullptr;
     }
 
     const Peer &PeerRoutingTable::getNext(const PeerId &id, const PeerId &except) {
-        int minIndex = -1;
-        PeerId minDistance = 0;
-
-        for(int i = 0; i < peers.size(); i++){
-            if(peers[i].id != except) {
-                PeerId distance = id ^peers[i].id;
-                if (minIndex == -1 || distance < minDistance) {
-                    minDistance = distance;
-                    minIndex = i;
+        return static_cast<const PeerRoutingTable*>(this)->getNext(id, except, nextHops);
+    }
+
+    const Peer &PeerRoutingTable::getNext(const PeerId &id, const PeerId &except, NextHopCache &cache) const {
+        //pinned peers and replacements are not cached, so pinning a peer needs no invalidation
+        const Peer *direct = findDirect(id, except);
+        if(direct != nullptr){
+            return *direct;
+        }
+        cache.setLocalId(localPeer().id);
+        //slots are reused by other peers when a peer is removed
+        const NextHopCache::Entry *entry = cache.find(id, [&](const NextHopCache::Entry &entry){
+            return entry.generation == generations[entry.level + 1]
+                && (size_t)entry.slot < peers.size() && peers[entry.slot].id == entry.next;
+        });
+        //an entry is computed without except, excluding a peer that is neither the result nor the closest one changes nothing
+        if(entry != nullptr && entry->next != except && entry->closest != except){
+            return peers[entry->slot];
+        }
+
+        int closest = -1;
+        if(entry == nullptr){
+            int index = nextIndex(id, PeerId(0), closest);
+            if(index != -1){
+                int level = getLevel(peers[index].id);
+                cache.insert({id, index, level, generations[level + 1], peers[index].id, peers[closest].id});
+                if(peers[index].id != except && peers[closest].id != except){
+                    return peers[index];
                 }
             }
         }
+        int index = nextIndex(id, except, closest);
+        return index != -1 ? peers[index] : defaultPeer;
+    }
 
-        if(minIndex != -1){
-            return peers[minIndex];
-        }else{
-            return defaultPeer;
+    const Peer &PeerRoutingTable::getNextUncached(const PeerId &id, const PeerId &except) const {
+        const Peer *replacement = findDirect(id, except);
+        if(replacement != nullptr){
+            return *replacement;
         }
+        int closest = -1;
+        int index = nextIndex(id, except, closest);
+        return index != -1 ? peers[index] : defaultPeer;
+    }
+
+    std::vector<Peer> PeerRoutingTable::getClosest(const PeerId &id, int count, const PeerId &except) {
+        std::vector<int> slots;
+        forLevels(id, [&](int level){
+            if(level == -1){
+                return false;
+            }
+            int begin = slots.size();
+            for(int slot : buckets[level].slots){
+                if(peers[slot].id != except){
+                    slots.push_back(slot);
+                }
+            }
+            std::sort(slots.begin() + begin, slots.end(), [&](int a, int b){
+                return (peers[a].id ^ id) < (peers[b].id ^ id);
+            });
+            return slots.size() >= count;
+        });
+
+        std::vector<Peer> result;
+        for(int i = 0; i < slots.size() && i < count; i++){
+            result.push_back(peers[slots[i]]);
+        }
+        return result;
+    }
+
+    std::vector<Peer> PeerRoutingTable::getBucket(int level, int count) {
+        std::vector<Peer> result;
+        if(!nonEmpty.getBit(level)){
+            return result;
+        }
+        std::vector<int> slots = buckets[level].slots;
+        auto rtt = [&](int slot){
+            return peers[slot].rtt > 0 ? peers[slot].rtt : INT_MAX;
+        };
+        int size = std::min<int>(count, slots.size());
+        std::partial_sort(slots.begin(), slots.begin() + size, slots.end(), [&](int a, int b){
+            return rtt(a) < rtt(b);
+        });
+        slots.resize(size);
+        for(int slot : slots){
+            result.push_back(peers[slot]);
+        }
+        return result;
     }
 
     PeerId PeerRoutingTable::lookupTarget(int level) {
-        return localPeer().id ^ (PeerId(1) << level);
+        PeerId target = localPeer().id;
+        target.flipBit(level);
+        return target;
     }
 
     bool PeerRoutingTable::remove(const PeerId &id) {
-        bool removed = false;
+        int level = getLevel(id);
+        if(level < 0){
+            return false;
+        }
+        if(unpin(id)){
+            return true;
+        }
+
+        Bucket &bucket = buckets[level];
+        for(int i = 0; i < bucket.replacements.size(); i++){
+            if(bucket.replacements[i].id == id){
+                bucket.replacements.erase(bucket.replacements.begin() + i);
+                break;
+            }
+        }
+
+        for(int i = 0; i < bucket.slots.size(); i++){
+            int slot = bucket.slots[i];
+            if(peers[slot].id == id){
+                invalidate(level);
+                bucket.slots.erase(bucket.slots.begin() + i);
+                bucket.high.erase(bucket.high.begin() + i);
+                bucket.low.erase(bucket.low.begin() + i);
+                unindexEndpoint(slot);
+
+                //move the last peer into the free slot
+                int last = peers.size() - 1;
+                if(slot != last){
+                    unindexEndpoint(last);
+                    peers[slot] = peers[last];
+                    for(int &moved : buckets[getLevel(peers[slot].id)].slots){
+                        if(moved == last){
+                            moved = slot;
+                        }
+                    }
+                    indexEndpoint(slot);
+                }
+                peers.pop_back();
+
+                //refill with the most recently seen replacement
+                if(!bucket.replacements.empty()){
+                    Peer replacement = bucket.replacements.back();
+                    bucket.replacements.pop_back();
+                    insert(replacement, level);
+                }
+                nonEmpty.setBit(level, !bucket.slots.empty());
+                return true;
+            }
+        }
+        return false;
+    }
+
+    bool PeerRoutingTable::pin(const Peer &peer) {
+        if(getLevel(peer.id) < 0 || indexOf(peer.id) != -1){
+            return false;
+        }
+        for(auto &link : pinned){
+            if(link.id == peer.id){
+                return false;
+            }
+        }
+        pinned.push_back(peer);
+        return true;
+    }
+
+    bool PeerRoutingTable::unpin(const PeerId &id) {
+        for(int i = 0; i < pinned.size(); i++){
+            if(pinned[i].id == id){
+                pinned.erase(pinned.begin() + i);
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void PeerRoutingTable::setFormat(const PeerId &id, WireFormat format) {
+        int index = indexOf(id);
+        if(index != -1){
+            peers[index].format = format;
+        }
+        for(auto &peer : pinned){
+            if(peer.id == id){
+                peer.format = format;
+            }
+        }
+    }
+
+    void PeerRoutingTable::setCompression(const PeerId &id, bool compression) {
+        int index = indexOf(id);
+        if(index != -1){
+            peers[index].compression = compression;
+        }
+        for(auto &peer : pinned){
+            if(peer.id == id){
+                peer.compression = compression;
+            }
+        }
+    }
+
+    void PeerRoutingTable::addRttSample(const PeerId &id, int micros) {
+        int index = indexOf(id);
+        if(index <= 0){
+            return;
+        }
+        Peer &peer = peers[index];
+        //the rtt decides between the peers of the bucket a next hop was found in
+        if(proximityBits >= 0){
+            invalidate(getLevel(peer.id));
+        }
+        micros = micros < 1 ? 1 : micros;
+        //smoothing as for the TCP retransmission timer (RFC 6298)
+        if(peer.rtt == 0){
+            peer.rtt = micros;
+            peer.jitter = micros / 2;
+        }else{
+            int deviation = peer.rtt > micros ? peer.rtt - micros : micros - peer.rtt;
+            peer.jitter += (deviation - peer.jitter) / 4;
+            peer.rtt += (micros - peer.rtt) / 8;
+            peer.rtt = peer.rtt < 1 ? 1 : peer.rtt;
+        }
+    }
+
+    int PeerRoutingTable::getLevel(PeerId id) const {
+        return (id ^ localPeer().id).highestBit();
+    }
+
+    std::vector<int> PeerRoutingTable::refreshLevels() {
+        std::vector<int> levels;
+        int lowest = nonEmpty.lowestBit();
+        for(int level = PeerId::bits - 1; level >= 0 && level >= lowest - 1; level--){
+            if(buckets[level].slots.size() < bucketSize){
+                levels.push_back(level);
+            }
+        }
+        return levels;
+    }
+
+    Error PeerRoutingTable::saveSnapshot(const std::string &path) {
+        std::vector<SnapshotPeer> records;
+        int size = 0;
         for(int i = 1; i < peers.size(); i++){
-            if(peers[i].id == id){
-                peers.erase(peers.begin() + i);
-                i--;
-                removed = true;
+            if(peers[i].ep.valid()){
+                records.push_back({peers[i].id, peers[i].ep.getPort(), peers[i].ep.getAddress(), peers[i].lastSeen, peers[i].rtt});
+                size += Schema<SnapshotPeer>::size(records.back(), WIRE_V2);
+            }
+        }
+        SnapshotHeader header{SnapshotHeader::magicValue, SnapshotHeader::versionValue, 0, (uint32_t)records.size(), localPeer().id};
+        int headerSize = Schema<SnapshotHeader>::minSize<WIRE_V1>;
+
+        if(!snapshot.isOpen() || snapshotPath != path){
+            Error error = snapshot.create(path, headerSize + size);
+            if(error){
+                return error;
+            }
+            snapshotPath = path;
+        }else if(snapshot.size() < headerSize + size){
+            //grow with room for more peers, the record count marks the end
+            Error error = snapshot.resize((headerSize + size) * 3 / 2);
+            if(error){
+                snapshot.close();
+                return error;
+            }
+        }
+
+        char *begin = snapshot.data() + headerSize;
+        char *ptr = begin;
+        for(auto &record : records){
+            ptr = Schema<SnapshotPeer>::write(ptr, record, WIRE_V2);
+        }
+        header.checksum = checksum(begin, ptr);
+        Schema<SnapshotHeader>::write(snapshot.data(), header, WIRE_V1);
+        return snapshot.flush();
+    }
+
+    Error PeerRoutingTable::loadSnapshot(const std::string &path, PeerId &localId, std::vector<Peer> &peers) {
+        MappedFile file;
+        Error error = file.open(path);
+        if(error){
+            return error;
+        }
+
+        const char *end = file.data() + file.size();
+        SnapshotHeader header;
+        const char *begin = Schema<SnapshotHeader>::read(file.data(), end, header, WIRE_V1);
+        if(begin == nullptr || header.magic != SnapshotHeader::magicValue || header.version != SnapshotHeader::versionValue){
+            return Error("invalid snapshot");
+        }
+
+        std::vector<Peer> result;
+        const char *ptr = begin;
+        for(int i = 0; i < header.count; i++){
+            SnapshotPeer record;
+            ptr = Schema<SnapshotPeer>::read(ptr, end, record, WIRE_V2);
+            if(ptr == nullptr){
+                return Error("invalid snapshot");
+            }
+            Peer peer;
+            peer.id = record.id;
+            peer.ep.set(record.address.c_str(), record.port);
+            peer.lastSeen = record.lastSeen;
+            peer.rtt = record.rtt;
+            result.push_back(peer);
+        }
+        if(checksum(begin, ptr) != header.checksum){
+            return Error("invalid snapshot");
+        }
+
+        localId = header.localId;
+        peers.swap(result);
+        return Error();
+    }
+
+    int PeerRoutingTable::indexOf(const PeerId &id) {
+        int level = getLevel(id);
+        if(level < 0){
+            return 0;
+        }
+        for(int slot : buckets[level].slots){
+            if(peers[slot].id == id){
+                return slot;
             }
         }
-        return removed;
+        return -1;
     }
 
-    int PeerRoutingTable::getLevel(PeerId id) {
-        PeerId dist = id ^ localPeer().id;
-        int level = -1;
-        while (dist > (PeerId) 0) {
-            dist = dist >> 1;
-            level++;
+    int PeerRoutingTable::closestIn(int level, const PeerId &id, const PeerId &except) const {
+        static const NearestScan scan = nearestScan();
+        const Bucket &bucket = buckets[level];
+        int index = scan(bucket.high.data(), bucket.low.data(), bucket.slots.size(),
+                id.word(1), id.word(0), except.word(1), except.word(0));
+        if(index != -1){
+            return bucket.slots[index];
+        }
+        return -1;
+    }
+
+    int PeerRoutingTable::nextIndex(const PeerId &id, const PeerId &except, int &closest) const {
+        int index = -1;
+        bool closer = true;
+        forLevels(id, [&](int level){
+            if(level == -1){
+                closer = false;
+                if(localPeer().id != except){
+                    index = 0;
+                }
+            }else{
+                index = closestIn(level, id, except);
+                //every peer of a closer level is closer than the local peer, routing still makes progress
+                if(index != -1 && closer && proximityBits >= 0){
+                    closest = index;
+                    index = proximityIn(level, id, except, index);
+                    return true;
+                }
+            }
+            closest = index;
+            return index != -1;
+        });
+        return index;
+    }
+
+    //a contact kept as replacement is still reachable directly, e.g. the source of a relayed LOOKUP_REPLY
+    const Peer *PeerRoutingTable::findDirect(const PeerId &id, const PeerId &except) const {
+        if(id == except){
+            return nullptr;
+        }
+        for(auto &peer : pinned){
+            if(peer.id == id){
+                return &peer;
+            }
+        }
+        int level = getLevel(id);
+        if(level >= 0){
+            for(auto &peer : buckets[level].replacements){
+                if(peer.id == id){
+                    return &peer;
+                }
+            }
+        }
+        return nullptr;
+    }
+
+    void PeerRoutingTable::invalidate(int level, bool filled) {
+        //the next hop is in the first non-empty bucket forLevels visits, or the local peer.
+        //it only changes if that bucket changes or if a bucket visited before it was empty and is not anymore,
+        //those are visited before the local peer too and so are higher levels than the next hop
+        generations[level + 1]++;
+        if(filled){
+            for(int lower = -1; lower < level; lower++){
+                generations[lower + 1]++;
+            }
+        }
+    }
+
+    int PeerRoutingTable::proximityIn(int level, const PeerId &id, const PeerId &except, int closest) const {
+        PeerId distance = peers[closest].id ^ id;
+        if(distance.isZero()){
+            return closest;
+        }
+        int limit = distance.highestBit() + proximityBits;
+        int index = closest;
+        int rtt = peers[closest].rtt > 0 ? peers[closest].rtt : INT_MAX;
+        for(int slot : buckets[level].slots){
+            const Peer &peer = peers[slot];
+            if(peer.rtt > 0 && peer.rtt < rtt && peer.id != except && (peer.id ^ id).highestBit() <= limit){
+                index = slot;
+                rtt = peer.rtt;
+            }
+        }
+        return index;
+    }
+
+    void PeerRoutingTable::insert(const Peer &peer, int level) {
+        peers.push_back(peer);
+        buckets[level].slots.push_back(peers.size() - 1);
+        buckets[level].high.push_back(peer.id.word(1));
+        buckets[level].low.push_back(peer.id.word(0));
+        nonEmpty.setBit(level);
+        indexEndpoint(peers.size() - 1);
+    }
+
+    void PeerRoutingTable::indexEndpoint(int slot) {
+        //invalid endpoints never compare equal and can not be looked up
+        if(peers[slot].ep.valid()){
+            endpointIndex[peers[slot].ep] = slot;
+        }
+    }
+
+    void PeerRoutingTable::unindexEndpoint(int slot) {
+        auto entry = endpointIndex.find(peers[slot].ep);
+        if(entry != endpointIndex.end() && entry->second == slot){
+            endpointIndex.erase(entry);
+            //another peer may share the endpoint, e.g. a restarted node with a new id
+            for(int i = 1; i < peers.size(); i++){
+                if(i != slot && peers[i].ep == peers[slot].ep){
+                    endpointIndex[peers[i].ep] = i;
+                    break;
+                }
+            }
         }
-        return level;
     }
 
-}
\ No newline at end of file
+}
@@ -5,39 +5,134 @@
 #ifndef SOCKET_PEERROUTINGTABLE_H
 #define SOCKET_PEERROUTINGTABLE_H
 
-#include "pnet/Blob.h"
 #include "pnet/Endpoint.h"
+#include "pnet/Schema.h"
+#include "pnet/MappedFile.h"
+#include "PeerId.h"
+#include "NextHopCache.h"
 #include <vector>
+#include <unordered_map>
 
 namespace pnet {
 
-    typedef Blob<16> PeerId;
-
     class Peer{
     public:
         PeerId id;
         Endpoint ep;
+        //format the peer can read, upgraded when it sends COMPACT
+        WireFormat format = WIRE_V1;
+        //the peer accepts compressed payloads, set when it sends COMPRESSION
+        bool compression = false;
+        //unix time in milliseconds of the last datagram received from the peer
+        uint64_t lastSeen = 0;
+        //smoothed round trip time in microseconds from handshakes and pings, 0 if not measured
+        int rtt = 0;
+        //smoothed deviation of the round trip time in microseconds
+        int jitter = 0;
     };
 
     std::string hex(PeerId id, bool shortVersion = false);
+    //position of a name in the id space, e.g. of a store key or a topic
+    PeerId hashId(std::string_view name);
 
+    //Kademlia style routing table, peers are sorted into buckets by the highest bit of their
+    //XOR distance to the local peer (the level), each bucket holds at most bucketSize peers
     class PeerRoutingTable{
     public:
+        //the local peer followed by all peers in the buckets
         std::vector<Peer> peers;
         Peer defaultPeer;
+        //maximum number of peers per bucket (k)
+        int bucketSize;
+        //maximum number of contacts kept per bucket to refill it when peers are removed
+        int replacementSize;
+        //next hops may be up to this many distance bits worse than the closest peer if their rtt is lower, -1 to disable
+        int proximityBits;
+        //direct links to peers outside the buckets, changed with pin and unpin
+        std::vector<Peer> pinned;
+        //results of getNext, an entry is dropped when the bucket it depends on changed since
+        NextHopCache nextHops;
 
         PeerRoutingTable();
         Peer &localPeer();
-        void add(const Peer &peer);
-        void add(const PeerId &id, const Endpoint &ep);
+        const Peer &localPeer() const;
+        //returns false if the bucket is full, the peer is kept as a replacement then
+        bool add(const Peer &peer);
+        bool add(const PeerId &id, const Endpoint &ep);
         bool has(const PeerId &id);
         bool has(const Endpoint &ep);
         const Peer &get(const PeerId &id);
-        const Peer &get(const Endpoint &ep);
+        const Peer &get(const Endpoint &ep) const;
+        //nullptr if no peer has the endpoint, the pointer is valid until the table is modified
+        Peer *find(const Endpoint &ep);
+        const Peer *find(const Endpoint &ep) const;
+        //removes the peer from the buckets and the pinned links
         bool remove(const PeerId &id);
+        //keep a direct link to a peer that is not in a bucket, getNext returns it for its own id
+        bool pin(const Peer &peer);
+        bool unpin(const PeerId &id);
+        void setFormat(const PeerId &id, WireFormat format);
+        void setCompression(const PeerId &id, bool compression);
+        //feed a round trip time measurement into the smoothed rtt and jitter of a peer
+        void addRttSample(const PeerId &id, int micros);
+        //the peer with the smallest XOR distance to id, including the local peer and a pinned peer or replacement with exactly id,
+        //a peer with a lower rtt is preferred if it is within proximityBits and closer to id than the local peer
         const Peer &getNext(const PeerId &id, const PeerId &except = 0);
+        //getNext with a cache of the caller, for tables read by several threads at once such as published snapshots.
+        //entries stay valid in copies of the table as long as the buckets they depend on are not changed
+        const Peer &getNext(const PeerId &id, const PeerId &except, NextHopCache &cache) const;
+        //getNext without a cache
+        const Peer &getNextUncached(const PeerId &id, const PeerId &except = 0) const;
+        //up to count peers ordered by XOR distance to id, without the local peer
+        std::vector<Peer> getClosest(const PeerId &id, int count, const PeerId &except = 0);
+        //up to count peers of the bucket at level, lowest measured rtt first
+        std::vector<Peer> getBucket(int level, int count);
         PeerId lookupTarget(int level);
-        int getLevel(PeerId id);
+        int getLevel(PeerId id) const;
+        //levels worth a lookup: buckets that are not full, down to one level below the closest known peer
+        std::vector<int> refreshLevels();
+
+        //write the local id and all peers to a memory mapped file, the file stays mapped for the next snapshot
+        Error saveSnapshot(const std::string &path);
+        //read a snapshot written by saveSnapshot, the table is not changed
+        static Error loadSnapshot(const std::string &path, PeerId &localId, std::vector<Peer> &peers);
+    private:
+        class Bucket{
+        public:
+            //indices into peers
+            std::vector<int> slots;
+            //ids of the slots as high and low words, contiguous for the vectorized distance scan
+            std::vector<uint64_t> high;
+            std::vector<uint64_t> low;
+            //most recently seen last
+            std::vector<Peer> replacements;
+        };
+        std::vector<Bucket> buckets;
+        //bit level is set if bucket level is not empty
+        PeerId nonEmpty;
+        //slot of the peer with an endpoint, for the source lookup of every received datagram
+        std::unordered_map<Endpoint, int> endpointIndex;
+        MappedFile snapshot;
+        std::string snapshotPath;
+        //generation of each bucket for the cached next hops, incremented when a change of the bucket can change them, -1 is the local peer at 0
+        std::vector<uint64_t> generations;
+
+        int indexOf(const PeerId &id);
+        int closestIn(int level, const PeerId &id, const PeerId &except) const;
+        int proximityIn(int level, const PeerId &id, const PeerId &except, int closest) const;
+        //index of the next hop without replacements, closest is the index before a peer with a lower rtt was preferred
+        int nextIndex(const PeerId &id, const PeerId &except, int &closest) const;
+        //a pinned peer or replacement with exactly id
+        const Peer *findDirect(const PeerId &id, const PeerId &except) const;
+        //invalidate the cached next hops a change of the bucket at level can affect,
+        //filled if the bucket was empty before, next hops in lower buckets can move to it then
+        void invalidate(int level, bool filled = false);
+        void insert(const Peer &peer, int level);
+        void indexEndpoint(int slot);
+        void unindexEndpoint(int slot);
+        //call a function with each level in XOR order to id, -1 stands for the local peer
+        template<typename Func>
+        void forLevels(const PeerId &id, const Func &func) const;
     };
 
 }
@@ -0,0 +1,239 @@
+//
+// Copyright (c) 2020 Julian Hinxlage. All rights reserved.
+//
+
+#include "ReliableChannel.h"
+#include <algorithm>
+#include <cstdlib>
+
+namespace pnet {
+
+    //acknowledged later segments that mark an earlier one as lost
+    static constexpr int duplicateThreshold = 3;
+    static constexpr int initialRto = 1000000;
+    static constexpr int maxRto = 10000000;
+
+    ReliableSender::ReliableSender(uint32_t session, int minRtoMillis) {
+        this->session = session;
+        cwnd = 4;
+        ssthresh = maxWindow;
+        srtt = 0;
+        rttvar = 0;
+        minRto = minRtoMillis * 1000;
+        rto = std::max(initialRto, minRto);
+        maxTransmissions = 10;
+        failed = false;
+        nextSequence = 0;
+        recover = 0;
+    }
+
+    void ReliableSender::push(const std::string &msg, bool more) {
+        queue.push_back(Segment());
+        queue.back().msg = msg;
+        queue.back().more = more;
+    }
+
+    void ReliableSender::ack(uint32_t expected, uint64_t mask, uint64_t now) {
+        bool newData = false;
+        for(auto &segment : window){
+            if(segment.acked){
+                continue;
+            }
+            uint32_t offset = segment.sequence - expected - 1;
+            if(segment.sequence < expected || (segment.sequence > expected && offset < 64 && (mask >> offset) & 1)){
+                segment.acked = true;
+                newData = true;
+                //Karn: the ACK of a retransmitted segment could belong to any of its transmissions
+                if(segment.transmissions == 1){
+                    addRttSample(now - segment.sent);
+                }
+                if(cwnd < ssthresh){
+                    cwnd += 1;
+                }else{
+                    cwnd += 1 / cwnd;
+                }
+            }
+        }
+        cwnd = std::min(cwnd, (double)maxWindow);
+        if(!newData){
+            return;
+        }
+
+        //a segment is lost when enough segments sent after it arrived,
+        //ackedAbove[i] counts the acknowledged segments after window[i], the window holds consecutive sequences
+        std::vector<int> ackedAbove(window.size() + 1, 0);
+        for(int i = window.size() - 1; i >= 0; i--){
+            ackedAbove[i] = ackedAbove[i + 1] + (window[i].acked ? 1 : 0);
+        }
+        uint32_t base = window.empty() ? 0 : window.front().sequence;
+        for(auto &segment : window){
+            if(segment.acked || segment.lost || segment.transmissions == 0){
+                continue;
+            }
+            int index = std::min<uint32_t>(segment.mark - base, window.size() - 1);
+            if(ackedAbove[index + 1] >= duplicateThreshold){
+                segment.lost = true;
+                if(segment.sequence >= recover){
+                    reduceWindow(false);
+                }
+            }
+        }
+        while(!window.empty() && window.front().acked){
+            window.pop_front();
+        }
+    }
+
+    std::vector<ReliableSender::Segment*> ReliableSender::poll(uint64_t now) {
+        std::vector<Segment*> result;
+        if(failed){
+            return result;
+        }
+
+        //retransmission timeout: everything in flight is considered lost
+        for(auto &segment : window){
+            if(!segment.acked && !segment.lost && segment.transmissions > 0 && now - segment.sent >= (uint64_t)rto){
+                for(auto &other : window){
+                    if(!other.acked && other.transmissions > 0){
+                        other.lost = true;
+                    }
+                }
+                reduceWindow(true);
+                rto = std::min(rto * 2, maxRto);
+                break;
+            }
+        }
+
+        int flight = inFlight();
+        for(auto &segment : window){
+            if(flight >= (int)cwnd){
+                return result;
+            }
+            if(segment.lost && !segment.acked){
+                if(segment.transmissions >= maxTransmissions){
+                    failed = true;
+                    result.clear();
+                    return result;
+                }
+                segment.lost = false;
+                segment.sent = now;
+                segment.transmissions++;
+                segment.mark = nextSequence - 1;
+                result.push_back(&segment);
+                flight++;
+            }
+        }
+        while(flight < (int)cwnd && !queue.empty() && window.size() < maxWindow){
+            window.push_back(std::move(queue.front()));
+            queue.pop_front();
+            Segment &segment = window.back();
+            segment.sequence = nextSequence++;
+            segment.sent = now;
+            segment.transmissions = 1;
+            segment.mark = segment.sequence;
+            result.push_back(&segment);
+            flight++;
+        }
+        return result;
+    }
+
+    bool ReliableSender::idle() {
+        return window.empty() && queue.empty();
+    }
+
+    int ReliableSender::space() {
+        if(failed){
+            return 0;
+        }
+        //lost segments are sent again before new ones
+        int lost = 0;
+        for(auto &segment : window){
+            if(segment.lost && !segment.acked){
+                lost++;
+            }
+        }
+        int room = std::min((int)cwnd - inFlight() - lost, maxWindow - (int)window.size());
+        return std::max(room - (int)queue.size(), 0);
+    }
+
+    int ReliableSender::inFlight() {
+        int count = 0;
+        for(auto &segment : window){
+            if(!segment.acked && !segment.lost && segment.transmissions > 0){
+                count++;
+            }
+        }
+        return count;
+    }
+
+    void ReliableSender::addRttSample(int micros) {
+        if(srtt == 0){
+            srtt = micros;
+            rttvar = micros / 2;
+        }else{
+            rttvar += (std::abs(srtt - micros) - rttvar) / 4;
+            srtt += (micros - srtt) / 8;
+        }
+        rto = std::clamp(srtt + std::max(4 * rttvar, 1000), minRto, maxRto);
+    }
+
+    void ReliableSender::reduceWindow(bool timeout) {
+        ssthresh = std::max(cwnd / 2, 2.0);
+        cwnd = timeout ? 1 : ssthresh;
+        recover = nextSequence;
+    }
+
+    ReliableReceiver::ReliableReceiver(uint32_t session, int maxMessageSize) {
+        this->session = session;
+        this->maxMessageSize = maxMessageSize;
+        expected = 0;
+        discard = false;
+    }
+
+    void ReliableReceiver::receive(uint32_t sequence, bool more, std::string &msg, std::vector<std::string> &deliver) {
+        if(sequence < expected || sequence - expected >= ReliableSender::maxWindow){
+            return;
+        }
+        if(buffered.find(sequence) == buffered.end()){
+            auto &entry = buffered[sequence];
+            entry.first.swap(msg);
+            entry.second = more;
+        }
+        while(!buffered.empty() && buffered.begin()->first == expected){
+            auto &entry = buffered.begin()->second;
+            if(!discard && partial.size() + entry.first.size() > (size_t)maxMessageSize){
+                discard = true;
+                partial.clear();
+                partial.shrink_to_fit();
+            }
+            if(!discard){
+                if(partial.empty()){
+                    partial.swap(entry.first);
+                }else{
+                    partial += entry.first;
+                }
+            }
+            if(!entry.second){
+                if(!discard){
+                    deliver.push_back(std::move(partial));
+                }
+                partial.clear();
+                discard = false;
+            }
+            buffered.erase(buffered.begin());
+            expected++;
+        }
+    }
+
+    uint64_t ReliableReceiver::mask() {
+        uint64_t mask = 0;
+        for(auto &entry : buffered){
+            uint32_t offset = entry.first - expected - 1;
+            if(offset >= 64){
+                break;
+            }
+            mask |= 1ull << offset;
+        }
+        return mask;
+    }
+
+}
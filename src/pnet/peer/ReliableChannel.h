@@ -0,0 +1,102 @@
+//
+// Copyright (c) 2020 Julian Hinxlage. All rights reserved.
+//
+
+#ifndef SOCKET_RELIABLECHANNEL_H
+#define SOCKET_RELIABLECHANNEL_H
+
+#include <string>
+#include <deque>
+#include <map>
+#include <vector>
+#include <cstdint>
+
+namespace pnet {
+
+    //sending side of a reliable ordered message stream to one peer
+    //sequence numbers start at 0 for every session, selective ACKs report the next expected sequence
+    //and which of the 64 following sequences were received.
+    //the round trip time is estimated as in RFC 6298, the congestion window grows and shrinks like TCP NewReno (AIMD)
+    class ReliableSender{
+    public:
+        //sequences ahead of the receiver that are sent or buffered, bounds the memory of both sides
+        static constexpr int maxWindow = 256;
+
+        class Segment{
+        public:
+            uint32_t sequence;
+            std::string msg;
+            //the message continues in the next segment
+            bool more = false;
+            //micro seconds
+            uint64_t sent = 0;
+            int transmissions = 0;
+            //highest sequence sent when it was last transmitted, only ACKs above it tell it is lost again
+            uint32_t mark = 0;
+            bool acked = false;
+            //needs a retransmission
+            bool lost = false;
+        };
+
+        //random per sender, the receiver starts over when it changes
+        uint32_t session;
+        //segments
+        double cwnd;
+        double ssthresh;
+        //micro seconds
+        int srtt;
+        int rttvar;
+        int rto;
+        int minRto;
+        //a segment sent this many times without an ACK fails the session
+        int maxTransmissions;
+        bool failed;
+
+        ReliableSender(uint32_t session = 0, int minRtoMillis = 200);
+        //messages larger than one datagram are pushed in parts, all but the last with more set
+        void push(const std::string &msg, bool more = false);
+        void ack(uint32_t expected, uint64_t mask, uint64_t now);
+        //segments to send now, lost and timed out segments first, then new ones as the window allows
+        std::vector<Segment*> poll(uint64_t now);
+        //all messages are acknowledged
+        bool idle();
+        //segments that could be pushed and sent by the next poll without waiting, for callers that keep their own queues
+        int space();
+    private:
+        //unacknowledged segments in sequence order
+        std::deque<Segment> window;
+        std::deque<Segment> queue;
+        uint32_t nextSequence;
+        //no further window reduction until the segments sent before a loss are acknowledged
+        uint32_t recover;
+
+        int inFlight();
+        void addRttSample(int micros);
+        void reduceWindow(bool timeout);
+    };
+
+    //receiving side of a session, delivers messages in order exactly once
+    class ReliableReceiver{
+    public:
+        uint32_t session;
+        //next sequence to deliver
+        uint32_t expected;
+        //bytes of a message assembled from parts, larger messages are dropped
+        int maxMessageSize;
+
+        ReliableReceiver(uint32_t session = 0, int maxMessageSize = 64 * 1024 * 1024);
+        //appends the messages that are now in order and complete to deliver
+        void receive(uint32_t sequence, bool more, std::string &msg, std::vector<std::string> &deliver);
+        //bit i is set if expected + 1 + i was received
+        uint64_t mask();
+    private:
+        std::map<uint32_t, std::pair<std::string, bool>> buffered;
+        //parts of the current message
+        std::string partial;
+        //the current message exceeded maxMessageSize, its remaining parts are skipped
+        bool discard;
+    };
+
+}
+
+#endif //SOCKET_RELIABLECHANNEL_H
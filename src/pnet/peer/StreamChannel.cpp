@@ -0,0 +1,182 @@
+//
+// Copyright (c) 2020 Julian Hinxlage. All rights reserved.
+//
+
+#include "StreamChannel.h"
+#include <algorithm>
+
+namespace pnet {
+
+    static std::string encodeFrame(const StreamFrame &frame) {
+        std::string result(Schema<StreamFrame>::size(frame, WIRE_V2), '\0');
+        Schema<StreamFrame>::write(result.data(), frame, WIRE_V2);
+        return result;
+    }
+
+    StreamSender::StreamSender(uint32_t session, int minRtoMillis, int window)
+        : reliable(session, minRtoMillis) {
+        this->window = window;
+        nextStream = 1;
+    }
+
+    uint32_t StreamSender::open() {
+        uint32_t id = nextStream++;
+        streams[id].limit = window;
+        return id;
+    }
+
+    bool StreamSender::write(uint32_t stream, std::string_view data) {
+        auto entry = streams.find(stream);
+        if(entry == streams.end() || entry->second.closing){
+            return false;
+        }
+        entry->second.buffer.append(data);
+        markReady(stream, entry->second);
+        return true;
+    }
+
+    void StreamSender::close(uint32_t stream) {
+        auto entry = streams.find(stream);
+        if(entry != streams.end()){
+            entry->second.closing = true;
+            markReady(stream, entry->second);
+        }
+    }
+
+    void StreamSender::extend(uint32_t stream, uint64_t limit) {
+        auto entry = streams.find(stream);
+        if(entry != streams.end() && limit > entry->second.limit){
+            entry->second.limit = limit;
+            markReady(stream, entry->second);
+        }
+    }
+
+    void StreamSender::sendWindow(uint32_t stream, uint64_t limit) {
+        windowFrames.push_back(encodeFrame(StreamFrame{stream, limit, STREAM_WINDOW, std::string_view()}));
+    }
+
+    void StreamSender::schedule(int frameSize) {
+        int space = reliable.space();
+        for(; space > 0 && !windowFrames.empty(); space--){
+            reliable.push(windowFrames.front());
+            windowFrames.pop_front();
+        }
+        for(; space > 0 && !readyStreams.empty(); space--){
+            uint32_t id = readyStreams.front();
+            readyStreams.pop_front();
+            auto entry = streams.find(id);
+            Stream &stream = entry->second;
+            stream.ready = false;
+
+            size_t pending = stream.buffer.size() - stream.pushed;
+            size_t size = std::min<uint64_t>({pending, (uint64_t)frameSize, stream.limit - stream.offset});
+            bool fin = stream.closing && size == pending;
+            reliable.push(encodeFrame(StreamFrame{id, stream.offset, (uint8_t)(fin ? STREAM_FIN : 0),
+                std::string_view(stream.buffer).substr(stream.pushed, size)}));
+            stream.offset += size;
+            stream.pushed += size;
+            if(fin){
+                streams.erase(entry);
+                continue;
+            }
+            //drop the framed bytes once they are half of the buffer, so appending stays amortized constant
+            if(stream.pushed * 2 >= stream.buffer.size()){
+                stream.buffer.erase(0, stream.pushed);
+                stream.pushed = 0;
+            }
+            markReady(id, stream);
+        }
+    }
+
+    size_t StreamSender::queued(uint32_t stream) {
+        auto entry = streams.find(stream);
+        if(entry == streams.end()){
+            return 0;
+        }
+        return entry->second.buffer.size() - entry->second.pushed;
+    }
+
+    bool StreamSender::idle() {
+        return readyStreams.empty() && windowFrames.empty() && reliable.idle();
+    }
+
+    //a stream can send when it has bytes its window allows, or has to send the end of the stream
+    void StreamSender::markReady(uint32_t id, Stream &stream) {
+        bool pending = stream.buffer.size() > stream.pushed;
+        if(!stream.ready && ((pending && stream.offset < stream.limit) || (stream.closing && !pending))){
+            stream.ready = true;
+            readyStreams.push_back(id);
+        }
+    }
+
+    StreamReceiver::StreamReceiver(uint32_t session, int window) {
+        this->session = session;
+        this->window = window;
+        expected = 0;
+    }
+
+    bool StreamReceiver::accept(uint32_t sequence) {
+        if(sequence < expected || sequence - expected >= ReliableSender::maxWindow){
+            return false;
+        }
+        if(sequence != expected){
+            return received.insert(sequence).second;
+        }
+        expected++;
+        while(!received.empty() && *received.begin() == expected){
+            received.erase(received.begin());
+            expected++;
+        }
+        return true;
+    }
+
+    uint64_t StreamReceiver::receive(const StreamFrame &frame, std::vector<Delivery> &deliver) {
+        auto entry = streams.find(frame.stream);
+        if(entry == streams.end()){
+            entry = streams.emplace(frame.stream, Stream()).first;
+            entry->second.limit = window;
+        }
+        Stream &stream = entry->second;
+        bool fin = frame.flags & STREAM_FIN;
+        if(frame.offset != stream.offset){
+            //a frame before this one is missing, the sender keeps every frame within the window
+            if(frame.offset > stream.offset){
+                stream.buffered.emplace(frame.offset, std::make_pair(std::string(frame.data), fin));
+            }
+            return 0;
+        }
+
+        deliver.push_back({frame.stream, std::string(frame.data), fin});
+        stream.offset += frame.data.size();
+        while(!fin && !stream.buffered.empty() && stream.buffered.begin()->first == stream.offset){
+            auto &next = stream.buffered.begin()->second;
+            fin = next.second;
+            stream.offset += next.first.size();
+            deliver.push_back({frame.stream, std::move(next.first), fin});
+            stream.buffered.erase(stream.buffered.begin());
+        }
+        if(fin){
+            streams.erase(entry);
+            return 0;
+        }
+        //extend once half of the window was delivered, not with every frame
+        if(stream.limit - stream.offset < (uint64_t)window / 2){
+            stream.limit = stream.offset + window;
+            return stream.limit;
+        }
+        return 0;
+    }
+
+    uint64_t StreamReceiver::mask() {
+        uint64_t mask = 0;
+        for(uint32_t sequence : received){
+            uint32_t offset = sequence - expected - 1;
+            if(offset >= 64){
+                break;
+            }
+            mask |= 1ull << offset;
+        }
+        return mask;
+    }
+
+}
@@ -0,0 +1,110 @@
+//
+// Copyright (c) 2020 Julian Hinxlage. All rights reserved.
+//
+
+#ifndef SOCKET_STREAMCHANNEL_H
+#define SOCKET_STREAMCHANNEL_H
+
+#include "ReliableChannel.h"
+#include "PeerMessages.h"
+#include <string>
+#include <string_view>
+#include <deque>
+#include <map>
+#include <set>
+#include <unordered_map>
+#include <vector>
+#include <cstdint>
+
+namespace pnet {
+
+    //sending side of the byte streams to one peer. the frames of all streams are segments of one reliable session
+    //and share its congestion window. streams take turns for the window and each one is limited by its own
+    //flow control window, so a stream that is not read fast enough does not hold back the others
+    class StreamSender{
+    public:
+        //retransmissions and congestion control, segments are pushed as the window allows
+        ReliableSender reliable;
+
+        //window is the number of bytes a stream may send ahead of what its receiver delivered
+        StreamSender(uint32_t session = 0, int minRtoMillis = 200, int window = 256 * 1024);
+        //a stream id that is not used by this sender yet
+        uint32_t open();
+        //false if the stream is not open
+        bool write(uint32_t stream, std::string_view data);
+        //the stream ends after the bytes written so far
+        void close(uint32_t stream);
+        //the receiver delivered enough of a stream to allow bytes up to limit
+        void extend(uint32_t stream, uint64_t limit);
+        //window update for a stream of the opposite direction, sent before any stream bytes
+        void sendWindow(uint32_t stream, uint64_t limit);
+        //pushes as many frames as the reliable sender can send right away, data frames carry up to frameSize bytes
+        void schedule(int frameSize);
+        //bytes written to a stream that were not pushed yet
+        size_t queued(uint32_t stream);
+        bool idle();
+    private:
+        class Stream{
+        public:
+            //bytes from pushed on are not framed yet
+            std::string buffer;
+            size_t pushed = 0;
+            //stream position of the first byte not framed
+            uint64_t offset = 0;
+            uint64_t limit = 0;
+            bool closing = false;
+            //in readyStreams
+            bool ready = false;
+        };
+        int window;
+        uint32_t nextStream;
+        std::unordered_map<uint32_t, Stream> streams;
+        //streams that can send a frame, in turn order
+        std::deque<uint32_t> readyStreams;
+        std::deque<std::string> windowFrames;
+
+        void markReady(uint32_t id, Stream &stream);
+    };
+
+    //receiving side of the byte streams from one peer. segments are applied in the order they arrive
+    //and the bytes of each stream are put in order on their own
+    class StreamReceiver{
+    public:
+        class Delivery{
+        public:
+            uint32_t stream;
+            std::string data;
+            //the stream ends after data
+            bool fin;
+        };
+
+        uint32_t session;
+        //next sequence not received
+        uint32_t expected;
+
+        StreamReceiver(uint32_t session = 0, int window = 256 * 1024);
+        //false if the sequence was received before or is beyond the window of the sender
+        bool accept(uint32_t sequence);
+        //appends the bytes of the stream that are now in order to deliver,
+        //returns the new limit if the window of the stream has to be extended, 0 otherwise
+        uint64_t receive(const StreamFrame &frame, std::vector<Delivery> &deliver);
+        //bit i is set if expected + 1 + i was received
+        uint64_t mask();
+    private:
+        class Stream{
+        public:
+            //next byte to deliver
+            uint64_t offset = 0;
+            uint64_t limit = 0;
+            //frames after a missing one by offset, with their fin flag
+            std::map<uint64_t, std::pair<std::string, bool>> buffered;
+        };
+        int window;
+        std::unordered_map<uint32_t, Stream> streams;
+        //sequences after expected that were received
+        std::set<uint32_t> received;
+    };
+
+}
+
+#endif //SOCKET_STREAMCHANNEL_H
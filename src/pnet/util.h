@@ -6,6 +6,8 @@
 #define SOCKET_UTIL_H
 
 #include <sstream>
+#include <chrono>
+#include <cstdint>
 
 namespace pnet {
 
@@ -16,6 +18,16 @@ namespace pnet {
         return ss.str();
     }
 
+    //monotonic time for timeouts and round trip times
+    inline uint64_t steadyMicros(){
+        return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    //wall clock time, comparable across restarts
+    inline uint64_t unixMillis(){
+        return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+    }
+
 }
 
 #endif //SOCKET_UTIL_H
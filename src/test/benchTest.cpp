@@ -0,0 +1,972 @@
+//
+// Copyright (c) 2020 Julian Hinxlage. All rights reserved.
+//
+
+#include "pnet/peer/PeerMessages.h"
+#include "pnet/peer/PeerRoutingTable.h"
+#include "pnet/peer/NearestScan.h"
+#include "pnet/peer/BroadcastCache.h"
+#include "pnet/peer/KeyValueStore.h"
+#include "pnet/Compressor.h"
+#include "pnet/RcuPointer.h"
+#include "pnet/util.h"
+#include <iostream>
+#include <chrono>
+#include <functional>
+#include <map>
+#include <thread>
+#include <mutex>
+#include <shared_mutex>
+#include <atomic>
+#include <random>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+
+using namespace pnet;
+
+//prevent the compiler from removing benchmarked work
+template<typename T>
+void keep(const T &t){
+    asm volatile("" : : "g"(&t) : "memory");
+}
+
+//set by check, the program exits with 1 if a result was wrong
+bool failed = false;
+
+void check(bool ok, const std::string &what){
+    if(!ok){
+        std::cout << "FAILED: " << what << std::endl;
+        failed = true;
+    }
+}
+
+//runs the function in batches until a minimum time has passed and prints ns per iteration
+void bench(const std::string &name, const std::function<void()> &func, int batch = 1000){
+    auto start = std::chrono::steady_clock::now();
+    long iterations = 0;
+    double seconds = 0;
+    while(seconds < 0.2){
+        for(int i = 0; i < batch; i++){
+            func();
+        }
+        iterations += batch;
+        seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    }
+    std::cout << name << ": " << seconds * 1e9 / iterations << " ns" << std::endl;
+}
+
+void benchSchema(){
+    LookupReplyMessage lookupReply{PeerId(12345), 2000, "::1"};
+    RouteMessage route{PeerId(1), PeerId(2), 100};
+
+    Packet lookupReplyPacket;
+    Schema<LookupReplyMessage>::write(lookupReplyPacket, lookupReply);
+    Packet routePacket;
+    Schema<RouteMessage>::write(routePacket, route);
+
+    //the schema has to read what the hand written encoding wrote
+    {
+        Packet packet;
+        packet.add(lookupReply.id);
+        packet.add(lookupReply.port);
+        packet.addStr(lookupReply.address);
+        check(packet.size() == lookupReplyPacket.size() && std::memcmp(packet.data(), lookupReplyPacket.data(), packet.size()) == 0,
+            "LOOKUP_REPLY schema encode differs from hand encode");
+        LookupReplyMessage msg;
+        check(Schema<LookupReplyMessage>::read(packet, msg) && msg.id == lookupReply.id && msg.port == lookupReply.port
+            && msg.address == lookupReply.address, "LOOKUP_REPLY schema decode differs from hand encode");
+    }
+
+    bench("LOOKUP_REPLY hand decode", [&](){
+        lookupReplyPacket.offset = 0;
+        LookupReplyMessage msg;
+        msg.id = lookupReplyPacket.get<PeerId>();
+        msg.port = lookupReplyPacket.get<uint16_t>();
+        msg.address = lookupReplyPacket.getStr();
+        keep(msg);
+    });
+    bench("LOOKUP_REPLY schema decode", [&](){
+        lookupReplyPacket.offset = 0;
+        LookupReplyMessage msg;
+        Schema<LookupReplyMessage>::read(lookupReplyPacket, msg);
+        keep(msg);
+    });
+    bench("ROUTE hand decode", [&](){
+        routePacket.offset = 0;
+        RouteMessage msg;
+        msg.source = routePacket.get<PeerId>();
+        msg.destination = routePacket.get<PeerId>();
+        msg.payloadSize = routePacket.get<int>();
+        keep(msg);
+    });
+    bench("ROUTE schema decode", [&](){
+        routePacket.offset = 0;
+        RouteMessage msg;
+        Schema<RouteMessage>::read(routePacket, msg);
+        keep(msg);
+    });
+    bench("ROUTE hand encode", [&](){
+        Packet packet;
+        packet.add(route.source);
+        packet.add(route.destination);
+        packet.add(route.payloadSize);
+        keep(packet);
+    });
+    bench("ROUTE schema encode", [&](){
+        Packet packet;
+        Schema<RouteMessage>::write(packet, route);
+        keep(packet);
+    });
+}
+
+//encoded size of a message including its opcode
+template<typename T>
+int wireSize(const T &msg, WireFormat format){
+    int opcodeSize = format == WIRE_V2 ? 1 : sizeof(PeerOpcode);
+    return opcodeSize + Schema<T>::size(msg, format);
+}
+
+template<typename T>
+void printWireSize(const std::string &name, const T &msg){
+    //usable payload of a datagram on a 1500 byte MTU path
+    const int datagramSize = 1452;
+    int v1 = wireSize(msg, WIRE_V1);
+    //the WIRE_V2 marker is paid once per datagram
+    int v2 = wireSize(msg, WIRE_V2);
+    std::cout << name << ": " << v1 << " -> " << v2 << " bytes, "
+        << datagramSize / v1 << " -> " << (datagramSize - 1) / v2 << " per datagram" << std::endl;
+}
+
+//writes msg in both formats, it has to read back equal and every truncated prefix has to be rejected
+template<typename T, typename Equal>
+void checkRoundTrip(const std::string &name, const T &msg, const Equal &equal){
+    for(WireFormat format : {WIRE_V1, WIRE_V2}){
+        std::string label = str(name, format == WIRE_V2 ? " V2" : " V1");
+        Packet packet;
+        Schema<T>::write(packet, msg, format);
+        check(packet.size() == Schema<T>::size(msg, format), label + " size differs from the written bytes");
+        T result{};
+        const char *end = Schema<T>::read(packet.data(), packet.data() + packet.size(), result, format);
+        check(end == packet.data() + packet.size() && equal(msg, result), label + " does not read back equal");
+        for(int bytes = 0; bytes < packet.size(); bytes++){
+            T partial{};
+            if(Schema<T>::read(packet.data(), packet.data() + bytes, partial, format) != nullptr){
+                check(false, str(label, " read ", bytes, " of ", packet.size(), " bytes"));
+                break;
+            }
+        }
+    }
+}
+
+void checkWire(){
+    const uint64_t boundaries[] = {0, 1, 127, 128, 16383, 16384, 2097151, 2097152, UINT32_MAX, (uint64_t)UINT32_MAX + 1, INT64_MAX, UINT64_MAX};
+    auto putEqual = [](const PutMessage &a, const PutMessage &b){
+        return a.requestId == b.requestId && a.version == b.version && a.flags == b.flags && a.key == b.key && a.value == b.value;
+    };
+    //string lengths around the varint boundaries, WIRE_V1 strings can not contain NUL
+    std::string value(16384, 'v');
+    for(int length : {0, 1, 127, 128, 16383, 16384}){
+        for(uint64_t number : boundaries){
+            uint32_t requestId = (uint32_t)std::min<uint64_t>(number, UINT32_MAX);
+            checkRoundTrip(str("PUT ", number, " ", length), PutMessage{requestId, number, STORE_REPLICA, "key",
+                std::string_view(value.data(), length)}, putEqual);
+        }
+    }
+    for(int size : {INT32_MIN, -65, -64, -1, 0, 63, 64, 8191, 8192, INT32_MAX}){
+        checkRoundTrip(str("ROUTE ", size), RouteMessage{PeerId(1), ~PeerId(0), size}, [](const RouteMessage &a, const RouteMessage &b){
+            return a.source == b.source && a.destination == b.destination && a.payloadSize == b.payloadSize;
+        });
+    }
+    for(uint16_t port : {0, 127, 128, 65535}){
+        checkRoundTrip(str("LOOKUP_REPLY ", port), LookupReplyMessage{PeerId(12345), port, "2001:db8::1"},
+            [](const LookupReplyMessage &a, const LookupReplyMessage &b){
+                return a.id == b.id && a.port == b.port && a.address == b.address;
+            });
+    }
+
+    //varints that do not fit the field or 64 bits are malformed
+    Packet packet;
+    Schema<PutMessage>::write(packet, PutMessage{0, 0, 0, "key", "value"}, WIRE_V2);
+    std::string wide(packet.data(), packet.size());
+    char varint[10];
+    wide.replace(0, 1, varint, writeVarint(varint, (uint64_t)UINT32_MAX + 1) - varint);
+    PutMessage msg;
+    check(Schema<PutMessage>::read(wide.data(), wide.data() + wide.size(), msg, WIRE_V2) == nullptr, "PUT V2 read a 33 bit request id");
+    std::string overlong = std::string(10, (char)0x80) + std::string(1, 1) + std::string(packet.data() + 1, packet.size() - 1);
+    check(Schema<PutMessage>::read(overlong.data(), overlong.data() + overlong.size(), msg, WIRE_V2) == nullptr, "PUT V2 read an 11 byte varint");
+}
+
+void benchWire(){
+    checkWire();
+    printWireSize("PONG", PongMessage());
+    printWireSize("HANDSHAKE", HandshakeMessage{PeerId(1)});
+    printWireSize("LOOKUP", LookupMessage{PeerId(1)});
+    printWireSize("LOOKUP_REPLY", LookupReplyMessage{PeerId(1), 2000, "::1"});
+    printWireSize("ROUTE header", RouteMessage{PeerId(1), PeerId(2), 100});
+    printWireSize("MESSAGE 16 bytes", DataMessage{std::string(16, 'x')});
+    printWireSize("BROADCAST 64 bytes", BroadcastMessage{PeerId(1), Blob<32>(), std::string(64, 'x')});
+}
+
+//repetitive JSON status messages as they are broadcast by applications
+std::vector<std::string> jsonSamples(int count){
+    std::vector<std::string> samples;
+    for(int i = 0; i < count; i++){
+        samples.push_back(str("{\"type\":\"status\",\"node\":\"node-", i * 7919 % 1000,
+            "\",\"position\":{\"x\":", i * 31 % 997, ",\"y\":", i * 17 % 991,
+            "},\"load\":0.", i % 100, ",\"services\":[\"storage\",\"relay\",\"discovery\"],\"state\":\"active\"}"));
+    }
+    return samples;
+}
+
+//every message has to decompress to itself, truncated data and data for a different dictionary must be rejected
+void checkCompression(const std::string &name, const Compressor &compressor, const std::vector<std::string> &messages){
+    Compressor other;
+    other.setDictionary(compressor.dictionaryId() == 0 ? "a different dictionary of the other compressor" : "");
+    int compressible = 0;
+    int roundTrips = 0;
+    int truncated = 0;
+    for(auto &msg : messages){
+        std::string compressed;
+        std::string output;
+        if(!compressor.compress(msg.data(), msg.size(), compressed)){
+            continue;
+        }
+        compressible++;
+        if(compressor.decompress(compressed.data(), compressed.size(), output) && output == msg){
+            roundTrips++;
+        }
+        for(int bytes = 0; bytes < compressed.size(); bytes++){
+            if(compressor.decompress(compressed.data(), bytes, output)){
+                truncated++;
+            }
+        }
+        check(!other.decompress(compressed.data(), compressed.size(), output), name + " decompressed with another dictionary");
+    }
+    check(roundTrips == compressible, str(name, " ", roundTrips, "/", compressible, " messages decompressed to the input"));
+    check(truncated == 0, str(name, " accepted ", truncated, " truncated messages"));
+}
+
+//a payload that decompresses to more than maxSize bytes is rejected before the output is allocated
+void checkCompressionBomb(){
+    Compressor large;
+    large.maxSize = 64 * 1024 * 1024;
+    Compressor plain;
+    std::string bomb(16 * 1024 * 1024, 'x');
+    std::string compressed;
+    std::string output;
+    check(large.compress(bomb.data(), bomb.size(), compressed), "bomb not compressed");
+    check(large.decompress(compressed.data(), compressed.size(), output) && output == bomb, "bomb not decompressed below maxSize");
+    std::string rejected;
+    check(!plain.decompress(compressed.data(), compressed.size(), rejected), "bomb decompressed above maxSize");
+    check(rejected.capacity() < plain.maxSize, "bomb output allocated");
+    std::cout << "compression bomb: " << bomb.size() << " bytes in " << compressed.size() << " rejected" << std::endl;
+
+    //exactly at and one byte above maxSize
+    std::string limit(plain.maxSize, 'y');
+    check(plain.compress(limit.data(), limit.size(), compressed), "maxSize message not compressed");
+    check(plain.decompress(compressed.data(), compressed.size(), output) && output == limit, "maxSize message not decompressed");
+    limit.push_back('y');
+    check(plain.compress(limit.data(), limit.size(), compressed), "oversized message not compressed");
+    check(!plain.decompress(compressed.data(), compressed.size(), output), "oversized message decompressed");
+}
+
+void benchCompressionCase(const std::string &name, const Compressor &compressor, const std::vector<std::string> &messages){
+    checkCompression(name, compressor, messages);
+    long raw = 0;
+    long wire = 0;
+    for(auto &msg : messages){
+        std::string compressed;
+        raw += msg.size();
+        wire += compressor.compress(msg.data(), msg.size(), compressed) ? compressed.size() : msg.size();
+    }
+    std::cout << name << ": " << raw << " -> " << wire << " bytes (" << 100.0 * wire / raw << "%)" << std::endl;
+
+    int index = 0;
+    std::string output;
+    bench(name + " compress", [&](){
+        auto &msg = messages[index++ % messages.size()];
+        compressor.compress(msg.data(), msg.size(), output);
+        keep(output);
+    }, 100);
+    std::vector<std::string> compressed;
+    for(auto &msg : messages){
+        if(compressor.compress(msg.data(), msg.size(), output)){
+            compressed.push_back(output);
+        }
+    }
+    if(compressed.empty()){
+        return;
+    }
+    bench(name + " decompress", [&](){
+        auto &msg = compressed[index++ % compressed.size()];
+        compressor.decompress(msg.data(), msg.size(), output);
+        keep(output);
+    }, 100);
+}
+
+void benchCompression(){
+    std::vector<std::string> samples = jsonSamples(1000);
+    std::vector<std::string> messages(samples.begin() + 500, samples.end());
+    samples.resize(500);
+
+    //single messages and the batches applications broadcast
+    std::vector<std::string> batches;
+    for(int i = 0; i + 8 <= messages.size(); i += 8){
+        std::string batch = "[";
+        for(int j = i; j < i + 8; j++){
+            batch += messages[j] + (j + 1 < i + 8 ? "," : "]");
+        }
+        batches.push_back(batch);
+    }
+
+    Compressor plain;
+    Compressor trained;
+    trained.setDictionary(Compressor::train(samples, 2048));
+
+    benchCompressionCase("json", plain, messages);
+    benchCompressionCase("json dictionary", trained, messages);
+    benchCompressionCase("json batch", plain, batches);
+    benchCompressionCase("json batch dictionary", trained, batches);
+    checkCompressionBomb();
+}
+
+//the previous byte wise blob operations, kept as baseline
+namespace byteBlob {
+    PeerId xorBytes(const PeerId &a, const PeerId &b){
+        PeerId result;
+        for(int i = 0; i < sizeof(PeerId); i++){
+            result.data[i] = a.data[i] ^ b.data[i];
+        }
+        return result;
+    }
+
+    bool less(const PeerId &a, const PeerId &b){
+        for(int i = sizeof(PeerId) - 1; i >= 0; i--){
+            if(a.data[i] < b.data[i]){
+                return true;
+            }else if(a.data[i] > b.data[i]){
+                return false;
+            }
+        }
+        return false;
+    }
+
+    PeerId shiftRight(const PeerId &a){
+        PeerId result;
+        for(int i = 0; i < sizeof(PeerId); i++){
+            result.data[i] = a.data[i] >> 1;
+            if(i + 1 < sizeof(PeerId)){
+                result.data[i] |= a.data[i + 1] << 7;
+            }
+        }
+        return result;
+    }
+
+    int level(const PeerId &a, const PeerId &b){
+        PeerId dist = xorBytes(a, b);
+        int level = -1;
+        while(less(PeerId(0), dist)){
+            dist = shiftRight(dist);
+            level++;
+        }
+        return level;
+    }
+}
+
+std::vector<PeerId> randomIds(int count){
+    std::vector<PeerId> ids(count);
+    uint64_t state = 88172645463325252ull;
+    for(auto &id : ids){
+        for(int i = 0; i < sizeof(PeerId); i++){
+            state ^= state << 13;
+            state ^= state >> 7;
+            state ^= state << 17;
+            id.data[i] = state & 0xff;
+        }
+    }
+    return ids;
+}
+
+void benchBlob(){
+    static_assert((PeerId(1) << 100).highestBit() == 100, "Blob is usable in constant expressions");
+
+    std::vector<PeerId> ids = randomIds(1024);
+    PeerId target = ids[0];
+    int index = 0;
+
+    bench("xor distance compare bytes", [&](){
+        const PeerId &a = ids[index++ & 1023];
+        const PeerId &b = ids[index & 1023];
+        bool result = byteBlob::less(byteBlob::xorBytes(a, target), byteBlob::xorBytes(b, target));
+        keep(result);
+    });
+    bench("xor distance compare words", [&](){
+        const PeerId &a = ids[index++ & 1023];
+        const PeerId &b = ids[index & 1023];
+        bool result = (a ^ target) < (b ^ target);
+        keep(result);
+    });
+    //close peers share a long prefix with the target, byte wise compares can not stop early
+    std::vector<PeerId> nearIds = ids;
+    for(auto &id : nearIds){
+        for(int i = 4; i < sizeof(PeerId); i++){
+            id.data[i] = target.data[i];
+        }
+    }
+    bench("xor distance compare bytes, shared prefix", [&](){
+        const PeerId &a = nearIds[index++ & 1023];
+        const PeerId &b = nearIds[index & 1023];
+        bool result = byteBlob::less(byteBlob::xorBytes(a, target), byteBlob::xorBytes(b, target));
+        keep(result);
+    });
+    bench("xor distance compare words, shared prefix", [&](){
+        const PeerId &a = nearIds[index++ & 1023];
+        const PeerId &b = nearIds[index & 1023];
+        bool result = (a ^ target) < (b ^ target);
+        keep(result);
+    });
+    bench("level shift loop", [&](){
+        int result = byteBlob::level(ids[index++ & 1023], target);
+        keep(result);
+    });
+    bench("level highest bit", [&](){
+        int result = (ids[index++ & 1023] ^ target).highestBit();
+        keep(result);
+    });
+}
+
+//previous routing: linear scan over all known contacts
+int flatNext(const std::vector<PeerId> &ids, const PeerId &target){
+    int minIndex = -1;
+    PeerId minDistance;
+    for(int i = 0; i < ids.size(); i++){
+        PeerId distance = ids[i] ^ target;
+        if(minIndex == -1 || distance < minDistance){
+            minDistance = distance;
+            minIndex = i;
+        }
+    }
+    return minIndex;
+}
+
+void benchRouting(){
+    for(int count : {100, 10000, 1000000}){
+        std::vector<PeerId> ids = randomIds(count + 1024);
+        std::vector<PeerId> targets(ids.begin() + count, ids.end());
+        ids.resize(count);
+        int index = 0;
+
+        bench(str("flat getNext ", count, " contacts"), [&](){
+            int result = flatNext(ids, targets[index++ & 1023]);
+            keep(result);
+        }, count > 10000 ? 1 : 100);
+
+        PeerRoutingTable table;
+        table.localPeer().id = targets[1023];
+        auto start = std::chrono::steady_clock::now();
+        for(auto &id : ids){
+            table.add(id, Endpoint());
+        }
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        std::cout << "bucket add " << count << " contacts: " << seconds * 1e9 / count << " ns, "
+            << table.peers.size() - 1 << " peers in buckets" << std::endl;
+
+        bench(str("bucket getNext ", count, " contacts"), [&](){
+            auto &result = table.getNextUncached(targets[index++ & 1023], table.localPeer().id);
+            keep(result);
+        });
+        bench(str("bucket getClosest(20) ", count, " contacts"), [&](){
+            auto result = table.getClosest(targets[index++ & 1023], 20);
+            keep(result);
+        }, 100);
+    }
+}
+
+//previous bucket scan: ids read from the peers next to their endpoints
+int peerNext(const std::vector<Peer> &peers, const PeerId &target){
+    int minIndex = -1;
+    PeerId minDistance;
+    for(int i = 0; i < peers.size(); i++){
+        PeerId distance = peers[i].id ^ target;
+        if(minIndex == -1 || distance < minDistance){
+            minDistance = distance;
+            minIndex = i;
+        }
+    }
+    return minIndex;
+}
+
+void benchNearestCase(const std::string &name, NearestScan scan, const std::vector<uint64_t> &high,
+        const std::vector<uint64_t> &low, const std::vector<PeerId> &targets){
+    for(auto &target : targets){
+        int expected = nearestScalar(high.data(), low.data(), high.size(), target.word(1), target.word(0), 0, 0);
+        int result = scan(high.data(), low.data(), high.size(), target.word(1), target.word(0), 0, 0);
+        if(result != expected){
+            check(false, str(name, " ", high.size(), " ids: index ", result, " instead of ", expected));
+            break;
+        }
+    }
+    int index = 0;
+    auto start = std::chrono::steady_clock::now();
+    long comparisons = 0;
+    while(std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count() < 0.2){
+        for(int i = 0; i < 100; i++){
+            const PeerId &target = targets[index++ & 1023];
+            int result = scan(high.data(), low.data(), high.size(), target.word(1), target.word(0), 0, 0);
+            keep(result);
+        }
+        comparisons += 100 * high.size();
+    }
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    std::cout << name << " " << high.size() << " ids: " << comparisons / seconds / 1e6 << " M comparisons/s, "
+        << seconds * 1e9 / (comparisons / high.size()) << " ns" << std::endl;
+}
+
+//compares a scan with nearestScalar on sizes around the vector widths, duplicate ids, targets equal to an id,
+//high distance words of all ones and the except id
+void checkNearest(const std::string &name, NearestScan scan){
+    std::vector<PeerId> pool = randomIds(64);
+    //same high word, only the low words decide
+    for(int i = 0; i < 8; i++){
+        pool[i].setWord(1, pool[8].word(1));
+    }
+    uint64_t state = 2463534242ull;
+    auto next = [&](){
+        state ^= state << 13;
+        state ^= state >> 7;
+        state ^= state << 17;
+        return state;
+    };
+    int mismatches = 0;
+    for(int count = 0; count <= 40; count++){
+        for(int round = 0; round < 200; round++){
+            std::vector<uint64_t> high;
+            std::vector<uint64_t> low;
+            for(int i = 0; i < count; i++){
+                //drawn from a small pool so ids repeat and distances tie
+                const PeerId &id = pool[next() % (round % 2 ? 8 : pool.size())];
+                high.push_back(id.word(1));
+                low.push_back(id.word(0));
+            }
+            PeerId target = pool[next() % pool.size()];
+            if(round % 4 == 3){
+                target = ~target;
+            }
+            PeerId except = count > 0 && round % 3 != 0 ? PeerId(pool[next() % pool.size()]) : PeerId(0);
+            if(count > 0 && round % 5 == 0){
+                int i = next() % count;
+                except.setWord(1, high[i]);
+                except.setWord(0, low[i]);
+            }
+            int expected = nearestScalar(high.data(), low.data(), count, target.word(1), target.word(0), except.word(1), except.word(0));
+            int result = scan(high.data(), low.data(), count, target.word(1), target.word(0), except.word(1), except.word(0));
+            if(result != expected){
+                mismatches++;
+            }
+        }
+    }
+    check(mismatches == 0, str(name, " differs from scalar in ", mismatches, " cases"));
+}
+
+void benchNearest(){
+    std::cout << "nearest scan: " << nearestScanName() << std::endl;
+#if defined(__x86_64__) || defined(__i386__)
+    if(__builtin_cpu_supports("sse4.2")){
+        checkNearest("sse4.2", nearestSse42);
+    }
+    if(__builtin_cpu_supports("avx2")){
+        checkNearest("avx2", nearestAvx2);
+    }
+#endif
+    for(int count : {1000, 10000}){
+        std::vector<PeerId> ids = randomIds(count + 1024);
+        std::vector<PeerId> targets(ids.begin() + count, ids.end());
+        ids.resize(count);
+
+        std::vector<Peer> peers;
+        std::vector<uint64_t> high;
+        std::vector<uint64_t> low;
+        for(auto &id : ids){
+            peers.push_back({id, Endpoint("::1", 2000)});
+            high.push_back(id.word(1));
+            low.push_back(id.word(0));
+        }
+
+        int index = 0;
+        bench(str("peer scan ", count, " ids"), [&](){
+            int result = peerNext(peers, targets[index++ & 1023]);
+            keep(result);
+        }, 100);
+        benchNearestCase("scalar", nearestScalar, high, low, targets);
+#if defined(__x86_64__) || defined(__i386__)
+        if(__builtin_cpu_supports("sse4.2")){
+            benchNearestCase("sse4.2", nearestSse42, high, low, targets);
+        }
+        if(__builtin_cpu_supports("avx2")){
+            benchNearestCase("avx2", nearestAvx2, high, low, targets);
+        }
+#endif
+
+        //a single bucket large enough for all peers, getNext scans the closest non empty bucket
+        PeerRoutingTable table;
+        table.bucketSize = count;
+        table.localPeer().id = targets[1023];
+        for(auto &id : ids){
+            table.add(id, Endpoint());
+        }
+        bench(str("getNext ", count, " peers, bucket size ", count), [&](){
+            auto &result = table.getNextUncached(targets[index++ & 1023], table.localPeer().id);
+            keep(result);
+        }, 100);
+    }
+}
+
+void benchSourceLookup(){
+    for(int count : {20, 200, 2000}){
+        PeerRoutingTable table;
+        table.bucketSize = count;
+        std::vector<PeerId> ids = randomIds(count);
+        std::vector<Endpoint> endpoints;
+        for(int i = 0; i < count; i++){
+            endpoints.emplace_back("::1", 10000 + i);
+            table.add(ids[i], endpoints.back());
+        }
+        int index = 0;
+
+        //previous per datagram attribution: has(ep) and get(ep) scans and a copy of the peer
+        bench(str("source lookup scan ", count, " peers"), [&](){
+            const Endpoint &ep = endpoints[index++ % count];
+            Peer hop;
+            bool found = false;
+            for(auto &peer : table.peers){
+                if(peer.ep == ep){
+                    found = true;
+                    break;
+                }
+            }
+            if(found){
+                for(auto &peer : table.peers){
+                    if(peer.ep == ep){
+                        hop = peer;
+                        break;
+                    }
+                }
+            }
+            keep(hop);
+        }, 100);
+        bench(str("source lookup index ", count, " peers"), [&](){
+            const Peer *hop = table.find(endpoints[index++ % count]);
+            keep(hop);
+        });
+    }
+}
+
+//an hour of 1M broadcasts, one every 3.6 ms, each id arrives once more 10 seconds later
+void benchDedup(){
+    const int count = 1000000;
+    //micro seconds between broadcasts
+    const uint64_t interval = 3600000 / count * 1000;
+    std::vector<Blob<32>> ids(count);
+    uint64_t state = 88172645463325252ull;
+    for(auto &id : ids){
+        for(int i = 0; i < 4; i++){
+            state ^= state << 13;
+            state ^= state >> 7;
+            state ^= state << 17;
+            id.setWord(i, state);
+        }
+    }
+    //the duplicate of broadcast i - lag arrives with broadcast i
+    const int lag = 10000000 / interval;
+
+    {
+        std::map<Blob<32>, bool> map;
+        int duplicates = 0;
+        auto start = std::chrono::steady_clock::now();
+        for(int i = 0; i < count; i++){
+            if(map.find(ids[i]) == map.end()){
+                map[ids[i]] = true;
+            }
+            if(i >= lag && map.find(ids[i - lag]) != map.end()){
+                duplicates++;
+            }
+        }
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        //red black tree node: three pointers and the color next to the value, plus the allocator header
+        long memory = (long)map.size() * (4 * sizeof(void*) + sizeof(std::pair<const Blob<32>, bool>) + 16);
+        std::cout << "dedup std::map: " << seconds * 1e9 / (2 * count) << " ns per check, about "
+            << memory / (1024 * 1024) << " MiB after an hour, " << duplicates << "/" << count - lag << " duplicates caught" << std::endl;
+    }
+    {
+        BroadcastCache cache;
+        cache.reset(16384, 30000);
+        int duplicates = 0;
+        auto start = std::chrono::steady_clock::now();
+        for(int i = 0; i < count; i++){
+            uint64_t now = i * interval / 1000;
+            cache.insert(ids[i], now);
+            if(i >= lag && !cache.insert(ids[i - lag], now)){
+                duplicates++;
+            }
+        }
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        std::cout << "dedup BroadcastCache: " << seconds * 1e9 / (2 * count) << " ns per check, "
+            << cache.memoryUsage() / 1024 << " KiB fixed, " << duplicates << "/" << count - lag << " duplicates caught" << std::endl;
+    }
+}
+
+//getNext from several threads while a writer changes the table every millisecond:
+//published copies read without locks against one table behind a shared or exclusive lock
+void benchSnapshot(){
+    std::vector<PeerId> ids = randomIds(1024 + 1024);
+    std::vector<PeerId> targets(ids.begin() + 1024, ids.end());
+    ids.resize(1024);
+    PeerRoutingTable table;
+    table.localPeer().id = targets[1023];
+    for(auto &id : ids){
+        table.add(id, Endpoint());
+    }
+    std::cout << "table of " << table.peers.size() - 1 << " peers" << std::endl;
+    bench("publish table copy", [&](){
+        auto copy = std::make_unique<PeerRoutingTable>(table);
+        keep(copy);
+    }, 10);
+
+    RcuPointer<PeerRoutingTable> published;
+    published.publish(std::make_unique<PeerRoutingTable>(table));
+    std::shared_mutex sharedMutex;
+    std::mutex exclusiveMutex;
+    const int reads = 1000000;
+
+    const char *names[] = {"RcuPointer", "shared_mutex", "mutex"};
+    for(int mode = 0; mode < 3; mode++){
+        for(int threads : {1, 2, 4}){
+            std::atomic<bool> running(true);
+            int writes = 0;
+            std::thread writer([&](){
+                while(running){
+                    if(mode == 0){
+                        published.publish(std::make_unique<PeerRoutingTable>(table));
+                    }else if(mode == 1){
+                        std::unique_lock<std::shared_mutex> lock(sharedMutex);
+                        table.addRttSample(ids[writes & 1023], 1000);
+                    }else{
+                        std::lock_guard<std::mutex> lock(exclusiveMutex);
+                        table.addRttSample(ids[writes & 1023], 1000);
+                    }
+                    writes++;
+                    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+                }
+            });
+            auto start = std::chrono::steady_clock::now();
+            std::vector<std::thread> readers;
+            for(int t = 0; t < threads; t++){
+                readers.emplace_back([&, t](){
+                    for(int i = 0; i < reads / threads; i++){
+                        const PeerId &target = targets[(i + t) & 1023];
+                        if(mode == 0){
+                            auto guard = published.read();
+                            keep(guard->getNextUncached(target).id);
+                        }else if(mode == 1){
+                            std::shared_lock<std::shared_mutex> lock(sharedMutex);
+                            keep(table.getNextUncached(target).id);
+                        }else{
+                            std::lock_guard<std::mutex> lock(exclusiveMutex);
+                            keep(table.getNextUncached(target).id);
+                        }
+                    }
+                });
+            }
+            for(auto &reader : readers){
+                reader.join();
+            }
+            double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+            running = false;
+            writer.join();
+            std::cout << names[mode] << " getNext, " << threads << " reader threads: " << seconds * 1e9 / reads
+                << " ns per read, " << writes << " writes" << std::endl;
+        }
+    }
+}
+
+//compares getNext with getNextUncached while peers are added, removed, pinned and measured,
+//on the table with its own cache and on copies of it with a cache of the reader as for published snapshots
+void checkNextHop(){
+    std::vector<PeerId> ids = randomIds(400);
+    std::vector<PeerId> destinations = randomIds(200);
+    std::mt19937_64 random(2);
+    PeerRoutingTable table;
+    table.localPeer().id = ids.back();
+    table.bucketSize = 4;
+    table.replacementSize = 2;
+    table.nextHops = NextHopCache(64);
+    PeerRoutingTable snapshot = table;
+    NextHopCache readerCache(64);
+    int mismatches = 0;
+    for(int round = 0; round < 200000; round++){
+        const PeerId &id = ids[random() % (ids.size() - 1)];
+        switch(random() % 16){
+            case 0: table.add(id, Endpoint()); break;
+            case 1: table.remove(id); break;
+            case 2: table.addRttSample(id, 1 + random() % 1000); break;
+            case 3: random() % 2 ? (void)table.pin({id, Endpoint()}) : (void)table.unpin(id); break;
+            case 4: snapshot = table; break;
+            default: break;
+        }
+        const PeerId &destination = random() % 4 ? destinations[random() % destinations.size()] : id;
+        PeerId except = random() % 2 ? table.peers[random() % table.peers.size()].id : PeerId(0);
+        if(table.getNext(destination, except).id != table.getNextUncached(destination, except).id){
+            mismatches++;
+        }
+        if(snapshot.getNext(destination, except, readerCache).id != snapshot.getNextUncached(destination, except).id){
+            mismatches++;
+        }
+    }
+    check(mismatches == 0, str("cached next hops differ from getNextUncached in ", mismatches, " cases"));
+}
+
+//destinations drawn from a Zipf distribution over 100k ids, as many consecutive messages go to a few popular peers,
+//with and without a peer replaced every 1000 lookups
+void benchNextHop(){
+    std::vector<PeerId> ids = randomIds(10000 + 100000);
+    std::vector<PeerId> destinations(ids.begin() + 10000, ids.end());
+    ids.resize(10000);
+    std::vector<double> cumulative(destinations.size());
+    double sum = 0;
+    for(int i = 0; i < destinations.size(); i++){
+        sum += 1.0 / (i + 1);
+        cumulative[i] = sum;
+    }
+    std::mt19937_64 random(1);
+    std::vector<int> workload(1 << 20);
+    for(int &index : workload){
+        double value = std::uniform_real_distribution<double>(0, sum)(random);
+        index = std::lower_bound(cumulative.begin(), cumulative.end(), value) - cumulative.begin();
+    }
+
+    for(bool churn : {false, true}){
+        for(int capacity : {0, 1024, 16384}){
+            PeerRoutingTable table;
+            table.localPeer().id = destinations.back();
+            table.nextHops = NextHopCache(capacity);
+            for(int i = 0; i < ids.size() / 2; i++){
+                table.add(ids[i], Endpoint());
+            }
+            int lookups = 0;
+            int added = ids.size() / 2;
+            auto start = std::chrono::steady_clock::now();
+            for(int index : workload){
+                const PeerId &destination = destinations[index];
+                auto &result = capacity == 0 ? table.getNextUncached(destination) : table.getNext(destination);
+                keep(result);
+                if(churn && ++lookups % 1000 == 0){
+                    table.remove(table.peers[1 + random() % (table.peers.size() - 1)].id);
+                    table.add(ids[added++ % ids.size()], Endpoint());
+                }
+            }
+            double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+            auto &stats = table.nextHops.stats();
+            std::cout << "getNext zipf, " << (churn ? "churn, " : "") << (capacity == 0 ? str("uncached") : str("cache ", capacity))
+                << ": " << seconds * 1e9 / workload.size() << " ns";
+            if(capacity > 0){
+                std::cout << ", hit rate " << 100.0 * stats.hits / (stats.hits + stats.misses) << "%, "
+                    << stats.invalidations << " entries invalidated";
+            }
+            std::cout << std::endl;
+        }
+    }
+}
+
+//local storage of the replicated store: writes in memory and with the log, replay of the log,
+//and rewrites of the same keys that make the log compact itself
+void benchStore(){
+    const int keys = 200000;
+    const std::string path = "/tmp/pnet-bench.store";
+    std::string value(100, 'v');
+    std::vector<std::string> names;
+    for(int i = 0; i < keys; i++){
+        names.push_back(str("key", i));
+    }
+    for(bool logged : {false, true}){
+        std::remove(path.c_str());
+        KeyValueStore store;
+        if(logged){
+            Error error = store.open(path);
+            if(error){
+                std::cout << "open failed: " << error.message << std::endl;
+                return;
+            }
+        }
+        auto start = std::chrono::steady_clock::now();
+        for(int i = 0; i < keys; i++){
+            store.apply(names[i], value, 1, false);
+        }
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        std::cout << "store apply " << (logged ? "logged" : "in memory") << ": " << seconds * 1e9 / keys << " ns, log "
+            << store.logSize() / 1024 << " KiB" << std::endl;
+        int version = 1;
+        bench(str("store find ", logged ? "logged" : "in memory"), [&](){
+            keep(store.find(names[version++ % keys]));
+        });
+    }
+
+    KeyValueStore store;
+    auto start = std::chrono::steady_clock::now();
+    store.open(path);
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    std::cout << "store replay of " << store.records.size() << " records: " << seconds * 1000 << " ms" << std::endl;
+
+    //the same keys again until the log is mostly replaced records
+    start = std::chrono::steady_clock::now();
+    for(int round = 2; round < 6; round++){
+        for(int i = 0; i < keys; i++){
+            store.apply(names[i], value, round, false);
+        }
+    }
+    seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    std::cout << "store overwrite logged: " << seconds * 1e9 / (4 * keys) << " ns, log " << store.logSize() / 1024 << " KiB" << std::endl;
+    store.close();
+    std::remove(path.c_str());
+}
+
+int main(int argc, char *argv[]){
+    std::string filter = argc > 1 ? argv[1] : "";
+
+    if(filter.empty() || filter == "blob"){
+        benchBlob();
+    }
+    if(filter.empty() || filter == "routing"){
+        benchRouting();
+    }
+    if(filter.empty() || filter == "nearest"){
+        benchNearest();
+    }
+    if(filter.empty() || filter == "source"){
+        benchSourceLookup();
+    }
+    if(filter.empty() || filter == "schema"){
+        benchSchema();
+    }
+    if(filter.empty() || filter == "wire"){
+        benchWire();
+    }
+    if(filter.empty() || filter == "compression"){
+        benchCompression();
+    }
+    if(filter.empty() || filter == "dedup"){
+        benchDedup();
+    }
+    if(filter.empty() || filter == "nexthop"){
+        checkNextHop();
+        benchNextHop();
+    }
+    if(filter.empty() || filter == "snapshot"){
+        benchSnapshot();
+    }
+    if(filter.empty() || filter == "store"){
+        benchStore();
+    }
+
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,1359 @@
+//
+// Copyright (c) 2020 Julian Hinxlage. All rights reserved.
+//
+
+#include "pnet/peer/PeerNetwork.h"
+#include "pnet/util.h"
+#include <iostream>
+#include <chrono>
+#include <atomic>
+#include <cstdio>
+#include <mutex>
+#include <algorithm>
+#include <ctime>
+
+using namespace pnet;
+
+//local cluster of peer networks on consecutive ports, node 0 is the entry node
+class Cluster{
+public:
+    std::vector<std::shared_ptr<PeerNetwork>> nodes;
+    std::vector<std::atomic<int>> received;
+    uint16_t basePort;
+    bool snapshots;
+    //called for every node before it starts
+    std::function<void(PeerNetwork &node, int index)> configure;
+    std::function<void(int index, const PeerId &id, const std::string &msg)> onMessage;
+
+    Cluster(int count, uint16_t basePort = 4000, bool snapshots = false)
+        : nodes(count), received(count), basePort(basePort), snapshots(snapshots) {}
+
+    ~Cluster(){
+        for(int i = 0; i < nodes.size(); i++){
+            stop(i);
+            std::remove(snapshotPath(i).c_str());
+        }
+    }
+
+    std::string snapshotPath(int index){
+        return str("/tmp/pnet-cluster-", basePort + index, ".snapshot");
+    }
+
+    Error start(int index){
+        auto node = std::make_shared<PeerNetwork>();
+        node->msgCallback = [this, index](const PeerId &id, const std::string &msg){
+            received[index]++;
+            if(onMessage){
+                onMessage(index, id, msg);
+            }
+        };
+        if(snapshots){
+            node->snapshotPath = snapshotPath(index);
+            node->snapshotInterval = 200;
+        }
+        node->addEntryNode(Endpoint("::1", basePort));
+        if(configure){
+            configure(*node, index);
+        }
+        Error error = node->start(basePort + index, "::1");
+        if(error){
+            return error;
+        }
+        nodes[index] = node;
+        return Error();
+    }
+
+    void stop(int index){
+        if(nodes[index]){
+            nodes[index]->stop();
+            nodes[index]->waitForStop();
+            nodes[index] = nullptr;
+        }
+    }
+
+    uint64_t sentDatagrams(){
+        uint64_t sum = 0;
+        for(auto &node : nodes){
+            sum += node ? node->sentDatagrams.load() : 0;
+        }
+        return sum;
+    }
+
+    uint64_t sentBytes(){
+        uint64_t sum = 0;
+        for(auto &node : nodes){
+            sum += node ? node->sentBytes.load() : 0;
+        }
+        return sum;
+    }
+
+    Error startAll(){
+        for(int i = 0; i < nodes.size(); i++){
+            Error error = start(i);
+            if(error){
+                return error;
+            }
+            if(i > 0){
+                nodes[i]->join();
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        }
+        return Error();
+    }
+};
+
+//set by a scenario that could not run or delivered less than expected, the program exits with 1
+bool failed = false;
+
+void fail(const std::string &what){
+    std::cout << "FAILED: " << what << std::endl;
+    failed = true;
+}
+
+//at least the share minimum of expected has to arrive
+void expect(const std::string &what, double actual, double expected, double minimum = 1.0){
+    if(actual < expected * minimum){
+        fail(str(what, ": ", actual, "/", expected, ", at least ", minimum * 100, "% expected"));
+    }
+}
+
+double seconds(std::chrono::steady_clock::time_point start){
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+//time from start() of a restarted node until a message sent by it arrives at a far node
+void restartCase(int count, bool snapshots){
+    Cluster cluster(count, 4000, snapshots);
+    Error error = cluster.startAll();
+    if(error){
+        fail(str("start failed: ", error.message));
+        return;
+    }
+    //let the lookups settle and the snapshots be written
+    std::this_thread::sleep_for(std::chrono::milliseconds(1000));
+
+    const int restarts = 10;
+    double total = 0;
+    int routed = 0;
+    for(int i = 0; i < restarts; i++){
+        int index = 1 + i * 7 % (count - 1);
+        int destination = (index + count / 2) % count;
+        if(destination == 0 || destination == index){
+            destination = 1 + (destination + 1) % (count - 1);
+        }
+        PeerId destinationId = cluster.nodes[destination]->localId();
+
+        cluster.stop(index);
+        auto start = std::chrono::steady_clock::now();
+        if(cluster.start(index)){
+            continue;
+        }
+        cluster.nodes[index]->join();
+
+        int before = cluster.received[destination];
+        while(cluster.received[destination] == before && seconds(start) < 5){
+            cluster.nodes[index]->send("route", destinationId);
+            std::this_thread::sleep_for(std::chrono::microseconds(500));
+        }
+        if(cluster.received[destination] != before){
+            total += seconds(start);
+            routed++;
+        }
+        //let the restarted node finish its lookups before the next restart
+        std::this_thread::sleep_for(std::chrono::milliseconds(300));
+    }
+    std::cout << "restart " << count << " nodes " << (snapshots ? "with" : "without") << " snapshot: "
+        << (routed > 0 ? total / routed * 1000 : 0) << " ms to first route, " << routed << "/" << restarts << " routed" << std::endl;
+    expect(str("restart ", snapshots ? "with" : "without", " snapshot routed"), routed, restarts, 0.8);
+}
+
+//latency of routed messages when links between regions are slow,
+//proximity routing prefers next hops with a low rtt among almost equally close peers
+void proximityCase(int count, int proximityBits){
+    const int regions = 4;
+    const int localDelay = 1;
+    const int remoteDelay = 20;
+    Cluster cluster(count, 4200);
+    cluster.configure = [&](PeerNetwork &node, int index){
+        node.proximityBits = proximityBits;
+        node.pingInterval = 300;
+        node.linkDelay = [&, index](const Endpoint &ep){
+            int other = ep.getPort() - cluster.basePort;
+            return other % regions == index % regions ? localDelay : remoteDelay;
+        };
+    };
+    std::mutex mutex;
+    std::vector<double> latencies;
+    cluster.onMessage = [&](int index, const PeerId &id, const std::string &msg){
+        double latency = (steadyMicros() - std::stoull(msg)) / 1000.0;
+        std::lock_guard<std::mutex> lock(mutex);
+        latencies.push_back(latency);
+    };
+    Error error = cluster.startAll();
+    if(error){
+        fail(str("start failed: ", error.message));
+        return;
+    }
+    //rtt estimates from a few ping rounds
+    std::this_thread::sleep_for(std::chrono::milliseconds(2000));
+
+    const int messages = 1000;
+    int sent = 0;
+    std::srand(1);
+    for(int i = 0; i < messages; i++){
+        int source = std::rand() % count;
+        int destination = std::rand() % count;
+        if(source != destination){
+            cluster.nodes[source]->send(str(steadyMicros()), cluster.nodes[destination]->localId());
+            sent++;
+        }
+        std::this_thread::sleep_for(std::chrono::microseconds(500));
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(1000));
+
+    std::lock_guard<std::mutex> lock(mutex);
+    std::sort(latencies.begin(), latencies.end());
+    double sum = 0;
+    for(double latency : latencies){
+        sum += latency;
+    }
+    std::cout << "proximity " << count << " nodes, " << regions << " regions " << localDelay << "/" << remoteDelay << " ms, proximity bits "
+        << proximityBits << ": mean " << (latencies.empty() ? 0 : sum / latencies.size()) << " ms, p90 "
+        << (latencies.empty() ? 0 : latencies[latencies.size() * 9 / 10]) << " ms, " << latencies.size() << " delivered" << std::endl;
+    expect(str("proximity bits ", proximityBits, " delivered"), latencies.size(), sent, 0.99);
+}
+
+//cost of bootstrapping: duration of join() and datagrams sent by the whole cluster per joined node,
+//then the ratio of routed messages that arrive
+void joinCase(int count){
+    Cluster cluster(count, 4400);
+    cluster.configure = [&](PeerNetwork &node, int index){
+        //only the bootstrap traffic is counted
+        node.refreshInterval = 60000;
+        node.pingInterval = 60000;
+    };
+
+    double joinTime = 0;
+    for(int i = 0; i < count; i++){
+        Error error = cluster.start(i);
+        if(error){
+            fail(str("start failed: ", error.message));
+            return;
+        }
+        if(i > 0){
+            auto start = std::chrono::steady_clock::now();
+            cluster.nodes[i]->join();
+            joinTime += seconds(start);
+        }
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(1000));
+    uint64_t joinDatagrams = cluster.sentDatagrams();
+
+    const int messages = 500;
+    std::srand(2);
+    int sent = 0;
+    int before = 0;
+    for(int i = 0; i < count; i++){
+        before += cluster.received[i];
+    }
+    for(int i = 0; i < messages; i++){
+        int source = std::rand() % count;
+        int destination = std::rand() % count;
+        if(source != destination){
+            cluster.nodes[source]->send("route", cluster.nodes[destination]->localId());
+            sent++;
+        }
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(500));
+    int received = -before;
+    for(int i = 0; i < count; i++){
+        received += cluster.received[i];
+    }
+    std::cout << "join " << count << " nodes: " << joinTime / (count - 1) * 1000 << " ms per join, "
+        << (double)joinDatagrams / (count - 1) << " datagrams per join, " << received << "/" << sent << " routed" << std::endl;
+    expect("join routed", received, sent, 0.99);
+}
+
+//datagrams received per delivered broadcast, bytes and time until the last node has a broadcast,
+//lossPercent of all datagrams are dropped
+void broadcastCase(int count, bool tree, int gossipInterval = 0, int size = 100, int lossPercent = 0, int broadcasts = 100){
+    Cluster cluster(count, 4600);
+    cluster.configure = [&](PeerNetwork &node, int index){
+        //only the broadcast traffic is counted
+        node.refreshInterval = 60000;
+        node.pingInterval = 60000;
+        node.treeBroadcast = tree;
+        node.gossipInterval = gossipInterval;
+        node.compressionThreshold = -1;
+    };
+    std::mutex mutex;
+    std::vector<int> arrivals(broadcasts);
+    std::vector<uint64_t> lastArrival(broadcasts);
+    cluster.onMessage = [&](int index, const PeerId &id, const std::string &msg){
+        int broadcast = 0;
+        unsigned long long sent = 0;
+        if(std::sscanf(msg.c_str(), "%d %llu", &broadcast, &sent) == 2 && broadcast >= 0 && broadcast < broadcasts){
+            std::lock_guard<std::mutex> lock(mutex);
+            arrivals[broadcast]++;
+            lastArrival[broadcast] = steadyMicros() - sent;
+        }
+    };
+    Error error = cluster.startAll();
+    if(error){
+        fail(str("start failed: ", error.message));
+        return;
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(1000));
+    if(lossPercent > 0){
+        for(auto &node : cluster.nodes){
+            node->linkDelay = [lossPercent](const Endpoint &ep){
+                thread_local uint32_t state = 1;
+                state = state * 1103515245 + 12345;
+                return (int)(state >> 16) % 100 < lossPercent ? -1 : 0;
+            };
+        }
+    }
+
+    uint64_t datagrams = cluster.sentDatagrams();
+    uint64_t bytes = cluster.sentBytes();
+    std::srand(3);
+    std::string payload(size, ' ');
+    for(auto &c : payload){
+        c = 'a' + std::rand() % 26;
+    }
+    for(int i = 0; i < broadcasts; i++){
+        std::string msg = str(i, " ", steadyMicros(), " ");
+        msg += payload.substr(std::min(msg.size(), payload.size()));
+        cluster.nodes[std::rand() % count]->broadcast(msg);
+        std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    }
+    //repairs take a few gossip rounds
+    std::this_thread::sleep_for(std::chrono::milliseconds(500 + 3 * gossipInterval));
+    datagrams = cluster.sentDatagrams() - datagrams;
+    bytes = cluster.sentBytes() - bytes;
+
+    std::lock_guard<std::mutex> lock(mutex);
+    int delivered = 0;
+    int covered = 0;
+    double coverageTime = 0;
+    for(int i = 0; i < broadcasts; i++){
+        delivered += arrivals[i];
+        if(arrivals[i] == count - 1){
+            covered++;
+            coverageTime += lastArrival[i] / 1000.0;
+        }
+    }
+    std::cout << "broadcast " << count << " nodes " << (tree ? gossipInterval > 0 ? "tree+gossip" : "tree" : "flood")
+        << ", " << size << " bytes, " << lossPercent << "% loss: "
+        << (delivered > 0 ? (double)datagrams / delivered : 0) << " datagrams per delivery, "
+        << bytes / broadcasts / 1024.0 << " KiB per broadcast, "
+        << (covered > 0 ? coverageTime / covered : 0) << " ms to full coverage, "
+        << covered << "/" << broadcasts << " fully covered" << std::endl;
+    //without loss every node gets every broadcast, with loss only gossip repairs what the flood or tree missed
+    expect(str("broadcast ", tree ? gossipInterval > 0 ? "tree+gossip" : "tree" : "flood", " ", size, " bytes ", lossPercent, "% loss delivered"),
+        delivered, broadcasts * (count - 1), lossPercent == 0 ? 0.99 : gossipInterval > 0 ? 0.95 : 0.5);
+}
+
+//goodput and latency of a paced stream between two nodes when every link has delay and loss
+void reliableCase(int count, bool reliable, int delay, int lossPercent){
+    Cluster cluster(count, 4800);
+    //the links are impaired after the cluster is joined
+    std::atomic<bool> impaired(false);
+    cluster.configure = [&](PeerNetwork &node, int index){
+        node.compressionThreshold = -1;
+        node.linkDelay = [&](const Endpoint &ep){
+            if(!impaired){
+                return 0;
+            }
+            thread_local uint32_t state = 1;
+            state = state * 1103515245 + 12345;
+            return (int)(state >> 16) % 100 < lossPercent ? -1 : delay;
+        };
+    };
+    const int messages = 2000;
+    const int size = 1000;
+    std::mutex mutex;
+    std::vector<double> latencies;
+    uint64_t lastDelivery = 0;
+    cluster.onMessage = [&](int index, const PeerId &id, const std::string &msg){
+        uint64_t now = steadyMicros();
+        std::lock_guard<std::mutex> lock(mutex);
+        latencies.push_back((now - std::stoull(msg)) / 1000.0);
+        lastDelivery = now;
+    };
+    Error error = cluster.startAll();
+    if(error){
+        fail(str("start failed: ", error.message));
+        return;
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(1000));
+    impaired = true;
+
+    auto &source = cluster.nodes[1];
+    PeerId destination = cluster.nodes[count - 1]->localId();
+    uint64_t start = steadyMicros();
+    for(int i = 0; i < messages; i++){
+        std::string msg = str(steadyMicros(), " ");
+        msg.resize(size, 'x');
+        source->send(msg, destination, reliable);
+        std::this_thread::sleep_for(std::chrono::microseconds(500));
+    }
+    //until everything arrived or nothing did for 3 seconds
+    while(true){
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        std::lock_guard<std::mutex> lock(mutex);
+        if(latencies.size() == messages || steadyMicros() - std::max(start, lastDelivery) > 3000000){
+            break;
+        }
+    }
+
+    std::lock_guard<std::mutex> lock(mutex);
+    std::sort(latencies.begin(), latencies.end());
+    auto percentile = [&](int p){
+        return latencies.empty() ? 0 : latencies[std::min(latencies.size() - 1, latencies.size() * p / 100)];
+    };
+    std::cout << "stream " << (reliable ? "reliable" : "unreliable") << ", " << delay << " ms delay, " << lossPercent << "% loss: "
+        << latencies.size() << "/" << messages << " delivered, "
+        << (lastDelivery > start ? latencies.size() * size / ((lastDelivery - start) / 1e6) / 1e6 : 0) << " MB/s goodput, latency p50 "
+        << percentile(50) << " ms, p99 " << percentile(99) << " ms, max " << (latencies.empty() ? 0 : latencies.back()) << " ms" << std::endl;
+    //an unreliable message is lost with every hop it takes
+    expect(str("stream ", reliable ? "reliable" : "unreliable", " ", lossPercent, "% loss delivered"),
+        latencies.size(), messages, reliable ? 1.0 : 1.0 - 4 * lossPercent / 100.0);
+}
+
+//messages from 1 KB to 16 MB between two nodes, unreliable ones are fragmented, reliable ones segmented
+void fragmentCase(int count, bool reliable, int lossPercent){
+    Cluster cluster(count, 5200);
+    std::atomic<bool> impaired(false);
+    cluster.configure = [&](PeerNetwork &node, int index){
+        node.compressionThreshold = -1;
+        node.linkDelay = [&](const Endpoint &ep){
+            if(!impaired){
+                return 0;
+            }
+            thread_local uint32_t state = 1;
+            state = state * 1103515245 + 12345;
+            return (int)(state >> 16) % 100 < lossPercent ? -1 : 0;
+        };
+    };
+    std::atomic<int> delivered(0);
+    std::atomic<uint64_t> lastDelivery(0);
+    std::atomic<int> expectedSize(0);
+    cluster.onMessage = [&](int index, const PeerId &id, const std::string &msg){
+        if(msg.size() == expectedSize){
+            lastDelivery = steadyMicros();
+            delivered++;
+        }
+    };
+    Error error = cluster.startAll();
+    if(error){
+        fail(str("start failed: ", error.message));
+        return;
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(1000));
+    impaired = true;
+
+    auto &source = cluster.nodes[1];
+    PeerId destination = cluster.nodes[count - 1]->localId();
+    for(int size : {1024, 16 * 1024, 256 * 1024, 1024 * 1024, 16 * 1024 * 1024}){
+        int messages = std::clamp(4 * 1024 * 1024 / size, 1, 100);
+        std::string msg(size, 'x');
+        expectedSize = size;
+        delivered = 0;
+        uint64_t datagrams = cluster.sentDatagrams();
+        uint64_t start = steadyMicros();
+        for(int i = 0; i < messages; i++){
+            source->send(msg, destination, reliable);
+        }
+        //until everything arrived or nothing did for 2 seconds
+        while(delivered < messages && steadyMicros() - std::max(start, lastDelivery.load()) < 2000000){
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+        //let repairs and late duplicates settle before the next size
+        std::this_thread::sleep_for(std::chrono::milliseconds(200));
+        double millis = (lastDelivery.load() > start ? lastDelivery.load() - start : 0) / 1000.0;
+        std::cout << (reliable ? "reliable" : "unreliable") << ", " << lossPercent << "% loss, " << size / 1024 << " KB: "
+            << delivered << "/" << messages << " delivered in " << millis << " ms, "
+            << (millis > 0 ? delivered * (double)size / (millis / 1000) / 1e6 : 0) << " MB/s, "
+            << (cluster.sentDatagrams() - datagrams) << " datagrams" << std::endl;
+        //a fragmented message is lost with any of its fragments, and a burst of unreliable messages can overflow the receive buffer
+        if(reliable || lossPercent == 0){
+            expect(str(reliable ? "reliable" : "unreliable", " ", lossPercent, "% loss ", size / 1024, " KB delivered"),
+                delivered, messages, reliable ? 1.0 : 0.75);
+        }
+    }
+}
+
+//many small messages from one node to the others, datagrams written per message with and without packing
+void coalesceCase(int count, int coalesceDelay){
+    Cluster cluster(count, 5400);
+    cluster.configure = [&](PeerNetwork &node, int index){
+        node.coalesceDelay = coalesceDelay;
+    };
+    const int messages = 50000;
+    std::mutex mutex;
+    std::vector<double> latencies;
+    std::atomic<uint64_t> lastDelivery(0);
+    cluster.onMessage = [&](int index, const PeerId &id, const std::string &msg){
+        uint64_t now = steadyMicros();
+        lastDelivery = now;
+        std::lock_guard<std::mutex> lock(mutex);
+        latencies.push_back((now - std::stoull(msg)) / 1000.0);
+    };
+    Error error = cluster.startAll();
+    if(error){
+        fail(str("start failed: ", error.message));
+        return;
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(1000));
+
+    auto &source = cluster.nodes[1];
+    std::vector<PeerId> destinations;
+    for(int i = 2; i < count; i++){
+        destinations.push_back(cluster.nodes[i]->localId());
+    }
+    uint64_t datagrams = cluster.sentDatagrams();
+    uint64_t start = steadyMicros();
+    for(int i = 0; i < messages; i++){
+        std::string msg = str(steadyMicros(), " ");
+        msg.resize(64, 'x');
+        source->send(msg, destinations[i % destinations.size()]);
+        //about 200k messages per second
+        if(i % 100 == 99){
+            while(steadyMicros() - start < (i + 1) * 5ull){}
+        }
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(500));
+    datagrams = cluster.sentDatagrams() - datagrams;
+
+    std::lock_guard<std::mutex> lock(mutex);
+    std::sort(latencies.begin(), latencies.end());
+    auto percentile = [&](int p){
+        return latencies.empty() ? 0 : latencies[std::min(latencies.size() - 1, latencies.size() * p / 100)];
+    };
+    double seconds = (lastDelivery.load() - start) / 1e6;
+    std::cout << "coalesce delay " << coalesceDelay << " us: " << latencies.size() << "/" << messages << " delivered, "
+        << (int)(latencies.size() / seconds) << " msg/s, " << (double)datagrams / messages << " datagrams per message, latency p50 "
+        << percentile(50) << " ms, p99 " << percentile(99) << " ms" << std::endl;
+    expect(str("coalesce delay ", coalesceDelay, " delivered"), latencies.size(), messages, 0.99);
+}
+
+//binary messages containing NUL bytes from one node to the others, delivered by copy, by view or in batches
+void binaryCase(int count, int mode){
+    Cluster cluster(count, 5600);
+    const int messages = 100000;
+    const int size = 256;
+    std::atomic<int> delivered(0);
+    std::atomic<int> corrupted(0);
+    std::atomic<int> batches(0);
+    std::atomic<uint64_t> lastDelivery(0);
+    //byte i of a message is its first byte plus i
+    auto check = [&](const std::byte *data, size_t bytes){
+        bool intact = bytes == size;
+        for(size_t i = 1; i < bytes && intact; i++){
+            intact = (uint8_t)data[i] == (uint8_t)((uint8_t)data[0] + i);
+        }
+        if(!intact){
+            corrupted++;
+        }
+        delivered++;
+        lastDelivery = steadyMicros();
+    };
+    cluster.configure = [&](PeerNetwork &node, int index){
+        if(mode == 0){
+            node.msgCallback = [&](const PeerId &id, const std::string &msg){
+                check((const std::byte*)msg.data(), msg.size());
+            };
+        }else if(mode == 1){
+            node.msgCallback = nullptr;
+            node.dataCallback = [&](const PeerId &id, std::span<const std::byte> msg){
+                check(msg.data(), msg.size());
+            };
+        }else{
+            node.msgCallback = nullptr;
+            node.batchCallback = [&](const std::vector<PeerNetwork::Delivery> &messages){
+                batches++;
+                for(auto &message : messages){
+                    check(message.msg.data(), message.msg.size());
+                }
+            };
+        }
+    };
+    Error error = cluster.startAll();
+    if(error){
+        fail(str("start failed: ", error.message));
+        return;
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(1000));
+
+    auto &source = cluster.nodes[1];
+    std::vector<PeerId> destinations;
+    for(int i = 2; i < count; i++){
+        destinations.push_back(cluster.nodes[i]->localId());
+    }
+    std::vector<std::byte> msg(size);
+    //cpu time of the network threads, the spinning sender thread is not counted
+    auto cpuTime = [](clockid_t clock){
+        timespec time{};
+        clock_gettime(clock, &time);
+        return time.tv_sec * 1e6 + time.tv_nsec / 1e3;
+    };
+    double cpu = cpuTime(CLOCK_PROCESS_CPUTIME_ID) - cpuTime(CLOCK_THREAD_CPUTIME_ID);
+    uint64_t start = steadyMicros();
+    for(int i = 0; i < messages; i++){
+        for(int j = 0; j < size; j++){
+            msg[j] = (std::byte)(i + j);
+        }
+        source->send(msg, destinations[i % destinations.size()]);
+        //about 100k messages per second
+        if(i % 100 == 99){
+            while(steadyMicros() - start < (i + 1) * 10ull){}
+        }
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(500));
+    double cpuMicros = cpuTime(CLOCK_PROCESS_CPUTIME_ID) - cpuTime(CLOCK_THREAD_CPUTIME_ID) - cpu;
+
+    const char *names[] = {"msgCallback (copy)", "dataCallback (view)", "batchCallback"};
+    double seconds = (lastDelivery.load() - start) / 1e6;
+    std::cout << names[mode] << ": " << delivered << "/" << messages << " delivered, " << corrupted << " corrupted, "
+        << (int)(delivered / seconds) << " msg/s, " << cpuMicros / messages << " us cpu per message";
+    if(mode == 2){
+        std::cout << ", " << (double)delivered / std::max(batches.load(), 1) << " messages per batch";
+    }
+    std::cout << std::endl;
+    expect(str(names[mode], " delivered"), delivered, messages, 0.99);
+    expect(str(names[mode], " intact"), delivered - corrupted, delivered);
+}
+
+//datagrams packing a MESSAGE for a relay and a ROUTE it forwards without a marker in between, written by hand.
+//the MESSAGE is queued for batchCallback as a view into the receive buffer while the ROUTE is forwarded from the same buffer
+void packedCase(){
+    const int datagrams = 1000;
+    const int size = 64;
+    Cluster cluster(3, 6600);
+    std::atomic<int> direct(0);
+    std::atomic<int> routed(0);
+    std::atomic<int> corrupted(0);
+    cluster.configure = [&](PeerNetwork &node, int index){
+        node.msgCallback = nullptr;
+        node.batchCallback = [&, index](const std::vector<PeerNetwork::Delivery> &messages){
+            for(auto &message : messages){
+                //byte i of a message is its first byte plus i
+                const std::byte *data = message.msg.data();
+                bool intact = message.msg.size() == size;
+                for(size_t i = 1; i < message.msg.size() && intact; i++){
+                    intact = (uint8_t)data[i] == (uint8_t)((uint8_t)data[0] + i);
+                }
+                if(!intact){
+                    corrupted++;
+                }
+                (index == 1 ? direct : routed)++;
+            }
+        };
+    };
+    Error error = cluster.startAll();
+    if(error){
+        fail(str("start failed: ", error.message));
+        return;
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(1000));
+
+    std::string directMsg(size, 0);
+    std::string routedMsg(size, 0);
+    for(int i = 0; i < size; i++){
+        directMsg[i] = (char)i;
+        routedMsg[i] = (char)(i + 1);
+    }
+    Packet payload;
+    payload.add(WIRE_V2_MARKER);
+    payload.add((uint8_t)PeerOpcode::MESSAGE);
+    Schema<DataMessage>::write(payload, DataMessage{routedMsg}, WIRE_V2);
+    Packet datagram;
+    datagram.add(WIRE_V2_MARKER);
+    datagram.add((uint8_t)PeerOpcode::MESSAGE);
+    Schema<DataMessage>::write(datagram, DataMessage{directMsg}, WIRE_V2);
+    datagram.add((uint8_t)PeerOpcode::ROUTE);
+    Schema<RouteMessage>::write(datagram, RouteMessage{PeerId(1), cluster.nodes[2]->localId(), payload.size()}, WIRE_V2);
+    datagram.add(payload.data(), payload.size());
+
+    UdpSocket socket;
+    Endpoint relay("::1", 6601);
+    for(int i = 0; i < datagrams; i++){
+        socket.write(datagram.data(), datagram.size(), relay);
+        std::this_thread::sleep_for(std::chrono::microseconds(200));
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(500));
+
+    std::cout << "packed: " << direct << "/" << datagrams << " direct, " << routed << "/" << datagrams
+        << " routed delivered, " << corrupted << " corrupted" << std::endl;
+    expect("packed direct delivered", direct, datagrams, 0.99);
+    expect("packed routed delivered", routed, datagrams, 0.99);
+    expect("packed intact", direct + routed - corrupted, direct + routed);
+}
+
+//routed messages from one node to the nodes it does not know, the relays spend time in callbacks for a load of direct messages.
+//with processing threads the forwarding of a relay does not wait for its callbacks
+void shardsCase(int count, int threads){
+    Cluster cluster(count, 5800);
+    cluster.configure = [&](PeerNetwork &node, int index){
+        node.processingThreads = threads;
+    };
+    std::mutex mutex;
+    std::vector<double> latencies;
+    std::atomic<int> delivered(0);
+    std::atomic<uint64_t> lastDelivery(0);
+    cluster.onMessage = [&](int index, const PeerId &id, const std::string &msg){
+        if(msg[0] == 'L'){
+            //blocking work of the application, e.g. disk or database access
+            std::this_thread::sleep_for(std::chrono::microseconds(5000));
+            return;
+        }
+        delivered++;
+        lastDelivery = steadyMicros();
+        if(msg[0] != 'T'){
+            std::lock_guard<std::mutex> lock(mutex);
+            latencies.push_back((steadyMicros() - std::stoull(msg)) / 1000.0);
+        }
+    };
+    Error error = cluster.startAll();
+    if(error){
+        fail(str("start failed: ", error.message));
+        return;
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(1000));
+
+    //destinations the source does not know are reached over at least one relay
+    auto &source = cluster.nodes[1];
+    std::vector<PeerId> destinations;
+    std::vector<PeerId> relays;
+    std::vector<Peer> peers = source->getPeers();
+    for(int i = 2; i < count; i++){
+        PeerId id = cluster.nodes[i]->localId();
+        bool known = false;
+        for(auto &peer : peers){
+            known |= peer.id == id;
+        }
+        (known ? relays : destinations).push_back(id);
+    }
+    if(destinations.empty()){
+        fail("shards: every node is known to the source, use more nodes");
+        return;
+    }
+
+    //about 100 messages per second to every relay
+    std::atomic<bool> loading(true);
+    std::thread load([&](){
+        while(loading){
+            for(auto &relay : relays){
+                cluster.nodes[0]->send("L", relay);
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        }
+    });
+
+    const int messages = 2000;
+    for(int i = 0; i < messages; i++){
+        source->send(str(steadyMicros()), destinations[i % destinations.size()]);
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(500));
+
+    //as fast as the source can send
+    const int burst = 50000;
+    delivered = 0;
+    uint64_t start = steadyMicros();
+    for(int i = 0; i < burst; i++){
+        source->send("T", destinations[i % destinations.size()]);
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(1000));
+    loading = false;
+    load.join();
+
+    std::lock_guard<std::mutex> lock(mutex);
+    std::sort(latencies.begin(), latencies.end());
+    auto percentile = [&](int p){
+        return latencies.empty() ? 0 : latencies[std::min(latencies.size() - 1, latencies.size() * p / 100)];
+    };
+    double seconds = (lastDelivery.load() - start) / 1e6;
+    //next hops of sent and forwarded messages on all nodes
+    uint64_t hits = 0;
+    uint64_t lookups = 0;
+    for(auto &node : cluster.nodes){
+        auto &stats = node->nextHopStats();
+        hits += stats.hits;
+        lookups += stats.hits + stats.misses;
+    }
+    std::cout << "processing threads " << threads << ": " << destinations.size() << " routed destinations, latency p50 "
+        << percentile(50) << " ms, p99 " << percentile(99) << " ms (" << latencies.size() << "/" << messages << "), throughput "
+        << (int)(delivered / seconds) << " msg/s (" << delivered << "/" << burst << "), next hop hit rate "
+        << (lookups > 0 ? 100.0 * hits / lookups : 0) << "%" << std::endl;
+    expect(str("processing threads ", threads, " delivered"), latencies.size(), messages, 0.99);
+    expect(str("processing threads ", threads, " burst delivered"), delivered, burst, 0.99);
+}
+
+//skewed traffic from one node: most messages go to a few destinations it has no link to.
+//datagrams per message count the hops, directRate 0 keeps routing them over the overlay
+void directCase(int count, int directRate){
+    const int hot = 4;
+    const int messages = 3000;
+    Cluster cluster(count, 6000);
+    cluster.configure = [&](PeerNetwork &node, int index){
+        node.directRate = directRate;
+        node.coalesceDelay = -1;
+        //only the sent messages are counted
+        node.pingInterval = 60000;
+        node.refreshInterval = 60000;
+        node.linkDelay = [](const Endpoint &ep){
+            return 1;
+        };
+    };
+    std::mutex mutex;
+    std::vector<double> latencies;
+    cluster.onMessage = [&](int index, const PeerId &id, const std::string &msg){
+        double latency = (steadyMicros() - std::stoull(msg)) / 1000.0;
+        std::lock_guard<std::mutex> lock(mutex);
+        latencies.push_back(latency);
+    };
+    Error error = cluster.startAll();
+    if(error){
+        fail(str("start failed: ", error.message));
+        return;
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(1000));
+
+    auto &source = cluster.nodes[1];
+    std::vector<PeerId> known;
+    for(auto &peer : source->getPeers()){
+        known.push_back(peer.id);
+    }
+    std::vector<PeerId> hotDestinations;
+    std::vector<PeerId> destinations;
+    for(int i = 2; i < count; i++){
+        PeerId id = cluster.nodes[i]->localId();
+        if(hotDestinations.size() < hot && std::find(known.begin(), known.end(), id) == known.end()){
+            hotDestinations.push_back(id);
+        }else{
+            destinations.push_back(id);
+        }
+    }
+    if(hotDestinations.empty()){
+        fail("direct: every node is known to the source, use more nodes");
+        return;
+    }
+
+    //the first half gives the upgrades time, the second half is measured
+    std::srand(3);
+    uint64_t datagrams = 0;
+    for(int i = 0; i < 2 * messages; i++){
+        if(i == messages){
+            std::this_thread::sleep_for(std::chrono::milliseconds(200));
+            std::lock_guard<std::mutex> lock(mutex);
+            latencies.clear();
+            datagrams = cluster.sentDatagrams();
+        }
+        //80% of the messages to the hot destinations
+        bool toHot = std::rand() % 5 != 0 || destinations.empty();
+        auto &destination = toHot ? hotDestinations[std::rand() % hotDestinations.size()] : destinations[std::rand() % destinations.size()];
+        source->send(str(steadyMicros()), destination);
+        std::this_thread::sleep_for(std::chrono::microseconds(500));
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(200));
+    datagrams = cluster.sentDatagrams() - datagrams;
+    int links = source->getDirectLinks().size();
+
+    //without traffic the links are dropped again
+    std::this_thread::sleep_for(std::chrono::milliseconds(2500));
+    int remaining = source->getDirectLinks().size();
+
+    std::lock_guard<std::mutex> lock(mutex);
+    std::sort(latencies.begin(), latencies.end());
+    auto percentile = [&](int p){
+        return latencies.empty() ? 0 : latencies[std::min(latencies.size() - 1, latencies.size() * p / 100)];
+    };
+    std::cout << "direct rate " << directRate << ": " << latencies.size() << "/" << messages << " delivered, "
+        << (double)datagrams / messages << " datagrams per message, latency p50 " << percentile(50) << " ms, p99 "
+        << percentile(99) << " ms, " << links << " direct links, " << remaining << " after idle" << std::endl;
+    expect(str("direct rate ", directRate, " delivered"), latencies.size(), messages, 0.99);
+}
+
+//replicated store on the cluster: throughput and latency of puts and gets with a bounded number in flight,
+//gets of a few hot keys, and gets after a tenth of the nodes failed without DISCONNECT
+void storeCase(int count, int hotKeyReads){
+    const int keys = 2000;
+    const int inFlight = 64;
+    Cluster cluster(count, 6200);
+    cluster.configure = [&](PeerNetwork &node, int index){
+        node.hotKeyReads = hotKeyReads;
+        node.pingInterval = 1000;
+        node.peerTimeout = 3000;
+    };
+    Error error = cluster.startAll();
+    if(error){
+        fail(str("start failed: ", error.message));
+        return;
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(2000));
+
+    //pings of the whole cluster, subtracted from the datagrams of the operations
+    uint64_t idle = cluster.sentDatagrams();
+    std::this_thread::sleep_for(std::chrono::milliseconds(1000));
+    double idleRate = cluster.sentDatagrams() - idle;
+
+    std::vector<int> alive;
+    for(int i = 0; i < count; i++){
+        alive.push_back(i);
+    }
+    std::mutex mutex;
+    std::vector<double> latencies;
+    std::atomic<int> pending(0);
+    std::atomic<int> succeeded(0);
+    std::atomic<int> correct(0);
+    //runs the operations from random live nodes and prints throughput and latency
+    //minimum is the share of operations that has to be correct
+    auto run = [&](const std::string &name, int operations, const std::function<std::string(int i)> &keyOf, bool write, double minimum){
+        latencies.clear();
+        succeeded = 0;
+        correct = 0;
+        uint64_t datagrams = cluster.sentDatagrams();
+        uint64_t start = steadyMicros();
+        for(int i = 0; i < operations; i++){
+            while(pending >= inFlight){
+                std::this_thread::sleep_for(std::chrono::microseconds(100));
+            }
+            std::string key = keyOf(i);
+            std::string expected = "value of " + key;
+            uint64_t begin = steadyMicros();
+            auto done = [&, begin, expected](const PeerNetwork::StoreResult &result){
+                double latency = (steadyMicros() - begin) / 1000.0;
+                if(result.ok){
+                    succeeded++;
+                }
+                if(write ? result.ok : result.found && result.value == expected){
+                    correct++;
+                }
+                std::lock_guard<std::mutex> lock(mutex);
+                latencies.push_back(latency);
+                pending--;
+            };
+            pending++;
+            auto &node = cluster.nodes[alive[std::rand() % alive.size()]];
+            if(write){
+                node->put(key, expected, done);
+            }else{
+                node->get(key, done);
+            }
+        }
+        while(pending > 0){
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+        double seconds = (steadyMicros() - start) / 1e6;
+        datagrams = cluster.sentDatagrams() - datagrams;
+        double operationDatagrams = std::max(0.0, datagrams - idleRate * seconds);
+
+        std::lock_guard<std::mutex> lock(mutex);
+        std::sort(latencies.begin(), latencies.end());
+        auto percentile = [&](int p){
+            return latencies.empty() ? 0 : latencies[std::min(latencies.size() - 1, latencies.size() * p / 100)];
+        };
+        std::cout << "store " << name << ": " << correct << "/" << operations << " correct, " << succeeded << " with quorum, "
+            << (int)(operations / seconds) << " ops/s, latency p50 " << percentile(50) << " ms, p99 " << percentile(99)
+            << " ms, " << operationDatagrams / operations << " datagrams per op" << std::endl;
+        expect(str("store ", name, " correct"), correct, operations, minimum);
+    };
+
+    std::cout << "store " << count << " nodes, hot key reads " << hotKeyReads << std::endl;
+    std::srand(4);
+    auto key = [](int i){
+        return str("key", i);
+    };
+    run("put", keys, key, true, 0.99);
+    run("get", keys, [&](int i){
+        return key(std::rand() % keys);
+    }, false, 0.99);
+    //90% of the gets to 8 keys
+    run("get hot", keys, [&](int i){
+        return key(std::rand() % 10 != 0 ? std::rand() % 8 : std::rand() % keys);
+    }, false, 0.99);
+
+    //a tenth of the nodes fail, node 0 is the entry node
+    int failed = count / 10;
+    for(int i = 0; i < failed; i++){
+        int index = 1 + std::rand() % (alive.size() - 1);
+        cluster.stop(alive[index]);
+        alive.erase(alive.begin() + index);
+    }
+    int index = 0;
+    //gets that pass a failed peer time out until it is removed
+    run("get after failure", keys, [&](int i){
+        return key(index++);
+    }, false, 0.7);
+    //the failed peers time out and the records are replicated to the new closest peers
+    std::this_thread::sleep_for(std::chrono::milliseconds(6000));
+    index = 0;
+    run("get after replication", keys, [&](int i){
+        return key(index++);
+    }, false, 0.99);
+}
+
+//publishes a message from random live nodes every 2 ms, returns the bytes sent per message
+//without the ones the cluster sends when idle
+double publishRun(Cluster &cluster, const std::vector<int> &alive, int messages, double idleRate, const std::string &prefix,
+    const std::function<void(int index, const std::string &msg)> &send){
+    uint64_t bytes = cluster.sentBytes();
+    uint64_t start = steadyMicros();
+    for(int i = 0; i < messages; i++){
+        std::string msg = prefix + str(i);
+        msg.resize(100, 'x');
+        send(alive[std::rand() % alive.size()], msg);
+        std::this_thread::sleep_for(std::chrono::milliseconds(2));
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(1000));
+    double seconds = (steadyMicros() - start) / 1e6;
+    return std::max(0.0, cluster.sentBytes() - bytes - idleRate * seconds) / messages;
+}
+
+//bytes sent per 100 byte message for a topic with subscribers on a share of the nodes: published along the topic tree,
+//or broadcast to all nodes that drop it if they did not subscribe
+void pubsubCase(int count, int density){
+    const int messages = 100;
+    Cluster cluster(count, 6400);
+    cluster.configure = [&](PeerNetwork &node, int index){
+        //only the messages are counted
+        node.pingInterval = 60000;
+        node.refreshInterval = 60000;
+        node.gossipInterval = 0;
+    };
+    std::string topic = str("topic", density);
+    std::string prefix = topic + "|";
+    std::vector<char> subscribed(count, false);
+    std::atomic<int> delivered(0);
+    cluster.onMessage = [&](int index, const PeerId &id, const std::string &msg){
+        if(subscribed[index] && msg.compare(0, prefix.size(), prefix) == 0){
+            delivered++;
+        }
+    };
+    Error error = cluster.startAll();
+    if(error){
+        fail(str("start failed: ", error.message));
+        return;
+    }
+    std::srand(5);
+    int subscribers = std::max(1, count * density / 100);
+    for(int i = 0; i < subscribers;){
+        int index = std::rand() % count;
+        if(!subscribed[index]){
+            subscribed[index] = true;
+            cluster.nodes[index]->subscribe(topic, [&](const PeerId &source, const std::string &msg){
+                delivered++;
+            });
+            i++;
+        }
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(1000));
+    //topic refreshes
+    uint64_t idle = cluster.sentBytes();
+    std::this_thread::sleep_for(std::chrono::milliseconds(2000));
+    double idleRate = (cluster.sentBytes() - idle) / 2.0;
+
+    std::vector<int> alive;
+    for(int i = 0; i < count; i++){
+        alive.push_back(i);
+    }
+    double treeBytes = publishRun(cluster, alive, messages, idleRate, prefix, [&](int index, const std::string &msg){
+        cluster.nodes[index]->publish(topic, msg);
+    });
+    int treeDelivered = delivered;
+    delivered = 0;
+    double broadcastBytes = publishRun(cluster, alive, messages, idleRate, prefix, [&](int index, const std::string &msg){
+        cluster.nodes[index]->broadcast(msg);
+    });
+    std::cout << "pubsub " << count << " nodes, " << subscribers << " subscribers (" << density << "%): publish "
+        << (int)treeBytes << " bytes per message, " << treeDelivered << "/" << subscribers * messages << " delivered; broadcast "
+        << (int)broadcastBytes << " bytes per message, " << delivered << " delivered" << std::endl;
+    expect(str("pubsub ", density, "% publish delivered"), treeDelivered, subscribers * messages, 0.99);
+    //a broadcast does not reach its own source, a publish does
+    expect(str("pubsub ", density, "% broadcast delivered"), delivered, subscribers * messages, 0.9);
+}
+
+//delivery to subscribers on a tenth of the nodes after a tenth of the other nodes failed without DISCONNECT
+void pubsubRepairCase(int count){
+    const int messages = 100;
+    Cluster cluster(count, 6400);
+    cluster.configure = [&](PeerNetwork &node, int index){
+        node.pingInterval = 1000;
+        node.peerTimeout = 3000;
+    };
+    Error error = cluster.startAll();
+    if(error){
+        fail(str("start failed: ", error.message));
+        return;
+    }
+    std::srand(6);
+    std::vector<char> subscribed(count, false);
+    std::atomic<int> delivered(0);
+    int subscribers = 0;
+    for(int i = 0; i < count; i++){
+        subscribed[i] = std::rand() % 10 == 0;
+        if(subscribed[i]){
+            subscribers++;
+            cluster.nodes[i]->subscribe("churn", [&](const PeerId &source, const std::string &msg){
+                delivered++;
+            });
+        }
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(1000));
+
+    std::vector<int> alive;
+    for(int i = 0; i < count; i++){
+        alive.push_back(i);
+    }
+    int failed = 0;
+    while(failed < count / 10){
+        int index = 1 + std::rand() % (alive.size() - 1);
+        if(!subscribed[alive[index]]){
+            cluster.stop(alive[index]);
+            alive.erase(alive.begin() + index);
+            failed++;
+        }
+    }
+    auto publish = [&](int index, const std::string &msg){
+        cluster.nodes[index]->publish("churn", msg);
+    };
+    publishRun(cluster, alive, messages, 0, "", publish);
+    int beforeRepair = delivered;
+    //the failed peers time out and the trees are repaired
+    std::this_thread::sleep_for(std::chrono::milliseconds(5000));
+    delivered = 0;
+    publishRun(cluster, alive, messages, 0, "", publish);
+    std::cout << "pubsub " << failed << " of " << count << " nodes failed: " << beforeRepair << "/" << subscribers * messages
+        << " delivered right after, " << delivered << "/" << subscribers * messages << " after repair" << std::endl;
+    expect("pubsub delivered after repair", delivered, subscribers * messages, 0.98);
+}
+
+//bytes from one node to another on one stream, written in chunks while at most 1 MB is queued
+void streamCase(int count, int lossPercent){
+    const uint64_t total = 32 * 1024 * 1024;
+    const int chunk = 64 * 1024;
+    Cluster cluster(count, 6800);
+    std::atomic<bool> impaired(false);
+    std::atomic<uint64_t> delivered(0);
+    std::atomic<bool> ordered(true);
+    std::atomic<uint64_t> finished(0);
+    cluster.configure = [&](PeerNetwork &node, int index){
+        node.linkDelay = [&](const Endpoint &ep){
+            if(!impaired){
+                return 0;
+            }
+            thread_local uint32_t state = 1;
+            state = state * 1103515245 + 12345;
+            return (int)(state >> 16) % 100 < lossPercent ? -1 : 0;
+        };
+        node.streamCallback = [&](const PeerId &id, uint32_t stream, std::string_view data, bool fin){
+            uint64_t offset = delivered;
+            for(size_t i = 0; i < data.size(); i++){
+                if(data[i] != (char)((offset + i) % 251)){
+                    ordered = false;
+                    break;
+                }
+            }
+            delivered += data.size();
+            if(fin){
+                finished = steadyMicros();
+            }
+        };
+    };
+    Error error = cluster.startAll();
+    if(error){
+        fail(str("start failed: ", error.message));
+        return;
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(1000));
+    impaired = true;
+
+    auto &source = cluster.nodes[1];
+    PeerId destination = cluster.nodes[count - 1]->localId();
+    std::string data(chunk, ' ');
+    uint64_t datagrams = cluster.sentDatagrams();
+    uint64_t start = steadyMicros();
+    uint32_t stream = source->openStream(destination);
+    for(uint64_t offset = 0; offset < total; offset += chunk){
+        while(source->streamQueued(destination, stream) > 1024 * 1024){
+            std::this_thread::sleep_for(std::chrono::microseconds(200));
+        }
+        for(int i = 0; i < chunk; i++){
+            data[i] = (char)((offset + i) % 251);
+        }
+        source->writeStream(destination, stream, data);
+    }
+    source->closeStream(destination, stream);
+    while(finished == 0 && steadyMicros() - start < 60000000){
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    double seconds = ((finished ? (uint64_t)finished : steadyMicros()) - start) / 1e6;
+    std::cout << "streams 1 stream, " << lossPercent << "% loss: " << delivered << "/" << total << " bytes " << (ordered ? "in order" : "out of order")
+        << ", " << total / seconds / 1e6 << " MB/s, " << (cluster.sentDatagrams() - datagrams) * 1e6 / total << " datagrams per MB" << std::endl;
+    expect(str("streams 1 stream ", lossPercent, "% loss bytes"), delivered, total);
+    expect(str("streams 1 stream ", lossPercent, "% loss in order"), ordered, 1);
+}
+
+//1000 streams from one node to another with the same number of bytes written at once, the bytes of each stream
+//when half of all bytes arrived tell how evenly the streams share the session
+void streamFairnessCase(int count, int streams, int lossPercent){
+    const int bytes = 32 * 1024;
+    Cluster cluster(count, 6800);
+    std::atomic<bool> impaired(false);
+    std::mutex mutex;
+    std::vector<uint64_t> delivered(streams + 1);
+    std::vector<uint64_t> halfway;
+    std::vector<uint64_t> finished;
+    uint64_t total = 0;
+    cluster.configure = [&](PeerNetwork &node, int index){
+        node.linkDelay = [&](const Endpoint &ep){
+            if(!impaired){
+                return 0;
+            }
+            thread_local uint32_t state = 1;
+            state = state * 1103515245 + 12345;
+            return (int)(state >> 16) % 100 < lossPercent ? -1 : 0;
+        };
+        node.streamCallback = [&](const PeerId &id, uint32_t stream, std::string_view data, bool fin){
+            std::lock_guard<std::mutex> lock(mutex);
+            delivered[stream] += data.size();
+            total += data.size();
+            if(halfway.empty() && total >= (uint64_t)streams * bytes / 2){
+                halfway = delivered;
+            }
+            if(fin){
+                finished.push_back(steadyMicros());
+            }
+        };
+    };
+    Error error = cluster.startAll();
+    if(error){
+        fail(str("start failed: ", error.message));
+        return;
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(1000));
+    impaired = true;
+
+    auto &source = cluster.nodes[1];
+    PeerId destination = cluster.nodes[count - 1]->localId();
+    std::string data(bytes, 'x');
+    uint64_t start = steadyMicros();
+    for(int i = 0; i < streams; i++){
+        uint32_t stream = source->openStream(destination);
+        source->writeStream(destination, stream, data);
+        source->closeStream(destination, stream);
+    }
+    while(steadyMicros() - start < 60000000){
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        std::lock_guard<std::mutex> lock(mutex);
+        if(finished.size() == streams){
+            break;
+        }
+    }
+
+    std::lock_guard<std::mutex> lock(mutex);
+    //Jain's index: 1 if all streams got the same share, 1 / streams if one got everything
+    double sum = 0;
+    double squares = 0;
+    uint64_t least = halfway.empty() ? 0 : UINT64_MAX;
+    uint64_t most = 0;
+    for(int i = 1; i <= streams && !halfway.empty(); i++){
+        sum += halfway[i];
+        squares += (double)halfway[i] * halfway[i];
+        least = std::min(least, halfway[i]);
+        most = std::max(most, halfway[i]);
+    }
+    std::sort(finished.begin(), finished.end());
+    auto finishedAt = [&](int p){
+        return finished.empty() ? 0 : (finished[std::min(finished.size() - 1, finished.size() * p / 100)] - start) / 1000.0;
+    };
+    std::cout << "streams " << streams << " streams, " << lossPercent << "% loss: " << finished.size() << "/" << streams
+        << " finished, at half of the bytes per stream min " << least << " max " << most << " Jain index " << (squares > 0 ? sum * sum / (streams * squares) : 0)
+        << ", finished p1 " << finishedAt(1) << " ms, p50 " << finishedAt(50) << " ms, p99 " << finishedAt(99) << " ms, "
+        << (uint64_t)streams * bytes / (finishedAt(100) / 1000) / 1e6 << " MB/s" << std::endl;
+    expect(str("streams ", streams, " streams ", lossPercent, "% loss finished"), finished.size(), streams);
+}
+
+int main(int argc, char *argv[]){
+    std::string scenario = argc > 1 ? argv[1] : "";
+    int count = argc > 2 ? std::stoi(argv[2]) : 100;
+
+    if(scenario.empty() || scenario == "restart"){
+        restartCase(count, false);
+        restartCase(count, true);
+    }
+    if(scenario.empty() || scenario == "join"){
+        joinCase(count);
+    }
+    if(scenario.empty() || scenario == "broadcast"){
+        broadcastCase(count, false);
+        broadcastCase(count, true);
+    }
+    if(scenario.empty() || scenario == "gossip"){
+        for(int size : {1024, 32768, 60000}){
+            for(int loss : {0, 2}){
+                broadcastCase(count, false, 0, size, loss, 20);
+                broadcastCase(count, true, 0, size, loss, 20);
+                broadcastCase(count, true, 200, size, loss, 20);
+            }
+        }
+    }
+    if(scenario.empty() || scenario == "reliable"){
+        for(int loss : {0, 1, 5}){
+            reliableCase(std::min(count, 10), false, 5, loss);
+            reliableCase(std::min(count, 10), true, 5, loss);
+        }
+    }
+    if(scenario.empty() || scenario == "fragment"){
+        for(int loss : {0, 1}){
+            fragmentCase(std::min(count, 10), false, loss);
+            fragmentCase(std::min(count, 10), true, loss);
+        }
+    }
+    if(scenario.empty() || scenario == "coalesce"){
+        for(int delay : {-1, 0, 50, 200, 1000}){
+            coalesceCase(std::min(count, 10), delay);
+        }
+    }
+    if(scenario.empty() || scenario == "binary"){
+        for(int mode : {0, 1, 2}){
+            binaryCase(std::min(count, 10), mode);
+        }
+        packedCase();
+    }
+    if(scenario.empty() || scenario == "shards"){
+        for(int threads : {0, 1, 2, 4}){
+            shardsCase(count, threads);
+        }
+    }
+    if(scenario.empty() || scenario == "proximity"){
+        proximityCase(count, -1);
+        proximityCase(count, 1);
+        proximityCase(count, 3);
+    }
+    if(scenario.empty() || scenario == "direct"){
+        directCase(count, 0);
+        directCase(count, 50);
+    }
+    if(scenario.empty() || scenario == "store"){
+        storeCase(count, 0);
+        storeCase(count, 16);
+    }
+    if(scenario.empty() || scenario == "pubsub"){
+        for(int density : {1, 10, 100}){
+            pubsubCase(count, density);
+        }
+        pubsubRepairCase(count);
+    }
+    if(scenario.empty() || scenario == "streams"){
+        for(int loss : {0, 1}){
+            streamCase(std::min(count, 10), loss);
+        }
+        for(int loss : {0, 1}){
+            streamFairnessCase(std::min(count, 10), 1000, loss);
+        }
+    }
+    return failed ? 1 : 0;
+}
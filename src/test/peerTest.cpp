@@ -20,10 +20,11 @@ void onExit(int sig){
 }
 
 void printInfo(){
-    terminal.print(str("local:\n", hex(net.localId()), " ", net.getPeers()[0].ep.getAddress(), " ", net.getPeers()[0].ep.getPort()));
-    terminal.print(str(net.getPeers().size() - 1, " peer(s):"));
-    for(int i = 1; i < net.getPeers().size(); i++){
-        auto &peer = net.getPeers()[i];
+    std::vector<Peer> peers = net.getPeers();
+    terminal.print(str("local:\n", hex(net.localId()), " ", peers[0].ep.getAddress(), " ", peers[0].ep.getPort()));
+    terminal.print(str(peers.size() - 1, " peer(s):"));
+    for(int i = 1; i < peers.size(); i++){
+        auto &peer = peers[i];
         terminal.print(str(hex(peer.id), " ", peer.ep.getAddress(), " ", peer.ep.getPort()));
     }
 }